@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <brotli/decode.h>
+
+#include "httpData.h"
+#include "zlib.h"
+
+// Undoes a response's Content-Encoding as the body arrives, so it can be
+// inspected without ever being whole in memory. Output is produced into a
+// fixed window and handed to a sink one window at a time, so how much a
+// body decodes to doesn't change how much memory it takes. (Brotli's own
+// history window is sized by the stream, up to 16MB.) Stacked codings are
+// undone one stage at a time, each stage's window feeding the next.
+
+#define BD_WINDOW 16384 // decoded bytes handed to the sink at a time
+
+typedef enum {
+    BD_MORE,  // wants more of the body
+    BD_DONE,  // the coded stream ended
+    BD_LIMIT, // produced as much as it was allowed to
+    BD_ERROR  // not what the encoding said it would be, or one we can't undo
+} BdStatus;
+
+// Gets each run of decoded bytes, the same way chunk data is handed on
+typedef void (*DecodeSink)(void *ctx, const char *data, int len);
+
+// Undoes one coding
+typedef struct {
+    Encoding encoding;
+    bool started;  // the codec's state has been set up
+    z_stream zs;   // gzip and deflate
+    BrotliDecoderState *brotli;
+    char head[1];  // a deflate stream's first byte, if it came on its own
+    int headLength;
+    char window[BD_WINDOW];
+} BdStage;
+
+typedef struct {
+    BdStatus status;
+    long produced; // decoded bytes handed to the sink so far
+    long limit;    // stops once this many have been produced
+    BdStage stages[MAX_CODINGS]; // the last coding applied comes off first
+    int numStages;
+    DecodeSink sink; // where the last stage's output goes, while feeding
+    void *ctx;
+} BodyDecoder;
+
+// encodings are in the order they were applied, like Header's
+void bd_init(BodyDecoder *decoder, const Encoding *encodings, int numEncodings, long limit);
+
+// Decodes len more bytes of the body. Once it's anything but BD_MORE,
+// the rest of the body is ignored. Returns the status
+BdStatus bd_feed(BodyDecoder *decoder, const char *data, int len, DecodeSink sink, void *ctx);
+void bd_term(BodyDecoder *decoder);
@@ -31,6 +31,10 @@ typedef struct CacheKey {
 
 // Cache Methods
 void cache_add(Header *clientHeader, Header *servHeader, int dataSize, DynamicArray *buff, HashTable *cache);
+// Stores a response whose body wasn't framed by a Content-Length (chunked,
+// or cut off by the server closing) with one added, and without its
+// Transfer-Encoding line. body is the decoded data
+void cache_addWithLength(Header *clientHeader, Header *servHeader, DynamicArray *buff, char *body, int bodySize, HashTable *cache);
 CacheObj *cache_get(Header *clientHeader, HashTable *cache);
 
 // Cache object and key helpers
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// Simple Unicode case folding, done while a blacklist is being built so
+// the scan never has to. It covers the scripts that have case and that
+// pages are mostly written in (Latin, Greek, Cyrillic, Armenian), plus the
+// odd symbol that folds into them, like the ohm sign into omega. Every
+// code point folds to one other, never to a longer string, so ß stays ß.
+//
+// The two symbols Unicode folds into ASCII letters, the Kelvin sign and
+// long s, are left out: they'd give every term with a k or an s a second
+// spelling, and a list of plain words a table a third bigger and slower.
+
+#define FOLD_MAX_VARIANTS 4 // code points that fold the same way, at most
+
+// Bytes in the UTF-8 sequence s starts with, or 0 if it isn't a valid
+// one: cut short, overlong, a surrogate or past U+10FFFF
+int fold_decode(const char *s, int len, uint32_t *cp);
+int fold_encode(uint32_t cp, char *out); // bytes written, 1 to 4
+uint32_t fold_codePoint(uint32_t cp);
+// Every code point that folds the same as cp, cp included. Returns how many
+int fold_variants(uint32_t cp, uint32_t *variants);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Decodes a chunked transfer-encoded body as it arrives. The framing (size
+// lines, extensions, trailers) is walked a byte at a time and can be split
+// anywhere across reads. Chunk data is never copied, it's handed to a sink
+// as slices of the input.
+
+#define CD_MAX_SIZE_DIGITS 15 // keeps chunk sizes inside a long
+
+typedef enum {
+    CD_SIZE,          // hex digits of the chunk size
+    CD_SIZE_EXT,      // ";name=value" extensions up to the end of the line
+    CD_SIZE_LF,       // saw the CR that ends the size line
+    CD_DATA,
+    CD_DATA_CR,       // CR LF after the chunk data
+    CD_DATA_LF,
+    CD_TRAILER_START, // a trailer field, or the blank line that ends it all
+    CD_TRAILER,
+    CD_TRAILER_LF,
+    CD_FINAL_LF,
+    CD_DONE,
+    CD_ERROR
+} ChunkState;
+
+typedef struct {
+    ChunkState state;
+    long remaining;  // data bytes left in the current chunk
+    int sizeDigits;
+    long bodySize;   // decoded bytes handed to the sink so far
+} ChunkDecoder;
+
+// Gets each run of decoded body bytes as soon as it's framed
+typedef void (*ChunkSink)(void *ctx, const char *data, int len);
+
+void cd_init(ChunkDecoder *decoder);
+
+// Consumes up to len bytes. Stops at the end of the message, so anything
+// after that belongs to the next one. Returns how many bytes were
+// consumed, or -1 if the framing is malformed. sink may be NULL to just
+// find where the body ends.
+int cd_feed(ChunkDecoder *decoder, const char *buf, int len, ChunkSink sink, void *ctx);
+bool cd_done(ChunkDecoder *decoder);
@@ -1,18 +1,97 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "dynamicArray.h"
 #include "httpData.h"
+#include "scan.h"
 
+// The blacklist as an Aho-Corasick automaton: a trie of the terms, plus a
+// failure link from every node to the longest proper suffix of its path
+// that is also in the trie. Once it's built, the bytes a node has no
+// child for point where following failure links would end up, so text is
+// scanned once with exactly one step per byte, no matter how many terms
+// there are. Terms are UTF-8 and can hold any character, spaces and
+// digits included. Matching ignores case: while the trie is built, each
+// character of a term is added as every code point that folds the same way
+// (caseFold.h), all leading to the same state, so the scan itself never
+// folds anything.
+//
+// The built automaton is one table. Bytes are first mapped to a class: one
+// for each byte some term's spellings use (an ASCII letter's upper and
+// lower case together), and class 0 for everything else, which always goes
+// back to the start. A state is a dense row of numClasses 32-bit entries,
+// and the entries hold the next state's offset rather than its number, so
+// a step is one load from classOf and one from next. A big list's rows
+// don't fit in any cache, though, and almost all of them are deep states
+// with one child, the rest of the row copied from their failure link's. So
+// only the shallowest states, which every word walks through, get rows,
+// as many as a cache sized budget allows. The rest are sparse: their
+// failure link and the few entries where they differ from it, which is
+// looked up instead for any other byte, until a row answers. States where
+// a term ends come last, so spotting a match is still one compare, and a
+// list small enough is all rows.
+//
+// Every match starts with the first two bytes of one of the terms'
+// spellings, so while the automaton is at the start state, text is skipped
+// with the vectorized pair search and only walked from where a pair turns
+// up. That only pays while pairs are rare; a list whose terms start with
+// too many different pairs, or that has one byte terms, is walked a byte
+// at a time. So is a stretch of text where the searches keep landing a few
+// bytes on, like a page full of the list's own words.
+//
+// A built filter can also be saved compiled (tools/compileBlacklist.c
+// does that). The table holds offsets rather than pointers, so the file is
+// just the table with a header in front. cf_create maps it read-only
+// instead of building anything, and processes that load the same file
+// share its pages. It's in the machine's own byte order and layout, so
+// compile it where it's going to run.
+//
+// A filter can be replaced while bodies are still being scanned with it,
+// so it's reference counted: every stream holds a reference until it's
+// done, and the filter is freed when the last one lets go.
 typedef struct ContentFilter {
-    struct ContentFilter *trie[26]; // one for each letter
-    bool isComplete;
+    uint8_t classOf[256];
+    int numClasses;
+    int numStates;
+    uint32_t sparseFrom; // dense rows first, the start state's at 0, then sparse states
+    uint32_t acceptFrom; // states at or past this offset mean a match
+    uint32_t numEntries; // how long next is
+    uint32_t *next;
+    bool prefilter;      // skip to the pairs between words
+    PairSet pairs;       // each term's first two bytes, in every spelling
+    int refs;
+    void *mapped;        // the compiled file next points into, or NULL
+    size_t mappedSize;
 } ContentFilter;
 
+// Scans a body that arrives a piece at a time. The automaton's state is
+// kept between pieces, so a term split across two reads (or two chunks)
+// is still found, and no piece is ever looked at twice.
+typedef struct {
+    ContentFilter *filter;
+    uint32_t state; // offset of the current state
+    bool matched;
+    long scanned; // bytes fed so far
+    int walkFor;  // bytes still to walk before searching for pairs again
+} FilterStream;
+
+void cf_streamInit(FilterStream *stream, ContentFilter *filter); // takes a reference
+// Returns true once a term has been seen; anything fed after that is ignored
+bool cf_streamFeed(FilterStream *stream, const char *data, int size);
+bool cf_streamVerdict(FilterStream *stream); // true if the body should be blocked
+void cf_streamTerm(FilterStream *stream);
+
+// Both start with one reference, the caller's. fileName is either a list
+// of terms, one per line, or a compiled filter
 ContentFilter *cf_create(char *fileName);
-ContentFilter *cf_init();
-void cf_print(ContentFilter *filter);
+ContentFilter *cf_init(); // matches nothing
+ContentFilter *cf_retain(ContentFilter *filter);
+void cf_release(ContentFilter *filter); // deletes it once nothing holds it
+bool cf_save(ContentFilter *filter, const char *fileName); // compiled, for cf_create to map
+long cf_tableBytes(ContentFilter *filter); // what the scan reads from
+void cf_print(ContentFilter *filter); // every term, and any path with a term at its end, in one spelling
 bool cf_searchText(ContentFilter *filter, char *text, int size);
 bool cf_searchString(ContentFilter *filter, char *string);
-void cf_delete(ContentFilter *filter);
+void cf_delete(ContentFilter *filter); // regardless of references
@@ -1,12 +1,24 @@
 #pragma once
 
+#include <sys/uio.h>
+
+// Seconds writevAll waits for a full socket to take more before giving up
+// on whoever's on the other end
+#define WRITE_TIMEOUT 10
+
 typedef struct DynamicArray {
   char *buff;
   int size, maxSize;
 } DynamicArray;
 
 int readAll(int sd, DynamicArray *buffer);
+// One read of at most most bytes, for when a fast sender shouldn't get to
+// fill the buffer all at once
+int readSome(int sd, DynamicArray *buffer, int most);
+ssize_t writevAll(int sd, struct iovec *iov, int iovcnt);
+ssize_t writeAll(int sd, const char *data, int len);
 void da_shift(DynamicArray *buffer, int amount);
+void da_append(DynamicArray *buffer, const char *data, int len);
 void da_init(DynamicArray *buffer, int maxSize);
 void da_clear(DynamicArray *buffer);
 void da_term(DynamicArray *buffer);
\ No newline at end of file
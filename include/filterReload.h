@@ -0,0 +1,45 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "contentFilter.h"
+
+// Rebuilds the blacklist when its file changes, or on SIGHUP, without
+// stopping the proxy. The list can be kept as text, or compiled (see
+// tools/compileBlacklist.c); both files are watched, and whichever was
+// written last is the one used, so editing the text list still counts
+// while a compiled one is around. Building a big list takes a while, so it's done on
+// a thread of its own; the event loop only ever swaps a finished filter
+// in. Scans already under way hold a reference to the filter they started
+// with and finish on it, and it's freed once they're done.
+//
+// Everything the event loop needs to hear about comes in on file
+// descriptors added to its epoll instance, so it never blocks on a build.
+
+typedef struct {
+    char *fileNames[2];      // the text list, then the compiled one
+    char *baseNames[2];      // what they show up as in inotify events
+    int watchFd;             // inotify on their directories
+    int signalFd;            // SIGHUP
+    int requestFd;           // eventfd the loop bumps to ask for a build
+    int readyFd;             // eventfd the builder bumps when one's done
+    pthread_t builder;
+    bool running;            // builder was started
+    bool stopping;           // tells the builder to finish up
+    pthread_mutex_t lock;
+    ContentFilter *ready;    // built but not swapped in yet, guarded by lock
+} FilterReloader;
+
+// Blocks SIGHUP (so it has to be called before any other thread starts)
+// and adds the reloader's descriptors to epollfd. Returns false if any of
+// it couldn't be set up; the list then just never reloads
+bool fr_init(FilterReloader *reloader, const char *textFile, const char *compiledFile, int epollfd);
+// Whichever of the two was modified last, or the one that's readable.
+// NULL if neither is
+const char *fr_pick(const char *textFile, const char *compiledFile);
+// Call with every ready descriptor. Returns false if it isn't one of the
+// reloader's. When a new filter is ready, *filter is released and
+// replaced with it
+bool fr_handle(FilterReloader *reloader, int fd, ContentFilter **filter);
+void fr_term(FilterReloader *reloader);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "httpParser.h"
+
+// Edits to a parsed header, recorded against the buffer it was parsed from
+// instead of being applied to it. The buffer is never moved or written to:
+// the edited header comes out as iovecs over the kept parts of it and the
+// added text, ready to go out with one writev.
+
+#define HR_MAX_ADDED 8 // lines added to a header, like Via and Age
+// Every field line can be removed, and a line only goes once, so removing
+// never runs out of room
+#define HR_MAX_EDITS (HP_MAX_FIELDS + HR_MAX_ADDED)
+#define HR_MAX_IOVECS (2 * HR_MAX_EDITS + 1) // a kept run and some text per edit, plus the tail
+#define HR_SCRATCH 512 // room for the lines hr_addField formats
+
+typedef struct {
+    int offset;       // where in the original header it applies
+    int removeLength; // original bytes dropped from there, 0 for an add
+    const char *text; // what goes in their place
+    int textLength;
+} HeaderEdit;
+
+typedef struct {
+    const char *buf;
+    int headerLength;
+    int end; // start of the blank line, where added lines go
+    HeaderEdit edits[HR_MAX_EDITS];
+    int numEdits;
+    char scratch[HR_SCRATCH];
+    int scratchUsed;
+} HeaderRewrite;
+
+void hr_init(HeaderRewrite *rw, const char *buf, int headerLength);
+
+// Lines are the HttpField line slices, line ending included. Text that's
+// passed in isn't copied, so it has to outlive the rewrite. These return
+// false if there's no room left for the edit
+bool hr_remove(HeaderRewrite *rw, HttpSlice line);
+bool hr_replace(HeaderRewrite *rw, HttpSlice line, const char *text, int length);
+bool hr_add(HeaderRewrite *rw, const char *text, int length);
+bool hr_addField(HeaderRewrite *rw, const char *name, const char *value); // formats "name: value"
+
+// Takes out Connection, every field it names, and the other hop-by-hop
+// fields, which are about one connection and mustn't be passed on.
+// Transfer-Encoding, Content-Length and Host stay even if Connection names
+// them, since bodies are relayed with their framing and requests need
+// their host
+void hr_stripHopByHop(HeaderRewrite *rw, const HttpMessage *msg);
+
+int hr_length(HeaderRewrite *rw); // size of the edited header
+int hr_iovecs(HeaderRewrite *rw, struct iovec *iov); // fills at most HR_MAX_IOVECS, returns how many
+void hr_copy(HeaderRewrite *rw, char *out); // writes hr_length bytes
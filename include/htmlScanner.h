@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "dynamicArray.h"
+
+// Picks out of a page, as it streams past, the URLs of what it loads
+// straight away: images, stylesheets, icons and preloads, scripts, and
+// whatever its CSS points at. They can then be fetched before the client
+// asks for them. Stylesheets themselves get looked at the same way.
+//
+// It's a small tokenizer that follows the page's tags, attributes,
+// comments, and the text of elements like <script> that can't hold tags.
+// It keeps its place from one piece to the next, so a piece can end
+// anywhere, even partway through an attribute. Text between tags is
+// skipped with the vectorized scanner.
+//
+// URLs are resolved against the page's, or its <base href>, the way a
+// browser would write them in its request, and only http ones are kept,
+// since those are all the prefetcher can fetch.
+
+#define HS_MAX_URLS 64    // collected per page
+#define HS_MAX_URL 2048   // longest URL kept, once resolved
+#define HS_MAX_VALUE 2048 // longest attribute value or CSS url() looked at
+#define HS_MAX_NAME 16    // tag and attribute names past this don't matter
+
+typedef enum {
+    HS_NONE, // not something that loads anything
+    HS_HTML,
+    HS_CSS
+} HsKind;
+
+typedef enum {
+    HS_DATA,
+    HS_TAG_OPEN,        // after '<'
+    HS_TAG_NAME,
+    HS_BEFORE_ATTR_NAME,
+    HS_ATTR_NAME,
+    HS_AFTER_ATTR_NAME,
+    HS_BEFORE_ATTR_VALUE,
+    HS_ATTR_VALUE,
+    HS_MARKUP,          // after "<!"
+    HS_COMMENT_START,   // after "<!-"
+    HS_COMMENT,
+    HS_BOGUS,           // end tags, doctypes and the like, up to their '>'
+    HS_RAW_TEXT         // in a <script>, <style> or the like, up to its end tag
+} HsState;
+
+typedef enum {
+    HS_TAG_OTHER,
+    HS_TAG_IMG,
+    HS_TAG_LINK,
+    HS_TAG_SCRIPT,
+    HS_TAG_BASE,
+    HS_TAG_STYLE,
+    HS_TAG_TEXT         // other elements whose text can't hold tags
+} HsTag;
+
+// Attributes worth keeping until the end of their tag
+typedef enum {
+    HS_ATTR_SRC,
+    HS_ATTR_SRCSET,
+    HS_ATTR_HREF,
+    HS_ATTR_REL,
+    HS_ATTR_STYLE,
+    HS_ATTR_COUNT,
+    HS_ATTR_NONE = -1
+} HsAttr;
+
+typedef enum {
+    HS_CSS_TEXT,
+    HS_CSS_URL_START,   // after "url("
+    HS_CSS_IMPORT,      // after "@import"
+    HS_CSS_QUOTED,
+    HS_CSS_BARE
+} HsCssState;
+
+typedef struct {
+    HsCssState state;
+    int urlMatched;     // bytes of "url(" just seen
+    int importMatched;  // of "@import"
+    char quote;
+    int length;         // of url; past HS_MAX_VALUE it's too long to keep
+    char url[HS_MAX_VALUE];
+} HsCss;
+
+typedef struct {
+    HsKind kind;
+    HsState state;
+    char base[HS_MAX_URL]; // the page's URL, or its <base href>
+    bool haveBase;         // later <base> tags don't count
+
+    // The tag being read
+    HsTag tag;
+    char name[HS_MAX_NAME]; // of the tag, then of each attribute, lower case
+    int nameLength;
+    HsAttr attr;           // the attribute being read, if it's kept
+    char quote;            // around its value, or 0 if there aren't any
+    char values[HS_ATTR_COUNT][HS_MAX_VALUE];
+    int valueLength[HS_ATTR_COUNT]; // -1 if the tag doesn't have it
+    int dashes;            // ending the comment so far
+    const char *rawEnd;    // name of the tag that ends the raw text
+    int rawMatched;        // bytes of "</" and rawEnd just seen
+    HsCss css;             // a stylesheet, or a <style>'s text
+
+    DynamicArray urls;     // NUL terminated, one after another
+    int numUrls;
+} HtmlScanner;
+
+// What a response with that Content-Type value is; NULL if there isn't one
+HsKind hs_kindOf(const char *contentType, int length);
+// pageUrl is where the page came from, for resolving its links against
+void hs_init(HtmlScanner *scanner, HsKind kind, const char *pageUrl);
+void hs_feed(HtmlScanner *scanner, const char *data, int len);
+// Walks the URLs found so far: pass NULL to get the first, then the last
+// one returned. NULL once there are no more
+const char *hs_nextUrl(HtmlScanner *scanner, const char *prev);
+void hs_term(HtmlScanner *scanner);
+// Resolves the refLength bytes of ref against base into out, and puts it
+// the way a browser would ask for it: dot segments gone, the host in
+// lower case, no default port or fragment, and odd bytes escaped. Returns
+// its length, or -1 if it isn't http, or doesn't fit in outSize
+int hs_resolve(const char *base, const char *ref, int refLength, char *out, int outSize);
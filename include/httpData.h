@@ -3,20 +3,42 @@
 #include <stdbool.h>
 #include <time.h>
 #include "dynamicArray.h"
+#include "httpParser.h"
+#include "responseQueue.h"
 
 typedef enum {
     GET,
     CONNECT,
-    POST
+    POST,
+    HEAD,
+    PUT,
+    DELETE,
+    OPTIONS,
+    PATCH,
+    OTHER_METHOD // forwarded like the rest, we just don't know its name
 } Method;
 
 typedef enum {
     NO_ENCODE,
-    GZIP
+    GZIP,
+    DEFLATE,       // zlib wrapped as the spec says, or raw as some servers send it
+    BROTLI,
+    OTHER_ENCODING // one we don't know
 } Encoding;
 
+#define MAX_CODINGS 4 // stacked Content-Encodings undone; past this it's OTHER_ENCODING
+
+// How the end of a message's body is found
+typedef enum {
+    BODY_NONE,       // requests without one, HEAD responses, 1xx/204/304
+    BODY_LENGTH,     // Content-Length
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE // responses with neither: the server closing ends it
+} BodyFraming;
+
 typedef struct {
     Method method;
+    int status; // responses only
     char url[2048];
     char port[8];
     char domain[128];
@@ -24,11 +46,24 @@ typedef struct {
     int headerLength;
     bool chunkedEncoding;
     int contentLength;
-    Encoding encoding;
+    BodyFraming framing;
+    bool keepAlive; // the connection can carry another message after this one
+    Encoding encodings[MAX_CODINGS]; // in the order they were applied, identity left out
+    int numEncodings;
     time_t age;
+    HttpField fields[HDR_COUNT]; // by name, all zero if the field isn't there
 } Header;
 
-char* uncompressGzip(char *outBuff, int *outSize, char *inBuff, int inSize);
+// The field with that name, or NULL if the header doesn't have one
+static inline HttpField *getField(Header *header, HeaderName id) {
+    return header->fields[id].line.length > 0 ? &header->fields[id] : NULL;
+}
+
+// Splits "host[:port]" between start and end into domain and port
+bool splitAuthority(char *buf, int start, int end, char *domain, char *port, const char *defaultPort);
+// Feeds the parser what's in buff, and once the header is complete, pulls
+// out the fields the proxy uses and works out how the body is framed
+HpStatus parseHeader(Header* outHeader, HttpParser* parser, DynamicArray* buff);
 
 typedef struct {
     int first;
@@ -43,6 +78,8 @@ bool connSockCmp(ConnectionData *data, int *sock);
 typedef struct {
     int sock;
     DynamicArray buffer;
+    HttpParser parser; // request header parsed so far
+    ResponseQueue pipeline; // requests sent ahead whose responses are still due
 } ClientData;
 
 ClientData *createClientData(int sock);
@@ -53,22 +90,15 @@ typedef struct {
     char *domain;
     int sock;
     DynamicArray buffer;
+    HttpParser parser; // response header parsed so far
+    bool busy; // a pipelined request's response is still due on it
 } ServerData;
 
 ServerData *createServerData(int sock, char *domain);
 void termServerData(ServerData *data);
 bool servSockCmp(ServerData *data, int *sock);
 bool servDomainCmp(ServerData *data, char *domain);
-
-typedef struct {
-    char *url;
-    char *content;
-    int contentLen;
-} PrefetchData;
-
-PrefetchData *createPrefetchData(char *domain, DynamicArray *buff);
-void termPrefetchData(PrefetchData *data);
-bool prefetchUrlCmp(PrefetchData *data, char *url);
+bool servIdleDomainCmp(ServerData *data, char *domain); // same, but not busy
 
 
 // This is the overall data list data structure.
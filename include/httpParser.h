@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define HP_MAX_FIELDS 64     // header lines we keep slices for
+#define HP_MAX_LINE 8192     // longest single header line we accept
+#define HP_MAX_HEADER 65536  // longest header block we accept
+
+// A view into the buffer that was parsed. The parser never copies or
+// modifies the buffer, it only records where things are.
+typedef struct {
+    int offset;
+    int length;
+} HttpSlice;
+
+// Header names the proxy looks at. The parser tags every field with one of
+// these, so later stages can switch on it instead of comparing strings.
+typedef enum {
+    HDR_OTHER, // anything we don't have a name for
+    HDR_TE,
+    HDR_AGE,
+    HDR_VIA,
+    HDR_HOST,
+    HDR_ETAG,
+    HDR_DATE,
+    HDR_VARY,
+    HDR_RANGE,
+    HDR_COOKIE,
+    HDR_PRAGMA,
+    HDR_EXPECT,
+    HDR_EXPIRES,
+    HDR_UPGRADE,
+    HDR_TRAILER,
+    HDR_LOCATION,
+    HDR_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_USER_AGENT,
+    HDR_SET_COOKIE,
+    HDR_CONTENT_TYPE,
+    HDR_CACHE_CONTROL,
+    HDR_LAST_MODIFIED,
+    HDR_IF_NONE_MATCH,
+    HDR_CONTENT_LENGTH,
+    HDR_ACCEPT_ENCODING,
+    HDR_CONTENT_ENCODING,
+    HDR_PROXY_CONNECTION,
+    HDR_TRANSFER_ENCODING,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_PROXY_AUTHENTICATE,
+    HDR_PROXY_AUTHORIZATION,
+    HDR_COUNT
+} HeaderName;
+
+typedef struct {
+    HttpSlice name;
+    HttpSlice value; // surrounding whitespace trimmed
+    HttpSlice line;  // the whole line, including its line ending
+    HeaderName id;
+} HttpField;
+
+typedef struct {
+    bool isResponse;
+    HttpSlice startLine;
+    HttpSlice method;  // requests only
+    HttpSlice target;  // requests only
+    HttpSlice version;
+    HttpSlice status;  // responses only
+    HttpSlice reason;  // responses only
+    HttpField fields[HP_MAX_FIELDS];
+    int numFields;
+    int headerLength; // including the blank line
+} HttpMessage;
+
+typedef enum {
+    HP_NEED_MORE, // the blank line hasn't arrived yet
+    HP_COMPLETE,
+    HP_ERROR      // malformed, or over one of the limits above
+} HpStatus;
+
+// Keeps its place between reads, so a header that trickles in over many
+// TCP segments is still only scanned once. Everything is stored as offsets,
+// so the buffer may be reallocated between calls, but it must not be
+// shifted until the header is complete.
+typedef struct {
+    HttpMessage msg;
+    HpStatus status;
+    int pos;      // start of the line we're in the middle of
+    int scanned;  // everything before this has already been looked at
+    int colon;    // first colon in the current line, or -1
+    bool sawStartLine;
+} HttpParser;
+
+void hp_init(HttpParser *parser);
+
+// Picks up where the last call left off. buf is the whole buffer the header
+// is being read into, including the bytes from earlier calls.
+HpStatus hp_feed(HttpParser *parser, const char *buf, int size);
+
+// One-shot version for a buffer that's already been read.
+// Returns the header length once the blank line has been seen, 0 if buf
+// doesn't hold the whole header yet, and -1 if the header is malformed or
+// goes over one of the limits above.
+int hp_parse(HttpMessage *msg, const char *buf, int size);
+
+// Maps a header name to its id with one table lookup and one compare,
+// HDR_OTHER if it isn't one we know
+HeaderName hp_lookupName(const char *name, int length);
+const char *hp_headerName(HeaderName id); // canonical spelling
+
+// Helpers for looking at slices without copying them out
+bool hp_sliceEquals(const char *buf, HttpSlice slice, const char *str); // case-sensitive
+bool hp_sliceEqualsNoCase(const char *buf, HttpSlice slice, const char *str);
+bool hp_sliceHasToken(const char *buf, HttpSlice slice, const char *token); // comma separated, no case
+long hp_sliceToLong(const char *buf, HttpSlice slice, int base); // -1 if not a number
+int hp_findField(HttpMessage *msg, const char *buf, const char *name); // index, or -1
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+
+// What the prefetcher brought in, waiting for a client to ask for it. Kept
+// by URL in a hash table, and on a list from most to least recently used:
+// past maxBytes, the least recently used go first. Nothing revalidates
+// a prefetched response, so it's only good for PS_TTL seconds after it
+// came in. Lookups never return one older than that, and ps_expire drops
+// them, with the event loop waking up for it when nothing else happens.
+
+#define PS_TTL 60 // seconds a response is served for
+#define PS_MIN_BUCKETS 64
+
+typedef struct PsEntry {
+    char *url;
+    char *content;                   // the whole response, as it came
+    int contentLen;
+    time_t fetchedAt;
+    struct PsEntry *chain;           // next in its bucket
+    struct PsEntry *newer, *older;   // by last use
+    struct PsEntry *earlier, *later; // by when they came in
+} PsEntry;
+
+typedef struct {
+    PsEntry **buckets;
+    int numBuckets;
+    int count;
+    long bytes, maxBytes; // entries and their URLs included
+    PsEntry *newest, *oldest;     // last used most and least recently
+    PsEntry *firstIn, *lastIn;    // first to expire, and last
+} PrefetchStore;
+
+void ps_init(PrefetchStore *store, long maxBytes);
+// Keeps a copy of message as url's response, in place of any before it,
+// making room for it if it has to. One too big for the whole store isn't
+// kept
+void ps_add(PrefetchStore *store, const char *url, const char *message, int length);
+// url's response, counted as a use, or NULL if there isn't one young enough
+PsEntry *ps_find(PrefetchStore *store, const char *url);
+void ps_remove(PrefetchStore *store, const char *url);
+// Drops every response past its time. Returns how many milliseconds until
+// the next one is, for epoll_wait, or -1 if there's nothing to wait for
+int ps_expire(PrefetchStore *store);
+void ps_term(PrefetchStore *store);
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "chunkDecoder.h"
+#include "contentFilter.h"
+#include "dynamicArray.h"
+#include "httpData.h"
+#include "prefetchStore.h"
+#include "workerPool.h"
+
+// Fetches the images a page links to before the client asks for them,
+// without holding anything else up. URLs wait in a queue per host and go
+// out over a few keep-alive connections to it, so a page with a hundred
+// images costs a handful of handshakes rather than a hundred, and doesn't
+// hit one server with all of them at once. Once a server has shown it
+// keeps connections open, a few requests are sent on each ahead of their
+// responses. Connections left idle are kept for the next page for a while.
+//
+// Connects are non-blocking and everything after them is driven by epoll.
+// Looking up a host's address can block, so that's done on a worker, and
+// the address is kept for the next page.
+//
+// A fetched image only counts if the whole response came back with a
+// 200, and its body, decoded, doesn't match the content filter. It then
+// goes in the store for serveRequests to answer from as it is, without
+// looking at it again.
+
+#define PF_MAX_CONNECTIONS 16 // open, idle ones included, across every host
+#define PF_MAX_PER_HOST 4   // connections to any one host
+#define PF_PIPELINE_DEPTH 4 // requests on a connection whose responses are due
+#define PF_MAX_QUEUED 256   // waiting for room; past this, new URLs are dropped
+#define PF_MAX_LOOKUPS 2    // on workers at once, so bodies still get the rest
+#define PF_MAX_HOSTS 64     // addresses kept; idle hosts make way for new ones
+#define PF_MAX_BYTES (4 * 1024 * 1024) // bigger images aren't worth holding
+#define PF_MAX_TRIES 2      // sends of a request the server hung up on unanswered
+#define PF_TIMEOUT 10       // seconds a connection owing responses can go quiet
+#define PF_IDLE_TIMEOUT 15  // seconds an idle connection is kept for
+#define PF_ADDRESS_TTL 300  // seconds a looked up address is used for
+
+typedef enum {
+    PF_UNRESOLVED,
+    PF_RESOLVING,  // a worker has it
+    PF_RESOLVED,
+    PF_UNREACHABLE // the lookup failed; its queue is dropped
+} PfHostState;
+
+struct Prefetcher;
+
+typedef struct PfFetch {
+    char *url;
+    DynamicArray request;  // the GET
+    int tries;             // times it's been sent
+    struct PfFetch *next;  // in its host's queue, or its connection's pipeline
+} PfFetch;
+
+typedef struct PfConn {
+    struct PfHost *host;
+    int sock;
+    bool connected;
+    unsigned events;       // what epoll is watching it for
+    time_t lastProgress;   // last connected, wrote or read, or went idle
+    DynamicArray out;      // requests still to be written
+    PfFetch *pipeline, *lastPipelined; // sent, oldest (next to be answered) first
+    int depth;             // fetches in pipeline
+    bool keepsAlive;       // the server said so, so requests can go ahead
+    bool closing;          // the server will hang up after this response
+    DynamicArray buffer;   // responses so far
+    HttpParser parser;     // the oldest one's header parsed so far
+    Header header;
+    bool haveHeader;
+    ChunkDecoder chunks;
+    int framed;            // bytes of buffer the chunk decoder has seen
+} PfConn;
+
+typedef struct PfHost {
+    struct Prefetcher *owner;
+    char name[128];
+    char port[8];
+    PfHostState state;
+    struct sockaddr_storage addr; // written by the worker while resolving
+    socklen_t addrLength;
+    bool found;                   // same
+    time_t resolvedAt;
+    int numConns;
+    PfFetch *queued, *lastQueued;
+    struct PfHost *next;
+} PfHost;
+
+typedef struct Prefetcher {
+    int epollfd;
+    WorkerPool *workers; // where lookups go; done inline if it's full
+    PfHost *hosts;
+    int numHosts;
+    PfConn *conns[PF_MAX_CONNECTIONS];
+    int numConns;
+    int numQueued;
+    int lookups;         // hosts with a worker resolving them
+} Prefetcher;
+
+void pf_init(Prefetcher *pf, int epollfd, WorkerPool *workers);
+// Queues url to be fetched once a connection has room. Does nothing if it
+// isn't plain http, is already in store, queued or under way, or the
+// queue is full
+void pf_queue(Prefetcher *pf, const char *url, PrefetchStore *store);
+// Call with every ready descriptor. Returns false if it isn't one of the
+// prefetcher's; otherwise moves that connection along, and adds the
+// images it finished that filter lets through to store
+bool pf_handle(Prefetcher *pf, int fd, PrefetchStore *store, ContentFilter *filter);
+// Whether the body of message, a whole response with header parsed from
+// it, passes filter once it's unchunked and decoded. One that can't be
+// decoded, or decodes to more than PF_MAX_BYTES, can't be scanned to the
+// end, so it doesn't
+bool pf_bodyPasses(const Header *header, const char *message, int messageSize, ContentFilter *filter);
+// Call after the workers are stopped, since one may be resolving a host
+void pf_term(Prefetcher *pf);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Requests a client pipelined, in the order it sent them. Every request
+// that can be is sent upstream before any response is read, and the
+// responses are then read and written back in this order, so the client
+// still gets them in the order it asked.
+
+#define MAX_PIPELINE 16 // requests sent ahead per client
+
+typedef struct {
+    bool sent;       // already written upstream; false if it's answered locally
+    int serverSock;  // the connection its response will come back on
+    bool reusedSock; // came from the pool, so it may have gone stale
+} PendingRequest;
+
+typedef struct {
+    PendingRequest slots[MAX_PIPELINE];
+    int head;
+    int count;
+} ResponseQueue;
+
+void rq_init(ResponseQueue *queue);
+bool rq_push(ResponseQueue *queue, PendingRequest request); // false if full
+bool rq_pop(ResponseQueue *queue, PendingRequest *out);     // false if empty
+bool rq_empty(ResponseQueue *queue);
+bool rq_full(ResponseQueue *queue);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Vectorized search for bytes that are any of a small set of delimiters.
+// The best implementation the CPU supports is picked at runtime, with a
+// plain table lookup as the fallback.
+
+#define SCAN_MAX_SET 16
+
+typedef struct {
+    char bytes[SCAN_MAX_SET];
+    int count;
+    bool member[256]; // for the scalar path and the unaligned tail
+} ByteSet;
+
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE42,
+    SCAN_AVX2
+} ScanImpl;
+
+// Walks every delimiter in a buffer. Each 64 byte block is turned into a
+// bitmask of hits with a few vector compares, and then hits are handed out
+// one at a time from the mask. This is much cheaper than calling
+// scan_findAny once per hit when the hits are close together, like the
+// colons and newlines in a header.
+typedef struct {
+    const char *buf;
+    int len;
+    int blockStart; // offset of the block that mask covers
+    uint64_t mask;  // hits in that block we haven't handed out yet
+    const ByteSet *set;
+    uint64_t (*blockMask)(const char *block, const ByteSet *set);
+} ScanCursor;
+
+// Two byte pairs, found without regard to case, Teddy style. Both bytes
+// are folded by setting their 0x20 bit, which lowercases letters and, for
+// other bytes, only ever adds pairs, so a caller that checks what it finds
+// misses nothing. Each pair goes in one of 8 buckets by its first byte,
+// and every byte's buckets are looked up by its low and high nibble with a
+// shuffle, 16 or 32 bytes at a time; a byte where its own buckets (as a
+// first byte) and the next byte's (as a second) overlap might start a
+// pair. Those are then checked against the exact set, so every
+// implementation finds the same pairs.
+typedef struct {
+    uint8_t firstLo[16], firstHi[16];   // buckets a first byte's nibbles can be in
+    uint8_t secondLo[16], secondHi[16]; // same for second bytes
+    uint64_t member[128][2]; // bit b of member[a] is the pair of folded bytes numbered a and b
+    int count;               // distinct pairs
+} PairSet;
+
+void scan_initSet(ByteSet *set, const char *bytes); // bytes is NUL terminated
+void scan_initPairs(PairSet *set);
+void scan_addPair(PairSet *set, char first, char second);
+ScanImpl scan_bestImpl();
+const char *scan_implName(ScanImpl impl);
+
+// Pointer to the first byte in buf[0, len) that is in set, or NULL
+const char *scan_findAny(const char *buf, int len, const ByteSet *set);
+
+// Pointer to the first byte of the first pair in buf[0, len), or NULL
+const char *scan_findPair(const char *buf, int len, const PairSet *set);
+
+// Next delimiter in buf[0, len), or NULL when there are no more
+void scan_cursorInit(ScanCursor *cursor, const char *buf, int len, const ByteSet *set);
+uint64_t scan_nextBlock(ScanCursor *cursor); // refills mask, 0 at the end
+
+// This gets called for every delimiter, so it's inlined and only drops
+// into the library when a block runs out of hits
+static inline const char *scan_next(ScanCursor *cursor) {
+    if (cursor->mask == 0 && scan_nextBlock(cursor) == 0)
+        return NULL;
+
+    int bit = __builtin_ctzll(cursor->mask);
+    cursor->mask &= cursor->mask - 1;
+    return cursor->buf + cursor->blockStart + bit;
+}
+
+// Same as above, but force one implementation. Used to benchmark and
+// cross-check them
+const char *scan_findAnyWith(ScanImpl impl, const char *buf, int len, const ByteSet *set);
+void scan_cursorInitWith(ScanImpl impl, ScanCursor *cursor, const char *buf, int len, const ByteSet *set);
+const char *scan_findPairWith(ScanImpl impl, const char *buf, int len, const PairSet *set);
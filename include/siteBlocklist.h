@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dynamicArray.h"
+
+// Sites that are refused before any connection to them is made. Each line
+// of the list is a domain, which blocks that host and every host under
+// it, or a domain followed by a path, which only blocks URLs on those
+// hosts whose path starts with it:
+//
+//   ads.example.com
+//   example.net/banners/
+//
+// Domains are indexed by a hash of their bytes taken from the end, so a
+// lookup hashes the host once, right to left, and at each dot it has the
+// hash of the suffix from there on and probes the table with it. That's
+// one probe per label of the host, however long the list is.
+
+typedef struct {
+    uint64_t hash;   // of the domain, read from its end
+    int name;        // offset of the domain in names, -1 for an empty slot
+    int nameLength;
+    bool everything; // the whole domain is blocked, not just some paths
+    int firstPath;   // index into paths, or -1
+} SbSlot;
+
+typedef struct {
+    int prefix;      // offset in names
+    int length;
+    int next;        // the domain's next path, or -1
+} SbPath;
+
+typedef struct {
+    SbSlot *slots;
+    int numSlots;    // a power of two, kept at least twice numDomains
+    int numDomains;
+    SbPath *paths;
+    int numPaths, maxPaths;
+    DynamicArray names; // domains (lowercased) and paths, NUL terminated
+} SiteBlocklist;
+
+SiteBlocklist *sb_create(const char *fileName); // empty if it can't be read
+void sb_add(SiteBlocklist *list, const char *rule); // one line of the list
+// host is matched without regard to case, and path (which may be NULL,
+// for a tunnel, where only whole domains apply) exactly
+bool sb_blocks(SiteBlocklist *list, const char *host, const char *path);
+bool sb_blocksUrl(SiteBlocklist *list, const char *url); // an http:// URL
+void sb_delete(SiteBlocklist *list);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// A few threads for work too slow to do on the event loop, like decoding
+// and scanning a big body, so one big page doesn't hold up every other
+// client. Jobs wait in a bounded queue. When it's full wp_submit says so,
+// and the caller does the work itself: a flood of big responses then
+// slows down to what the loop can do, rather than queuing without end.
+//
+// A job that wants the loop to hear it finished returns true. Its done
+// function is then called on the loop, from wp_handle, once the pool's
+// eventfd comes up in epoll, so it can touch anything the loop owns.
+
+#define WP_MAX_THREADS 16
+#define WP_MAX_JOBS 256 // submitted and not yet handed back to the loop
+
+typedef bool (*WorkFunc)(void *ctx); // on a worker; true to have done called
+typedef void (*DoneFunc)(void *ctx); // on the loop
+
+typedef struct {
+    WorkFunc work;
+    DoneFunc done;
+    void *ctx;
+} WpJob;
+
+typedef struct {
+    pthread_t threads[WP_MAX_THREADS];
+    int numThreads;          // 0 if none could be started; everything's then done inline
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     // a job was queued, or the pool is stopping
+    WpJob queue[WP_MAX_JOBS]; // waiting for a thread, guarded by lock
+    int head, numQueued;
+    WpJob finished[WP_MAX_JOBS]; // waiting for the loop, guarded by lock
+    int numFinished;
+    int outstanding;         // jobs submitted and not done with yet
+    int doneFd;              // eventfd bumped when something's finished
+    bool stopping;
+} WorkerPool;
+
+// Starts up to threads workers and adds the pool's eventfd to epollfd.
+// Returns false if it couldn't; wp_submit then always refuses
+bool wp_init(WorkerPool *pool, int threads, int epollfd);
+// Queues work(ctx). False if the pool is full (or has no threads), and
+// nothing was queued
+bool wp_submit(WorkerPool *pool, WorkFunc work, DoneFunc done, void *ctx);
+// Call with every ready descriptor. Returns false if it isn't the pool's;
+// otherwise runs the done functions of whatever finished
+bool wp_handle(WorkerPool *pool, int fd);
+void wp_term(WorkerPool *pool); // jobs still queued are dropped
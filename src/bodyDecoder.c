@@ -0,0 +1,195 @@
+#include "bodyDecoder.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static BdStatus feedStage(BodyDecoder *decoder, int index, const char *data, int len);
+
+// Hands on what's in the window, without going over the limit
+static void emit(BodyDecoder *decoder, const char *data, int len) {
+    if (len > decoder->limit - decoder->produced)
+        len = decoder->limit - decoder->produced;
+    if (len > 0)
+        decoder->sink(decoder->ctx, data, len);
+    decoder->produced += len;
+    if (decoder->produced >= decoder->limit)
+        decoder->status = BD_LIMIT;
+}
+
+// What a stage decoded goes through the rest of them, then to the sink
+static void pass(BodyDecoder *decoder, int index, const char *data, int len) {
+    if (index + 1 < decoder->numStages)
+        feedStage(decoder, index + 1, data, len);
+    else
+        emit(decoder, data, len);
+}
+
+static bool startInflate(BdStage *stage, int windowBits) {
+    memset(&(stage->zs), 0, sizeof(z_stream));
+    if (inflateInit2(&(stage->zs), windowBits) != Z_OK)
+        return false;
+    stage->started = true;
+    return true;
+}
+
+static BdStatus inflateInto(BodyDecoder *decoder, int index, const char *data, int len) {
+    BdStage *stage = &(decoder->stages[index]);
+    z_stream *zs = &(stage->zs);
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = len;
+
+    // Keep going while there's input, or while the last round filled the
+    // window, since then zlib may still be holding output back
+    do {
+        zs->next_out = (Bytef*)stage->window;
+        zs->avail_out = BD_WINDOW;
+        int res = inflate(zs, Z_NO_FLUSH);
+        pass(decoder, index, stage->window, BD_WINDOW - zs->avail_out);
+
+        if (decoder->status != BD_MORE)
+            return decoder->status; // hit the limit, or a later stage is done
+        if (res == Z_STREAM_END)
+            return BD_DONE;
+        if (res == Z_BUF_ERROR)
+            return BD_MORE; // nothing left to do until more arrives
+        if (res != Z_OK) {
+            fprintf(stderr, "Inflate error: %d\n", res);
+            return BD_ERROR;
+        }
+    } while (zs->avail_in > 0 || zs->avail_out == 0);
+    return BD_MORE;
+}
+
+static BdStatus deflateInto(BodyDecoder *decoder, int index, const char *data, int len) {
+    BdStage *stage = &(decoder->stages[index]);
+    if (stage->started)
+        return inflateInto(decoder, index, data, len);
+
+    // "deflate" is meant to have a zlib wrapper, but plenty of servers
+    // send the raw stream. A zlib header's first byte says deflate with a
+    // window of at most 32KB, and its first two bytes are a multiple of
+    // 31, which is how browsers tell the two apart too
+    if (stage->headLength + len < 2) {
+        stage->head[stage->headLength++] = data[0];
+        return BD_MORE;
+    }
+    unsigned char first = stage->headLength > 0 ? stage->head[0] : data[0];
+    unsigned char second = stage->headLength > 0 ? data[0] : data[1];
+    bool zlibWrapped = (first & 0x0f) == Z_DEFLATED && (first >> 4) <= 7 && (first * 256 + second) % 31 == 0;
+    if (!startInflate(stage, zlibWrapped ? MAX_WBITS : -MAX_WBITS))
+        return BD_ERROR;
+
+    if (stage->headLength > 0) {
+        BdStatus status = inflateInto(decoder, index, stage->head, stage->headLength);
+        if (status != BD_MORE)
+            return status;
+    }
+    return inflateInto(decoder, index, data, len);
+}
+
+static BdStatus brotliInto(BodyDecoder *decoder, int index, const char *data, int len) {
+    BdStage *stage = &(decoder->stages[index]);
+    if (!stage->started) {
+        stage->brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+        if (stage->brotli == NULL)
+            return BD_ERROR;
+        stage->started = true;
+    }
+
+    size_t availIn = len;
+    const uint8_t *nextIn = (const uint8_t*)data;
+    for (;;) {
+        size_t availOut = BD_WINDOW;
+        uint8_t *nextOut = (uint8_t*)stage->window;
+        BrotliDecoderResult res = BrotliDecoderDecompressStream(stage->brotli, &availIn, &nextIn,
+                                                                &availOut, &nextOut, NULL);
+        pass(decoder, index, stage->window, BD_WINDOW - availOut);
+
+        if (decoder->status != BD_MORE)
+            return decoder->status;
+        if (res == BROTLI_DECODER_RESULT_SUCCESS)
+            return BD_DONE;
+        if (res == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT)
+            return BD_MORE;
+        if (res == BROTLI_DECODER_RESULT_ERROR) {
+            fprintf(stderr, "Brotli error: %s\n",
+                    BrotliDecoderErrorString(BrotliDecoderGetErrorCode(stage->brotli)));
+            return BD_ERROR;
+        }
+        // BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT: go round with an empty window
+    }
+}
+
+static BdStatus feedStage(BodyDecoder *decoder, int index, const char *data, int len) {
+    if (decoder->status != BD_MORE || len <= 0)
+        return decoder->status;
+
+    BdStage *stage = &(decoder->stages[index]);
+    BdStatus status;
+    switch (stage->encoding) {
+        case GZIP:
+            // 16 more window bits tells zlib to expect a gzip wrapper
+            if (!stage->started && !startInflate(stage, 16 + MAX_WBITS))
+                status = BD_ERROR;
+            else
+                status = inflateInto(decoder, index, data, len);
+            break;
+        case DEFLATE:
+            status = deflateInto(decoder, index, data, len);
+            break;
+        case BROTLI:
+            status = brotliInto(decoder, index, data, len);
+            break;
+        default:
+            status = BD_ERROR; // OTHER_ENCODING, which we can't undo
+            break;
+    }
+
+    // A coding that ends before the one inside it did cut that one short
+    if (status == BD_DONE && decoder->status == BD_MORE && index + 1 < decoder->numStages)
+        status = BD_ERROR;
+    decoder->status = status;
+    return status;
+}
+
+void bd_init(BodyDecoder *decoder, const Encoding *encodings, int numEncodings, long limit) {
+    decoder->status = limit > 0 ? BD_MORE : BD_LIMIT;
+    decoder->produced = 0;
+    decoder->limit = limit;
+
+    // Undone in the opposite order they were applied in
+    decoder->numStages = 0;
+    for (int i = numEncodings - 1; i >= 0 && decoder->numStages < MAX_CODINGS; i--) {
+        if (encodings[i] == NO_ENCODE)
+            continue;
+        BdStage *stage = &(decoder->stages[decoder->numStages++]);
+        stage->encoding = encodings[i];
+        stage->started = false;
+        stage->brotli = NULL;
+        stage->headLength = 0;
+    }
+}
+
+BdStatus bd_feed(BodyDecoder *decoder, const char *data, int len, DecodeSink sink, void *ctx) {
+    if (decoder->status != BD_MORE || len <= 0)
+        return decoder->status;
+
+    decoder->sink = sink;
+    decoder->ctx = ctx;
+    if (decoder->numStages == 0)
+        emit(decoder, data, len); // nothing to undo, the slice itself goes to the sink
+    else
+        feedStage(decoder, 0, data, len);
+    return decoder->status;
+}
+
+void bd_term(BodyDecoder *decoder) {
+    for (int i = 0; i < decoder->numStages; i++) {
+        BdStage *stage = &(decoder->stages[i]);
+        if (stage->started && stage->encoding == BROTLI)
+            BrotliDecoderDestroyInstance(stage->brotli);
+        else if (stage->started)
+            inflateEnd(&(stage->zs));
+        stage->started = false;
+    }
+}
@@ -1,22 +1,22 @@
 #include "cache.h"
+#include "headerRewrite.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-void cache_add(Header* clientHeader, Header* servHeader, int dataSize, DynamicArray* buff, HashTable* cache) {
+// Takes ownership of data
+static void cacheInsert(Header* clientHeader, Header* servHeader, char* data, int dataSize, int headerSize, HashTable* cache) {
     CacheKey* key = malloc(sizeof(CacheKey));
     strcpy(key->url, clientHeader->url);
     strcpy(key->port, clientHeader->port);
 
-    char* data = malloc(sizeof(char) * (buff->size + 1));
-    strcpy(data, buff->buff);
-
     CacheObj* obj = malloc(sizeof(CacheObj));
     obj->data = data;
     obj->timeCreated = time(NULL) - servHeader->age; // Apply the age that was already in, into our own cache
     obj->timeToLive = servHeader->timeToLive;  // TODO: Change this to real time to live
     obj->lastAccess = -1;
-    obj->headerSize = servHeader->headerLength;
+    obj->headerSize = headerSize;
     obj->dataSize = dataSize;
 
     if (cache->numElem >= cache->maxElem) {
@@ -29,6 +29,36 @@ void cache_add(Header* clientHeader, Header* servHeader, int dataSize, DynamicAr
     ht_insert(cache, key, obj);
 }
 
+void cache_add(Header* clientHeader, Header* servHeader, int dataSize, DynamicArray* buff, HashTable* cache) {
+    // Bodies can hold binary data (images, gzip), so copy by size, not strcpy
+    char* data = malloc(sizeof(char) * (buff->size + 1));
+    memcpy(data, buff->buff, buff->size);
+    data[buff->size] = '\0';
+
+    cacheInsert(clientHeader, servHeader, data, dataSize, servHeader->headerLength, cache);
+}
+
+void cache_addWithLength(Header* clientHeader, Header* servHeader, DynamicArray* buff, char* body, int bodySize, HashTable* cache) {
+    // Everything but the Transfer-Encoding line (if there is one), with a
+    // Content-Length in its place, then the decoded body
+    char contentLength[24];
+    sprintf(contentLength, "%d", bodySize);
+
+    HeaderRewrite rw;
+    hr_init(&rw, buff->buff, servHeader->headerLength);
+    hr_remove(&rw, servHeader->fields[HDR_TRANSFER_ENCODING].line);
+    hr_addField(&rw, "Content-Length", contentLength);
+
+    int headerSize = hr_length(&rw);
+    int dataSize = headerSize + bodySize;
+    char* data = malloc(sizeof(char) * (dataSize + 1));
+    hr_copy(&rw, data);
+    memcpy(data + headerSize, body, bodySize);
+    data[dataSize] = '\0';
+
+    cacheInsert(clientHeader, servHeader, data, dataSize, headerSize, cache);
+}
+
 CacheObj* cache_get(Header* clientHeader, HashTable* cache) {
     // Create a key to see if we've already seen the page
     CacheKey key;
@@ -0,0 +1,151 @@
+#include "caseFold.h"
+
+#include <stdbool.h>
+
+// Code points from, from + step, ... up to last fold to themselves plus
+// delta. Most scripts keep their capitals in one run (step 1), but a lot
+// of Latin and Cyrillic alternates capital, small, capital, small (step 2)
+typedef struct {
+    uint32_t from, last;
+    int32_t delta;
+    uint32_t step;
+} FoldRange;
+
+static const FoldRange foldRanges[] = {
+    { 0x0041, 0x005a, 32, 1 },              // A-Z
+    { 0x00b5, 0x00b5, 0x03bc - 0x00b5, 1 }, // micro sign to mu
+    { 0x00c0, 0x00d6, 32, 1 },              // À-Ö
+    { 0x00d8, 0x00de, 32, 1 },              // Ø-Þ
+    { 0x0100, 0x012e, 1, 2 },               // Latin Extended-A
+    { 0x0132, 0x0136, 1, 2 },
+    { 0x0139, 0x0147, 1, 2 },
+    { 0x014a, 0x0176, 1, 2 },
+    { 0x0178, 0x0178, 0x00ff - 0x0178, 1 }, // Ÿ
+    { 0x0179, 0x017d, 1, 2 },
+    { 0x0386, 0x0386, 0x03ac - 0x0386, 1 }, // Greek with tonos
+    { 0x0388, 0x038a, 0x03ad - 0x0388, 1 },
+    { 0x038c, 0x038c, 0x03cc - 0x038c, 1 },
+    { 0x038e, 0x038f, 0x03cd - 0x038e, 1 },
+    { 0x0391, 0x03a1, 32, 1 },              // Α-Ρ
+    { 0x03a3, 0x03ab, 32, 1 },              // Σ-Ϋ
+    { 0x03c2, 0x03c2, 1, 1 },               // final sigma
+    { 0x03d8, 0x03ee, 1, 2 },
+    { 0x0400, 0x040f, 80, 1 },              // Ѐ-Џ
+    { 0x0410, 0x042f, 32, 1 },              // А-Я
+    { 0x0460, 0x0480, 1, 2 },
+    { 0x048a, 0x04be, 1, 2 },
+    { 0x04c0, 0x04c0, 15, 1 },
+    { 0x04c1, 0x04cd, 1, 2 },
+    { 0x04d0, 0x052e, 1, 2 },
+    { 0x0531, 0x0556, 48, 1 },              // Armenian
+    { 0x1e00, 0x1e94, 1, 2 },               // Latin Extended Additional
+    { 0x1e9e, 0x1e9e, 0x00df - 0x1e9e, 1 }, // capital sharp s
+    { 0x1ea0, 0x1efe, 1, 2 },
+    { 0x2126, 0x2126, 0x03c9 - 0x2126, 1 }, // ohm sign
+    { 0x212b, 0x212b, 0x00e5 - 0x212b, 1 }, // angstrom sign
+    { 0x2160, 0x216f, 16, 1 },              // Roman numerals
+    { 0x24b6, 0x24cf, 26, 1 },              // circled letters
+    { 0xff21, 0xff3a, 32, 1 },              // fullwidth A-Z
+};
+
+#define NUM_FOLD_RANGES (int)(sizeof(foldRanges) / sizeof(foldRanges[0]))
+
+static inline bool inRange(const FoldRange *range, uint32_t cp) {
+    return cp >= range->from && cp <= range->last && (cp - range->from) % range->step == 0;
+}
+
+int fold_decode(const char *s, int len, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char*)s;
+    if (len < 1)
+        return 0;
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    }
+
+    int length;
+    uint32_t value, least;
+    if ((u[0] & 0xe0) == 0xc0) {
+        length = 2;
+        value = u[0] & 0x1f;
+        least = 0x80;
+    }
+    else if ((u[0] & 0xf0) == 0xe0) {
+        length = 3;
+        value = u[0] & 0x0f;
+        least = 0x800;
+    }
+    else if ((u[0] & 0xf8) == 0xf0) {
+        length = 4;
+        value = u[0] & 0x07;
+        least = 0x10000;
+    }
+    else {
+        return 0;
+    }
+    if (len < length)
+        return 0;
+    for (int i = 1; i < length; i++) {
+        if ((u[i] & 0xc0) != 0x80)
+            return 0;
+        value = (value << 6) | (u[i] & 0x3f);
+    }
+    if (value < least || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff))
+        return 0;
+    *cp = value;
+    return length;
+}
+
+int fold_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+uint32_t fold_codePoint(uint32_t cp) {
+    for (int i = 0; i < NUM_FOLD_RANGES; i++) {
+        if (inRange(foldRanges + i, cp))
+            return cp + foldRanges[i].delta;
+    }
+    return cp;
+}
+
+int fold_variants(uint32_t cp, uint32_t *variants) {
+    if (cp < 0x80) {
+        variants[0] = cp;
+        if ((unsigned)((cp | 0x20) - 'a') >= 26)
+            return 1;
+        variants[0] = cp | 0x20;
+        variants[1] = cp & ~0x20;
+        return 2;
+    }
+
+    // Nothing folds onto a code point that itself folds, so whatever folds
+    // the same way as cp is the folded one plus one from some range
+    uint32_t folded = fold_codePoint(cp);
+    int count = 0;
+    variants[count++] = folded;
+    for (int i = 0; i < NUM_FOLD_RANGES && count < FOLD_MAX_VARIANTS; i++) {
+        uint32_t from = folded - foldRanges[i].delta;
+        if (inRange(foldRanges + i, from))
+            variants[count++] = from;
+    }
+    return count;
+}
@@ -0,0 +1,126 @@
+#include "chunkDecoder.h"
+
+#include <stddef.h>
+
+static inline int hexValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// After the size line, either start the chunk data or, for the zero size
+// last chunk, move on to the trailer
+static ChunkState afterSizeLine(ChunkDecoder *decoder) {
+    if (decoder->sizeDigits == 0)
+        return CD_ERROR;
+    return decoder->remaining == 0 ? CD_TRAILER_START : CD_DATA;
+}
+
+void cd_init(ChunkDecoder *decoder) {
+    decoder->state = CD_SIZE;
+    decoder->remaining = 0;
+    decoder->sizeDigits = 0;
+    decoder->bodySize = 0;
+}
+
+int cd_feed(ChunkDecoder *decoder, const char *buf, int len, ChunkSink sink, void *ctx) {
+    int i = 0;
+    while (i < len && decoder->state != CD_DONE && decoder->state != CD_ERROR) {
+        char c = buf[i];
+
+        // Chunk data is the only part that isn't walked a byte at a time;
+        // whatever's here of it goes to the sink in one slice
+        if (decoder->state == CD_DATA) {
+            int take = len - i;
+            if (take > decoder->remaining)
+                take = decoder->remaining;
+            if (sink != NULL)
+                sink(ctx, buf + i, take);
+            decoder->bodySize += take;
+            decoder->remaining -= take;
+            i += take;
+            if (decoder->remaining == 0)
+                decoder->state = CD_DATA_CR;
+            continue;
+        }
+
+        i++;
+        switch (decoder->state) {
+            case CD_SIZE: {
+                int digit = hexValue(c);
+                if (digit != -1) {
+                    if (++decoder->sizeDigits > CD_MAX_SIZE_DIGITS)
+                        decoder->state = CD_ERROR;
+                    else
+                        decoder->remaining = decoder->remaining * 16 + digit;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    // Extensions carry nothing we use, so they're skipped
+                    decoder->state = decoder->sizeDigits == 0 ? CD_ERROR : CD_SIZE_EXT;
+                } else if (c == '\r') {
+                    decoder->state = CD_SIZE_LF;
+                } else if (c == '\n') {
+                    // Some servers end lines with a bare LF
+                    decoder->state = afterSizeLine(decoder);
+                } else {
+                    decoder->state = CD_ERROR;
+                }
+                break;
+            }
+            case CD_SIZE_EXT:
+                if (c == '\r')
+                    decoder->state = CD_SIZE_LF;
+                else if (c == '\n')
+                    decoder->state = afterSizeLine(decoder);
+                break;
+            case CD_SIZE_LF:
+                decoder->state = c == '\n' ? afterSizeLine(decoder) : CD_ERROR;
+                break;
+            case CD_DATA_CR:
+                if (c == '\r')
+                    decoder->state = CD_DATA_LF;
+                else if (c == '\n')
+                    decoder->state = CD_SIZE;
+                else
+                    decoder->state = CD_ERROR;
+                decoder->sizeDigits = 0;
+                break;
+            case CD_DATA_LF:
+                decoder->state = c == '\n' ? CD_SIZE : CD_ERROR;
+                break;
+            case CD_TRAILER_START:
+                // Trailer fields are dropped, we only need to know where
+                // the blank line that ends the message is
+                if (c == '\r')
+                    decoder->state = CD_FINAL_LF;
+                else if (c == '\n')
+                    decoder->state = CD_DONE;
+                else
+                    decoder->state = CD_TRAILER;
+                break;
+            case CD_TRAILER:
+                if (c == '\r')
+                    decoder->state = CD_TRAILER_LF;
+                else if (c == '\n')
+                    decoder->state = CD_TRAILER_START;
+                break;
+            case CD_TRAILER_LF:
+                decoder->state = c == '\n' ? CD_TRAILER_START : CD_ERROR;
+                break;
+            case CD_FINAL_LF:
+                decoder->state = c == '\n' ? CD_DONE : CD_ERROR;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return decoder->state == CD_ERROR ? -1 : i;
+}
+
+bool cd_done(ChunkDecoder *decoder) {
+    return decoder->state == CD_DONE;
+}
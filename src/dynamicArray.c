@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,14 +8,23 @@
 #include "dynamicArray.h"
 
 void da_shift(DynamicArray *buffer, int amount) {
-  if (buffer->size <= 0) {
+  if (buffer->size <= 0 || amount <= 0) {
     return;
   }
-  char *newBuff = malloc(buffer->size);
-  memcpy(newBuff, buffer->buff, buffer->size);
+  if (amount > buffer->size)
+    amount = buffer->size;
   buffer->size -= amount;
-  memcpy(buffer->buff, newBuff + amount, buffer->size);
-  free(newBuff);
+  memmove(buffer->buff, buffer->buff + amount, buffer->size);
+}
+
+void da_append(DynamicArray *buffer, const char *data, int len) {
+  if (buffer->size + len > buffer->maxSize) {
+    while (buffer->size + len > buffer->maxSize)
+      buffer->maxSize *= 2;
+    buffer->buff = realloc(buffer->buff, buffer->maxSize * sizeof(char));
+  }
+  memcpy(buffer->buff + buffer->size, data, len);
+  buffer->size += len;
 }
 
 void da_init(DynamicArray *buffer, int size) {
@@ -59,3 +69,63 @@ int readAll(int sd, DynamicArray *buffer) {
 
   return totalRead;
 }
+
+int readSome(int sd, DynamicArray *buffer, int most) {
+  if (buffer->size + most > buffer->maxSize) {
+    while (buffer->size + most > buffer->maxSize)
+      buffer->maxSize *= 2;
+    buffer->buff = realloc(buffer->buff, buffer->maxSize * sizeof(char));
+  }
+
+  int bytesRead = read(sd, buffer->buff + buffer->size, most);
+  if (bytesRead > 0)
+    buffer->size += bytesRead;
+  return bytesRead;
+}
+
+// Writes every iovec, picking up where a short write left off. The iovecs
+// are advanced in place, so the caller's array is consumed. If the socket is
+// non-blocking and full, we wait for it to drain instead of dropping the rest
+// of the response, but only for WRITE_TIMEOUT: a reader that's stopped
+// reading gets -1 (and ETIMEDOUT) so the caller can close it, rather than
+// holding up everyone else.
+ssize_t writevAll(int sd, struct iovec *iov, int iovcnt) {
+  ssize_t totalWritten = 0;
+
+  while (iovcnt > 0) {
+    ssize_t written = writev(sd, iov, iovcnt);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd = { .fd = sd, .events = POLLOUT };
+        int ready = poll(&pfd, 1, WRITE_TIMEOUT * 1000);
+        if (ready == 0)
+          errno = ETIMEDOUT;
+        if (ready == 0 || (ready == -1 && errno != EINTR))
+          return -1;
+        continue;
+      }
+      return -1;
+    }
+    totalWritten += written;
+
+    // Skip the iovecs that were fully written, and trim the partial one
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return totalWritten;
+}
+
+ssize_t writeAll(int sd, const char *data, int len) {
+  struct iovec iov = { .iov_base = (char *)data, .iov_len = len };
+  return writevAll(sd, &iov, 1);
+}
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include "filterReload.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *fr_pick(const char *textFile, const char *compiledFile) {
+    struct stat text, compiled;
+    bool haveText = access(textFile, R_OK) == 0 && stat(textFile, &text) == 0;
+    bool haveCompiled = access(compiledFile, R_OK) == 0 && stat(compiledFile, &compiled) == 0;
+    if (!haveText || !haveCompiled)
+        return haveCompiled ? compiledFile : haveText ? textFile : NULL;
+
+    // Compiling takes a moment, so a compiled list written in the same
+    // second as its text is taken to be up to date
+    return compiled.st_mtime >= text.st_mtime ? compiledFile : textFile;
+}
+
+static void *buildLoop(void *arg) {
+    FilterReloader *reloader = arg;
+
+    // Requests that come in while a build is running add up in the
+    // eventfd's counter, so however many there were, they make one build
+    uint64_t requests;
+    while (read(reloader->requestFd, &requests, sizeof(requests)) == sizeof(requests)) {
+        if (__atomic_load_n(&(reloader->stopping), __ATOMIC_ACQUIRE))
+            break;
+
+        // A list that's gone (or half way through being replaced) would
+        // build empty, so the one we have stays
+        const char *fileName = fr_pick(reloader->fileNames[0], reloader->fileNames[1]);
+        if (fileName == NULL) {
+            fprintf(stderr, "Can't read blacklist %s or %s, keeping the current one\n",
+                    reloader->fileNames[0], reloader->fileNames[1]);
+            continue;
+        }
+        printf("Building blacklist from %s\n", fileName);
+        ContentFilter *filter = cf_create((char*)fileName);
+
+        // One the loop hasn't picked up yet is out of date already
+        pthread_mutex_lock(&(reloader->lock));
+        ContentFilter *stale = reloader->ready;
+        reloader->ready = filter;
+        pthread_mutex_unlock(&(reloader->lock));
+        cf_release(stale);
+
+        uint64_t one = 1;
+        if (write(reloader->readyFd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "Error on write() to the reload eventfd\n");
+    }
+    return NULL;
+}
+
+static bool watch(int epollfd, int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void requestBuild(FilterReloader *reloader) {
+    uint64_t one = 1;
+    if (write(reloader->requestFd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "Error on write() to the reload eventfd\n");
+}
+
+// Editors tend to write a new file and rename it over the old one, which
+// would leave a watch on the file itself pointing at nothing, so it's the
+// directory that's watched
+static bool watchDir(FilterReloader *reloader, int which, const char *fileName) {
+    reloader->fileNames[which] = strdup(fileName);
+    const char *slash = strrchr(fileName, '/');
+    reloader->baseNames[which] = strdup(slash != NULL ? slash + 1 : fileName);
+
+    char *dir;
+    if (slash == NULL)
+        dir = strdup(".");
+    else if (slash == fileName)
+        dir = strdup("/");
+    else
+        dir = strndup(fileName, slash - fileName);
+    // The same directory twice gets the same watch
+    bool ok = inotify_add_watch(reloader->watchFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) != -1;
+    free(dir);
+    return ok;
+}
+
+bool fr_init(FilterReloader *reloader, const char *textFile, const char *compiledFile, int epollfd) {
+    reloader->running = false;
+    reloader->stopping = false;
+    reloader->ready = NULL;
+    pthread_mutex_init(&(reloader->lock), NULL);
+
+    // Blocked here, SIGHUP is only ever read from the signalfd, and threads
+    // started after this inherit the mask
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigprocmask(SIG_BLOCK, &hup, NULL);
+
+    reloader->signalFd = signalfd(-1, &hup, SFD_NONBLOCK | SFD_CLOEXEC);
+    reloader->watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    reloader->requestFd = eventfd(0, EFD_CLOEXEC); // the builder blocks on this one
+    reloader->readyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    bool ok = reloader->signalFd != -1 && reloader->watchFd != -1 &&
+              reloader->requestFd != -1 && reloader->readyFd != -1;
+    ok = watchDir(reloader, 0, textFile) && ok;
+    ok = watchDir(reloader, 1, compiledFile) && ok;
+    ok = ok && watch(epollfd, reloader->signalFd) && watch(epollfd, reloader->watchFd) &&
+         watch(epollfd, reloader->readyFd);
+    ok = ok && pthread_create(&(reloader->builder), NULL, buildLoop, reloader) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "Couldn't set up reloading for blacklist %s\n", textFile);
+        return false;
+    }
+    reloader->running = true;
+    return true;
+}
+
+bool fr_handle(FilterReloader *reloader, int fd, ContentFilter **filter) {
+    if (fd == reloader->signalFd) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == sizeof(info))
+            ;
+        printf("Got SIGHUP, reloading blacklist\n");
+        requestBuild(reloader);
+        return true;
+    }
+
+    if (fd == reloader->watchFd) {
+        // Only events for the lists themselves count, not the rest of
+        // their directories
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+        ssize_t len;
+        while ((len = read(fd, events, sizeof(events))) > 0) {
+            for (char *cur = events; cur < events + len;) {
+                struct inotify_event *event = (struct inotify_event*)cur;
+                if (event->len > 0 && (strcmp(event->name, reloader->baseNames[0]) == 0 ||
+                                       strcmp(event->name, reloader->baseNames[1]) == 0))
+                    changed = true;
+                cur += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (changed) {
+            printf("Blacklist changed, reloading it\n");
+            requestBuild(reloader);
+        }
+        return true;
+    }
+
+    if (fd == reloader->readyFd) {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            return true;
+
+        pthread_mutex_lock(&(reloader->lock));
+        ContentFilter *fresh = reloader->ready;
+        reloader->ready = NULL;
+        pthread_mutex_unlock(&(reloader->lock));
+
+        // New responses get the new filter. The old one goes once the
+        // last stream scanning with it lets go
+        if (fresh != NULL) {
+            cf_release(*filter);
+            *filter = fresh;
+            printf("Reloaded blacklist (%d states)\n", fresh->numStates);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void fr_term(FilterReloader *reloader) {
+    if (reloader->running) {
+        __atomic_store_n(&(reloader->stopping), true, __ATOMIC_RELEASE);
+        requestBuild(reloader);
+        pthread_join(reloader->builder, NULL);
+    }
+
+    int fds[] = { reloader->signalFd, reloader->watchFd, reloader->requestFd, reloader->readyFd };
+    for (int i = 0; i < 4; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    cf_release(reloader->ready);
+    pthread_mutex_destroy(&(reloader->lock));
+    for (int i = 0; i < 2; i++) {
+        free(reloader->fileNames[i]);
+        free(reloader->baseNames[i]);
+    }
+}
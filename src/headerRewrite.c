@@ -0,0 +1,156 @@
+#include "headerRewrite.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+void hr_init(HeaderRewrite *rw, const char *buf, int headerLength) {
+    rw->buf = buf;
+    rw->headerLength = headerLength;
+    // The blank line is CRLF or, from some servers, a bare LF
+    rw->end = headerLength >= 2 && buf[headerLength - 2] == '\r' ? headerLength - 2 : headerLength - 1;
+    rw->numEdits = 0;
+    rw->scratchUsed = 0;
+}
+
+static bool addEdit(HeaderRewrite *rw, int offset, int removeLength, const char *text, int textLength) {
+    if (rw->numEdits == HR_MAX_EDITS)
+        return false;
+
+    // Kept sorted by offset as they come in. Adds at the same offset stay
+    // in the order they were made
+    int i = rw->numEdits++;
+    while (i > 0 && rw->edits[i - 1].offset > offset) {
+        rw->edits[i] = rw->edits[i - 1];
+        i--;
+    }
+    rw->edits[i] = (HeaderEdit){ offset, removeLength, text, textLength };
+    return true;
+}
+
+static bool removes(HeaderRewrite *rw, HttpSlice line) {
+    for (int i = 0; i < rw->numEdits; i++) {
+        if (rw->edits[i].offset == line.offset && rw->edits[i].removeLength > 0)
+            return true;
+    }
+    return false;
+}
+
+bool hr_remove(HeaderRewrite *rw, HttpSlice line) {
+    return hr_replace(rw, line, NULL, 0);
+}
+
+bool hr_replace(HeaderRewrite *rw, HttpSlice line, const char *text, int length) {
+    // A line that's already going can't go twice; that happens when
+    // Connection names a field that's hop-by-hop anyway
+    if (line.length == 0 || removes(rw, line))
+        return false;
+    return addEdit(rw, line.offset, line.length, text, length);
+}
+
+bool hr_add(HeaderRewrite *rw, const char *text, int length) {
+    return addEdit(rw, rw->end, 0, text, length);
+}
+
+bool hr_addField(HeaderRewrite *rw, const char *name, const char *value) {
+    char *line = rw->scratch + rw->scratchUsed;
+    int room = HR_SCRATCH - rw->scratchUsed;
+    int length = snprintf(line, room, "%s: %s\r\n", name, value);
+    if (length >= room || !hr_add(rw, line, length))
+        return false;
+    rw->scratchUsed += length;
+    return true;
+}
+
+static bool isHopByHop(HeaderName id) {
+    switch (id) {
+        case HDR_CONNECTION:
+        case HDR_KEEP_ALIVE:
+        case HDR_PROXY_CONNECTION:
+        case HDR_TE:
+        case HDR_UPGRADE:
+        case HDR_PROXY_AUTHENTICATE:
+        case HDR_PROXY_AUTHORIZATION:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Fields the message can't do without, whatever Connection says
+static bool isEssential(HeaderName id) {
+    return id == HDR_TRANSFER_ENCODING || id == HDR_CONTENT_LENGTH || id == HDR_HOST;
+}
+
+// Removes the fields named by one comma separated Connection value
+static void removeNamed(HeaderRewrite *rw, const HttpMessage *msg, HttpSlice value) {
+    const char *buf = rw->buf;
+    int end = value.offset + value.length;
+    int start = value.offset;
+    while (start < end) {
+        int tokenEnd = start;
+        while (tokenEnd < end && buf[tokenEnd] != ',')
+            tokenEnd++;
+
+        int first = start, last = tokenEnd;
+        while (first < last && isSpace(buf[first]))
+            first++;
+        while (last > first && isSpace(buf[last - 1]))
+            last--;
+
+        for (int i = 0; i < msg->numFields; i++) {
+            const HttpField *field = &msg->fields[i];
+            if (!isEssential(field->id) && field->name.length == last - first &&
+                strncasecmp(buf + field->name.offset, buf + first, last - first) == 0)
+                hr_remove(rw, field->line);
+        }
+        start = tokenEnd + 1;
+    }
+}
+
+void hr_stripHopByHop(HeaderRewrite *rw, const HttpMessage *msg) {
+    for (int i = 0; i < msg->numFields; i++) {
+        const HttpField *field = &msg->fields[i];
+        if (field->id == HDR_CONNECTION || field->id == HDR_PROXY_CONNECTION)
+            removeNamed(rw, msg, field->value);
+        if (isHopByHop(field->id))
+            hr_remove(rw, field->line);
+    }
+}
+
+int hr_length(HeaderRewrite *rw) {
+    int length = rw->headerLength;
+    for (int i = 0; i < rw->numEdits; i++)
+        length += rw->edits[i].textLength - rw->edits[i].removeLength;
+    return length;
+}
+
+int hr_iovecs(HeaderRewrite *rw, struct iovec *iov) {
+    // The kept run before each edit, then its text, then whatever's left
+    int count = 0;
+    int pos = 0;
+    for (int i = 0; i < rw->numEdits; i++) {
+        HeaderEdit *edit = &rw->edits[i];
+        if (edit->offset > pos)
+            iov[count++] = (struct iovec){ (char *)rw->buf + pos, edit->offset - pos };
+        if (edit->textLength > 0)
+            iov[count++] = (struct iovec){ (char *)edit->text, edit->textLength };
+        pos = edit->offset + edit->removeLength;
+    }
+    if (rw->headerLength > pos)
+        iov[count++] = (struct iovec){ (char *)rw->buf + pos, rw->headerLength - pos };
+    return count;
+}
+
+void hr_copy(HeaderRewrite *rw, char *out) {
+    struct iovec iov[HR_MAX_IOVECS];
+    int count = hr_iovecs(rw, iov);
+    for (int i = 0; i < count; i++) {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        out += iov[i].iov_len;
+    }
+}
@@ -0,0 +1,836 @@
+#define _GNU_SOURCE
+
+#include "htmlScanner.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "caseFold.h"
+#include "scan.h"
+
+static const ByteSet tagDelim = { .bytes = "<", .count = 1, .member = { ['<'] = true } };
+static const ByteSet cssDelim = { .bytes = "uU@", .count = 3, .member = { ['u'] = true, ['U'] = true, ['@'] = true } };
+
+static char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static bool isLetter(char c) {
+    return lower(c) >= 'a' && lower(c) <= 'z';
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool isSlash(char c) {
+    return c == '/' || c == '\\'; // browsers take either in http URLs
+}
+
+static bool tokenIs(const char *s, int length, const char *word) {
+    return length == (int)strlen(word) && strncasecmp(s, word, length) == 0;
+}
+
+/************ Resolving ************/
+
+// Where a URL is written. Bytes past size are counted but not written, so
+// it only needs checking once at the end
+typedef struct {
+    char *buff;
+    int length;
+    int size;
+} UrlOut;
+
+static void put(UrlOut *url, char c) {
+    if (url->length < url->size)
+        url->buff[url->length] = c;
+    url->length++;
+}
+
+// Escapes the bytes a browser would before sending them
+static void putEscaped(UrlOut *url, unsigned char c, bool inPath) {
+    static const char hex[] = "0123456789ABCDEF";
+    if (c <= ' ' || c >= 0x7f || c == '"' || c == '<' || c == '>' || c == '`' ||
+        (inPath ? c == '{' || c == '}' : c == '\'')) {
+        put(url, '%');
+        put(url, hex[c >> 4]);
+        put(url, hex[c & 0xf]);
+    }
+    else
+        put(url, c);
+}
+
+// 1 for ".", 2 for "..", spelled out or escaped; 0 for anything else
+static int dots(const char *segment, int length) {
+    int count = 0;
+    for (int i = 0; i < length; count++) {
+        if (segment[i] == '.')
+            i++;
+        else if (length - i >= 3 && segment[i] == '%' && segment[i + 1] == '2' && lower(segment[i + 2]) == 'e')
+            i += 3;
+        else
+            return 0;
+    }
+    return count <= 2 ? count : 0;
+}
+
+// Writes host[:port] the way a browser would, lower case and without the
+// default port. False if it isn't a host we could connect to
+static bool putHost(UrlOut *url, const char *host, int length) {
+    int nameEnd = 0;
+    if (length > 0 && host[0] == '[') {
+        // An IPv6 address
+        while (nameEnd < length && host[nameEnd] != ']') {
+            char c = lower(host[nameEnd]);
+            if (nameEnd > 0 && !isDigit(c) && !(c >= 'a' && c <= 'f') && c != ':' && c != '.')
+                return false;
+            nameEnd++;
+        }
+        if (nameEnd++ == length)
+            return false;
+    }
+    else {
+        while (nameEnd < length && host[nameEnd] != ':') {
+            char c = host[nameEnd];
+            if (!isLetter(c) && !isDigit(c) && c != '-' && c != '.' && c != '_')
+                return false;
+            nameEnd++;
+        }
+    }
+    if (nameEnd == 0)
+        return false;
+
+    long port = 80; // an empty one is the default too
+    if (nameEnd < length) {
+        if (host[nameEnd] != ':')
+            return false;
+        if (nameEnd + 1 < length)
+            port = 0;
+        for (int i = nameEnd + 1; i < length; i++) {
+            if (!isDigit(host[i]) || (port = port * 10 + host[i] - '0') > 65535)
+                return false;
+        }
+    }
+
+    for (int i = 0; i < nameEnd; i++)
+        put(url, lower(host[i]));
+    if (port != 80) {
+        char digits[8];
+        int count = snprintf(digits, sizeof(digits), ":%ld", port);
+        for (int i = 0; i < count; i++)
+            put(url, digits[i]);
+    }
+    return true;
+}
+
+int hs_resolve(const char *base, const char *ref, int refLength, char *out, int outSize) {
+    // Whitespace around it doesn't count
+    while (refLength > 0 && (unsigned char)ref[0] <= ' ') {
+        ref++;
+        refLength--;
+    }
+    while (refLength > 0 && (unsigned char)ref[refLength - 1] <= ' ')
+        refLength--;
+
+    int scheme = 0;
+    while (scheme < refLength && (isLetter(ref[scheme]) ||
+           (scheme > 0 && (isDigit(ref[scheme]) || ref[scheme] == '+' || ref[scheme] == '-' || ref[scheme] == '.'))))
+        scheme++;
+    bool absolute = false;
+    if (scheme > 0 && scheme < refLength && ref[scheme] == ':') {
+        if (!tokenIs(ref, scheme, "http"))
+            return -1; // https, data:, javascript: and the like
+        if (refLength > 5 && isSlash(ref[5]))
+            absolute = true;
+        else {
+            // "http:x" on an http page is relative to it
+            ref += 5;
+            refLength -= 5;
+        }
+    }
+    if (!absolute && (refLength == 0 || ref[0] == '#'))
+        return -1; // the page itself
+
+    // How much of base goes ahead of ref
+    int baseLength = strlen(base);
+    bool httpBase = baseLength > 7 && strncasecmp(base, "http://", 7) == 0;
+    int authorityEnd = 0, pathEnd = 0;
+    if (httpBase) {
+        authorityEnd = 7 + strcspn(base + 7, "/\\?#");
+        pathEnd = authorityEnd + strcspn(base + authorityEnd, "?#");
+    }
+    int keep = 0;
+    bool addSlash = false;
+    if (absolute)
+        keep = 0;
+    else if (!httpBase)
+        return -1;
+    else if (refLength >= 2 && isSlash(ref[0]) && isSlash(ref[1]))
+        keep = 5; // just the "http:"
+    else if (isSlash(ref[0]))
+        keep = authorityEnd;
+    else if (ref[0] == '?')
+        keep = pathEnd;
+    else {
+        // In place of the base's last segment
+        keep = pathEnd;
+        while (keep > authorityEnd && !isSlash(base[keep - 1]))
+            keep--;
+        addSlash = keep == authorityEnd;
+    }
+
+    // Tabs and line breaks inside it are dropped
+    char joined[2 * HS_MAX_URL];
+    if (keep + 1 + refLength > (int)sizeof(joined))
+        return -1;
+    memcpy(joined, base, keep);
+    int length = keep;
+    if (addSlash)
+        joined[length++] = '/';
+    for (int i = 0; i < refLength; i++) {
+        if (ref[i] != '\t' && ref[i] != '\n' && ref[i] != '\r')
+            joined[length++] = ref[i];
+    }
+
+    UrlOut url = { out, 0, outSize };
+    for (const char *p = "http://"; *p != '\0'; p++)
+        put(&url, *p);
+    int i = 5;
+    while (i < length && isSlash(joined[i]))
+        i++;
+    int hostStart = i;
+    while (i < length && !isSlash(joined[i]) && joined[i] != '?' && joined[i] != '#')
+        i++;
+    if (!putHost(&url, joined + hostStart, i - hostStart))
+        return -1;
+
+    // The path a segment at a time, taking out "." and ".." as it goes
+    int pathStart = url.length;
+    while (i < length && joined[i] != '?' && joined[i] != '#') {
+        int start = i + 1, end = start;
+        while (end < length && !isSlash(joined[end]) && joined[end] != '?' && joined[end] != '#')
+            end++;
+        bool last = end == length || !isSlash(joined[end]);
+
+        int count = dots(joined + start, end - start);
+        if (count == 2 && url.length <= url.size) {
+            while (url.length > pathStart && out[--url.length] != '/')
+                ;
+        }
+        if (count == 0) {
+            put(&url, '/');
+            for (int j = start; j < end; j++)
+                putEscaped(&url, joined[j], true);
+        }
+        else if (last)
+            put(&url, '/');
+        i = end;
+    }
+    if (url.length == pathStart)
+        put(&url, '/');
+
+    // The query as it is, and the fragment never gets sent
+    while (i < length && joined[i] != '#')
+        putEscaped(&url, joined[i++], false);
+
+    if (url.length >= outSize)
+        return -1;
+    out[url.length] = '\0';
+    return url.length;
+}
+
+/************ Collecting ************/
+
+static void addUrl(HtmlScanner *scanner, const char *ref, int length) {
+    if (scanner->numUrls == HS_MAX_URLS)
+        return;
+    char url[HS_MAX_URL];
+    int urlLength = hs_resolve(scanner->base, ref, length, url, sizeof(url));
+    if (urlLength == -1)
+        return;
+
+    // Pages tend to use the same icon or spacer over and over
+    const char *seen = NULL;
+    while ((seen = hs_nextUrl(scanner, seen)) != NULL) {
+        if (strcmp(seen, url) == 0)
+            return;
+    }
+    da_append(&(scanner->urls), url, urlLength + 1);
+    scanner->numUrls++;
+}
+
+// Undoes the character references a URL in an attribute is likely to
+// have, in place. A reference is never shorter than what it stands for.
+// Returns the new length
+static int decodeReferences(char *value, int length) {
+    static const struct {
+        const char *name;
+        char c;
+    } named[] = { { "amp;", '&' }, { "lt;", '<' }, { "gt;", '>' }, { "quot;", '"' }, { "apos;", '\'' } };
+
+    int out = 0;
+    for (int i = 0; i < length; ) {
+        const char *ref = value + i + 1;
+        int avail = length - i - 1;
+        if (value[i] != '&' || avail < 3) {
+            value[out++] = value[i++];
+            continue;
+        }
+
+        if (ref[0] == '#') {
+            bool hex = lower(ref[1]) == 'x';
+            int j = hex ? 2 : 1;
+            uint32_t cp = 0;
+            for (; j < avail && cp <= 0x10ffff; j++) {
+                char c = lower(ref[j]);
+                if (isDigit(c))
+                    cp = cp * (hex ? 16 : 10) + c - '0';
+                else if (hex && c >= 'a' && c <= 'f')
+                    cp = cp * 16 + c - 'a' + 10;
+                else
+                    break;
+            }
+            bool digits = j > (hex ? 2 : 1);
+            if (digits && j < avail && ref[j] == ';' && cp > 0 && cp <= 0x10ffff && (cp < 0xd800 || cp > 0xdfff)) {
+                out += fold_encode(cp, value + out);
+                i += j + 2;
+                continue;
+            }
+        }
+        else {
+            int which = 0, count = sizeof(named) / sizeof(named[0]);
+            while (which < count && (avail < (int)strlen(named[which].name) ||
+                                     memcmp(ref, named[which].name, strlen(named[which].name)) != 0))
+                which++;
+            if (which < count) {
+                value[out++] = named[which].c;
+                i += 1 + strlen(named[which].name);
+                continue;
+            }
+        }
+        value[out++] = value[i++];
+    }
+    return out;
+}
+
+/************ CSS ************/
+
+static void cssInit(HsCss *css) {
+    css->state = HS_CSS_TEXT;
+    css->urlMatched = 0;
+    css->importMatched = 0;
+    css->length = 0;
+}
+
+static void cssAppend(HsCss *css, char c) {
+    if (css->length < HS_MAX_VALUE)
+        css->url[css->length] = c;
+    if (css->length <= HS_MAX_VALUE)
+        css->length++;
+}
+
+static void cssUrlDone(HtmlScanner *scanner, HsCss *css) {
+    if (css->length <= HS_MAX_VALUE)
+        addUrl(scanner, css->url, css->length);
+    css->state = HS_CSS_TEXT;
+}
+
+// Picks out url(...) and @import "...". Comments and escapes aren't
+// followed; the worst that does is fetch something that isn't needed
+static void cssFeed(HtmlScanner *scanner, HsCss *css, const char *data, int len) {
+    const char *cur = data;
+    const char *end = data + len;
+    while (cur < end) {
+        char c = *cur;
+        switch (css->state) {
+            case HS_CSS_TEXT:
+                if (css->urlMatched == 0 && css->importMatched == 0) {
+                    // Nothing's started, so skip to where something could
+                    const char *next = scan_findAny(cur, end - cur, &cssDelim);
+                    if (next == NULL)
+                        return;
+                    cur = next;
+                    c = *cur;
+                }
+                css->urlMatched = lower(c) == "url("[css->urlMatched] ? css->urlMatched + 1 : lower(c) == 'u';
+                css->importMatched = lower(c) == "@import"[css->importMatched] ? css->importMatched + 1 : c == '@';
+                if (css->urlMatched == 4) {
+                    css->urlMatched = 0;
+                    css->state = HS_CSS_URL_START;
+                }
+                else if (css->importMatched == 7) {
+                    css->importMatched = 0;
+                    css->state = HS_CSS_IMPORT;
+                }
+                break;
+
+            case HS_CSS_URL_START:
+            case HS_CSS_IMPORT:
+                if (isSpace(c))
+                    break;
+                css->length = 0;
+                if (c == '"' || c == '\'') {
+                    css->quote = c;
+                    css->state = HS_CSS_QUOTED;
+                    break;
+                }
+                // A bare url, or for @import, maybe a url(...) after all
+                css->state = css->state == HS_CSS_URL_START ? HS_CSS_BARE : HS_CSS_TEXT;
+                continue;
+
+            case HS_CSS_QUOTED:
+                if (c == css->quote)
+                    cssUrlDone(scanner, css);
+                else if (c == '\n')
+                    css->state = HS_CSS_TEXT; // a string can't run over a line
+                else
+                    cssAppend(css, c);
+                break;
+
+            case HS_CSS_BARE:
+                if (c == ')' || isSpace(c))
+                    cssUrlDone(scanner, css);
+                else
+                    cssAppend(css, c);
+                break;
+        }
+        cur++;
+    }
+}
+
+/************ Tags ************/
+
+static const struct {
+    const char *name;
+    HsTag tag;
+} tags[] = {
+    { "img", HS_TAG_IMG }, { "link", HS_TAG_LINK }, { "script", HS_TAG_SCRIPT },
+    { "base", HS_TAG_BASE }, { "style", HS_TAG_STYLE },
+    // With scripts on, a browser takes <noscript> as text too, and
+    // doesn't load what's in it
+    { "textarea", HS_TAG_TEXT }, { "title", HS_TAG_TEXT }, { "noscript", HS_TAG_TEXT },
+    { "iframe", HS_TAG_TEXT }, { "xmp", HS_TAG_TEXT }, { "noembed", HS_TAG_TEXT },
+    { "noframes", HS_TAG_TEXT },
+};
+
+static const char *attrNames[HS_ATTR_COUNT] = {
+    [HS_ATTR_SRC] = "src", [HS_ATTR_SRCSET] = "srcset", [HS_ATTR_HREF] = "href",
+    [HS_ATTR_REL] = "rel", [HS_ATTR_STYLE] = "style"
+};
+
+// Names are kept in lower case, and most don't even start the same
+static bool nameIs(const HtmlScanner *scanner, const char *word) {
+    return scanner->name[0] == word[0] && scanner->nameLength == (int)strlen(word) &&
+           memcmp(scanner->name, word, scanner->nameLength) == 0;
+}
+
+static void addName(HtmlScanner *scanner, char c) {
+    if (scanner->nameLength < HS_MAX_NAME)
+        scanner->name[scanner->nameLength++] = lower(c);
+}
+
+// The tag's name is in, so what it is decides which attributes are kept
+static void tagNamed(HtmlScanner *scanner) {
+    scanner->tag = HS_TAG_OTHER;
+    for (int i = 0; i < (int)(sizeof(tags) / sizeof(tags[0])); i++) {
+        if (nameIs(scanner, tags[i].name)) {
+            scanner->tag = tags[i].tag;
+            scanner->rawEnd = tags[i].name;
+            break;
+        }
+    }
+    for (int attr = 0; attr < HS_ATTR_COUNT; attr++)
+        scanner->valueLength[attr] = -1;
+    scanner->attr = HS_ATTR_NONE;
+}
+
+static void attrNamed(HtmlScanner *scanner) {
+    HsTag tag = scanner->tag;
+    scanner->attr = HS_ATTR_NONE;
+    for (HsAttr attr = 0; attr < HS_ATTR_COUNT; attr++) {
+        if (nameIs(scanner, attrNames[attr]))
+            scanner->attr = attr;
+    }
+
+    bool wanted;
+    switch (scanner->attr) {
+        case HS_ATTR_SRC:    wanted = tag == HS_TAG_IMG || tag == HS_TAG_SCRIPT; break;
+        case HS_ATTR_SRCSET: wanted = tag == HS_TAG_IMG; break;
+        case HS_ATTR_HREF:   wanted = tag == HS_TAG_LINK || tag == HS_TAG_BASE; break;
+        case HS_ATTR_REL:    wanted = tag == HS_TAG_LINK; break;
+        case HS_ATTR_STYLE:  wanted = true; break;
+        default:             wanted = false; break;
+    }
+    // The first of a repeated attribute is the one that counts
+    if (!wanted || scanner->valueLength[scanner->attr] != -1)
+        scanner->attr = HS_ATTR_NONE;
+    else
+        scanner->valueLength[scanner->attr] = 0;
+}
+
+static void appendValue(HtmlScanner *scanner, const char *data, int len) {
+    if (scanner->attr == HS_ATTR_NONE)
+        return;
+    int *length = &(scanner->valueLength[scanner->attr]);
+    if (*length + len > HS_MAX_VALUE) {
+        *length = HS_MAX_VALUE + 1; // too long to be worth it
+        return;
+    }
+    memcpy(scanner->values[scanner->attr] + *length, data, len);
+    *length += len;
+}
+
+static void attrDone(HtmlScanner *scanner) {
+    HsAttr attr = scanner->attr;
+    scanner->attr = HS_ATTR_NONE;
+    if (attr == HS_ATTR_NONE)
+        return;
+    if (scanner->valueLength[attr] > HS_MAX_VALUE) {
+        scanner->valueLength[attr] = -1;
+        return;
+    }
+
+    int length = scanner->valueLength[attr];
+    if (memchr(scanner->values[attr], '&', length) != NULL) {
+        length = decodeReferences(scanner->values[attr], length);
+        scanner->valueLength[attr] = length;
+    }
+    if (attr == HS_ATTR_STYLE) {
+        HsCss css;
+        cssInit(&css);
+        cssFeed(scanner, &css, scanner->values[attr], length);
+    }
+}
+
+// Whether a <link> with that rel loads what it points to
+static bool relLoads(const char *rel, int length) {
+    bool stylesheet = false, alternate = false, other = false;
+    for (int i = 0; i < length; ) {
+        while (i < length && isSpace(rel[i]))
+            i++;
+        int start = i;
+        while (i < length && !isSpace(rel[i]))
+            i++;
+        stylesheet |= tokenIs(rel + start, i - start, "stylesheet");
+        alternate |= tokenIs(rel + start, i - start, "alternate");
+        other |= tokenIs(rel + start, i - start, "preload") || tokenIs(rel + start, i - start, "icon");
+    }
+    // Alternate stylesheets only load if someone picks one
+    return other || (stylesheet && !alternate);
+}
+
+// Collects from a tag once its '>' is in, and works out what follows it
+static void tagDone(HtmlScanner *scanner) {
+    scanner->state = HS_DATA;
+    char (*values)[HS_MAX_VALUE] = scanner->values;
+    int *lengths = scanner->valueLength;
+
+    switch (scanner->tag) {
+        case HS_TAG_IMG:
+            // src, or the first of srcset if there isn't one. The browser's
+            // pick from srcset depends on its screen, which we can't know
+            if (lengths[HS_ATTR_SRC] > 0)
+                addUrl(scanner, values[HS_ATTR_SRC], lengths[HS_ATTR_SRC]);
+            else if (lengths[HS_ATTR_SRCSET] > 0) {
+                const char *srcset = values[HS_ATTR_SRCSET];
+                int length = lengths[HS_ATTR_SRCSET];
+                int start = 0;
+                while (start < length && (isSpace(srcset[start]) || srcset[start] == ','))
+                    start++;
+                int end = start;
+                while (end < length && !isSpace(srcset[end]))
+                    end++;
+                while (end > start && srcset[end - 1] == ',')
+                    end--;
+                addUrl(scanner, srcset + start, end - start);
+            }
+            break;
+        case HS_TAG_LINK:
+            if (lengths[HS_ATTR_HREF] > 0 && lengths[HS_ATTR_REL] > 0 &&
+                relLoads(values[HS_ATTR_REL], lengths[HS_ATTR_REL]))
+                addUrl(scanner, values[HS_ATTR_HREF], lengths[HS_ATTR_HREF]);
+            break;
+        case HS_TAG_SCRIPT:
+            if (lengths[HS_ATTR_SRC] > 0)
+                addUrl(scanner, values[HS_ATTR_SRC], lengths[HS_ATTR_SRC]);
+            scanner->state = HS_RAW_TEXT;
+            break;
+        case HS_TAG_BASE:
+            if (!scanner->haveBase && lengths[HS_ATTR_HREF] > 0) {
+                // Only the first one counts. If it's not somewhere we can
+                // fetch from, nothing relative is either
+                char url[HS_MAX_URL];
+                if (hs_resolve(scanner->base, values[HS_ATTR_HREF], lengths[HS_ATTR_HREF], url, sizeof(url)) != -1)
+                    strcpy(scanner->base, url);
+                else
+                    scanner->base[0] = '\0';
+                scanner->haveBase = true;
+            }
+            break;
+        case HS_TAG_STYLE:
+            cssInit(&(scanner->css));
+            scanner->state = HS_RAW_TEXT;
+            break;
+        case HS_TAG_TEXT:
+            scanner->state = HS_RAW_TEXT;
+            break;
+        case HS_TAG_OTHER:
+            break;
+    }
+    scanner->rawMatched = 0;
+}
+
+/************ Interface ************/
+
+HsKind hs_kindOf(const char *contentType, int length) {
+    if (contentType == NULL)
+        return HS_HTML; // it's pages that tend to leave it out
+    int end = 0;
+    while (end < length && contentType[end] != ';')
+        end++;
+    while (end > 0 && isSpace(contentType[end - 1]))
+        end--;
+
+    if (tokenIs(contentType, end, "text/html") || tokenIs(contentType, end, "application/xhtml+xml"))
+        return HS_HTML;
+    if (tokenIs(contentType, end, "text/css"))
+        return HS_CSS;
+    return HS_NONE;
+}
+
+void hs_init(HtmlScanner *scanner, HsKind kind, const char *pageUrl) {
+    scanner->kind = kind;
+    scanner->state = HS_DATA;
+    snprintf(scanner->base, sizeof(scanner->base), "%s", pageUrl);
+    scanner->haveBase = false;
+    scanner->tag = HS_TAG_OTHER;
+    scanner->nameLength = 0;
+    scanner->attr = HS_ATTR_NONE;
+    scanner->rawEnd = NULL;
+    scanner->rawMatched = 0;
+    cssInit(&(scanner->css));
+    da_init(&(scanner->urls), 256);
+    scanner->numUrls = 0;
+}
+
+void hs_feed(HtmlScanner *scanner, const char *data, int len) {
+    if (scanner->numUrls == HS_MAX_URLS)
+        return; // nothing more would be kept
+    if (scanner->kind == HS_CSS)
+        cssFeed(scanner, &(scanner->css), data, len);
+    if (scanner->kind != HS_HTML)
+        return;
+
+    // Each state either takes the one byte at cur, and breaks, or moves
+    // cur itself, and continues
+    const char *cur = data;
+    const char *end = data + len;
+    while (cur < end) {
+        char c = *cur;
+        switch (scanner->state) {
+            case HS_DATA: {
+                // Jump from one '<' to the next with the vectorized scanner
+                const char *open = scan_findAny(cur, end - cur, &tagDelim);
+                if (open == NULL)
+                    return;
+                scanner->state = HS_TAG_OPEN;
+                cur = open + 1;
+                continue;
+            }
+
+            case HS_TAG_OPEN:
+                if (isLetter(c)) {
+                    scanner->nameLength = 0;
+                    scanner->state = HS_TAG_NAME;
+                    continue;
+                }
+                if (c == '!')
+                    scanner->state = HS_MARKUP;
+                else if (c == '/' || c == '?')
+                    scanner->state = HS_BOGUS;
+                else {
+                    scanner->state = HS_DATA; // a '<' in the text
+                    continue;
+                }
+                break;
+
+            case HS_TAG_NAME:
+                while (cur < end && !isSpace(*cur) && *cur != '/' && *cur != '>')
+                    addName(scanner, *cur++);
+                if (cur == end)
+                    return;
+                tagNamed(scanner);
+                scanner->state = HS_BEFORE_ATTR_NAME;
+                if (*cur == '>')
+                    tagDone(scanner);
+                break;
+
+            case HS_BEFORE_ATTR_NAME:
+                while (cur < end && (isSpace(*cur) || *cur == '/'))
+                    cur++;
+                if (cur == end)
+                    return;
+                if (*cur == '>')
+                    tagDone(scanner);
+                else {
+                    scanner->nameLength = 0;
+                    scanner->state = HS_ATTR_NAME;
+                    continue;
+                }
+                break;
+
+            case HS_ATTR_NAME:
+                while (cur < end && !isSpace(*cur) && *cur != '/' && *cur != '=' && *cur != '>')
+                    addName(scanner, *cur++);
+                if (cur == end)
+                    return;
+                c = *cur;
+                attrNamed(scanner);
+                if (c == '=')
+                    scanner->state = HS_BEFORE_ATTR_VALUE;
+                else if (isSpace(c))
+                    scanner->state = HS_AFTER_ATTR_NAME;
+                else {
+                    // It has no value, and this is the next one or the end
+                    attrDone(scanner);
+                    scanner->state = HS_BEFORE_ATTR_NAME;
+                    continue;
+                }
+                break;
+
+            case HS_AFTER_ATTR_NAME:
+                if (c == '=')
+                    scanner->state = HS_BEFORE_ATTR_VALUE;
+                else if (!isSpace(c)) {
+                    // It had no value, and this is the next one or the end
+                    attrDone(scanner);
+                    scanner->state = HS_BEFORE_ATTR_NAME;
+                    continue;
+                }
+                break;
+
+            case HS_BEFORE_ATTR_VALUE:
+                if (isSpace(c))
+                    break;
+                if (c == '>') {
+                    attrDone(scanner);
+                    tagDone(scanner);
+                    break;
+                }
+                scanner->quote = c == '"' || c == '\'' ? c : 0;
+                scanner->state = HS_ATTR_VALUE;
+                if (scanner->quote == 0)
+                    continue; // c starts the value
+                break;
+
+            case HS_ATTR_VALUE: {
+                // Everything up to where it ends goes in one go
+                const char *stop = NULL;
+                if (scanner->quote != 0)
+                    stop = memchr(cur, scanner->quote, end - cur);
+                else {
+                    for (const char *p = cur; p < end && stop == NULL; p++) {
+                        if (isSpace(*p) || *p == '>')
+                            stop = p;
+                    }
+                }
+                appendValue(scanner, cur, (stop != NULL ? stop : end) - cur);
+                if (stop == NULL)
+                    return;
+
+                attrDone(scanner);
+                scanner->state = HS_BEFORE_ATTR_NAME;
+                if (*stop == '>')
+                    tagDone(scanner);
+                cur = stop + 1;
+                continue;
+            }
+
+            case HS_MARKUP:
+                scanner->state = c == '-' ? HS_COMMENT_START : HS_BOGUS;
+                if (c != '-')
+                    continue;
+                break;
+
+            case HS_COMMENT_START:
+                if (c != '-') {
+                    scanner->state = HS_BOGUS;
+                    continue;
+                }
+                // "<!-->" and "<!--->" are whole comments too, so it starts
+                // out as if the opening dashes could close it
+                scanner->state = HS_COMMENT;
+                scanner->dashes = 2;
+                break;
+
+            case HS_COMMENT: {
+                // It ends at the first '>' that has two dashes before it
+                const char *close = memchr(cur, '>', end - cur);
+                const char *stop = close != NULL ? close : end;
+                int run = 0;
+                while (stop - run > cur && stop[-run - 1] == '-')
+                    run++;
+                int dashes = run == stop - cur ? scanner->dashes + run : run;
+                if (close == NULL) {
+                    scanner->dashes = dashes;
+                    return;
+                }
+                if (dashes >= 2)
+                    scanner->state = HS_DATA;
+                scanner->dashes = 0;
+                cur = close + 1;
+                continue;
+            }
+
+            case HS_BOGUS: {
+                const char *close = memchr(cur, '>', end - cur);
+                if (close == NULL)
+                    return;
+                scanner->state = HS_DATA;
+                cur = close + 1;
+                continue;
+            }
+
+            case HS_RAW_TEXT: {
+                // Only its own end tag ends it
+                if (scanner->rawMatched == 0) {
+                    const char *open = memchr(cur, '<', end - cur);
+                    const char *stop = open != NULL ? open : end;
+                    if (scanner->tag == HS_TAG_STYLE)
+                        cssFeed(scanner, &(scanner->css), cur, stop - cur);
+                    if (open == NULL)
+                        return;
+                    scanner->rawMatched = 1;
+                    cur = open + 1;
+                    continue;
+                }
+
+                int nameLength = strlen(scanner->rawEnd);
+                int matched = scanner->rawMatched;
+                if (matched == 1 ? c == '/' : matched < 2 + nameLength && lower(c) == scanner->rawEnd[matched - 2]) {
+                    scanner->rawMatched++;
+                    break;
+                }
+                if (matched == 2 + nameLength && (isSpace(c) || c == '/' || c == '>'))
+                    scanner->state = HS_BOGUS; // the rest of the end tag
+                scanner->rawMatched = 0;
+                continue;
+            }
+        }
+        cur++;
+    }
+}
+
+const char *hs_nextUrl(HtmlScanner *scanner, const char *prev) {
+    const char *next = prev == NULL ? scanner->urls.buff : prev + strlen(prev) + 1;
+    return next < scanner->urls.buff + scanner->urls.size ? next : NULL;
+}
+
+void hs_term(HtmlScanner *scanner) {
+    da_term(&(scanner->urls));
+}
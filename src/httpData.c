@@ -1,9 +1,10 @@
 #include "httpData.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
-#include "zlib.h"
 
 
 ConnectionData *createConnectionData(int first, int second) {
@@ -30,6 +31,8 @@ ClientData *createClientData(int sock) {
     ClientData *data = malloc(sizeof(ClientData));
     data->sock = sock;
     da_init(&(data->buffer), 2048);
+    hp_init(&(data->parser));
+    rq_init(&(data->pipeline));
     return data;
 }
 
@@ -50,6 +53,8 @@ ServerData *createServerData(int sock, char *domain) {
     data->domain = malloc(strlen(domain) + 1);
     strcpy(data->domain, domain);
     da_init(&(data->buffer), 2048);
+    hp_init(&(data->parser));
+    data->busy = false;
     return data;
 }
 
@@ -72,26 +77,8 @@ bool servDomainCmp(ServerData *data, char *domain) {
 }
 
 
-PrefetchData *createPrefetchData(char *domain, DynamicArray *buff) {
-    PrefetchData *data = malloc(sizeof(PrefetchData));
-    data->url = malloc(strlen(domain) + 1);
-    strcpy(data->url, domain);
-    data->content = malloc(buff->size);
-    memcpy(data->content, buff->buff, buff->size);
-    data->contentLen = buff->size;
-    return data;
-}
-
-
-void termPrefetchData(PrefetchData *data) {
-    free(data->url);
-    free(data->content);
-    free(data);
-}
-
-
-bool prefetchUrlCmp(PrefetchData *data, char *url) {
-    return strcmp(data->url, url) == 0;
+bool servIdleDomainCmp(ServerData *data, char *domain) {
+    return !data->busy && servDomainCmp(data, domain);
 }
 
 
@@ -137,58 +124,237 @@ int dataListLength(DataList *list) {
 }
 
 
-char *uncompressGzip(char *outBuff, int *outSize, char *inBuff, int inSize) {
-    int chunkSize = *outSize;
-    int uncomSize = 0;
-    int uncomMaxSize = chunkSize;
-    char *chunk = malloc(sizeof(char) * chunkSize);
+static Encoding contentEncoding(const char *buf, HttpSlice value) {
+    if (hp_sliceEqualsNoCase(buf, value, "gzip") || hp_sliceEqualsNoCase(buf, value, "x-gzip"))
+        return GZIP;
+    if (hp_sliceEqualsNoCase(buf, value, "deflate"))
+        return DEFLATE;
+    if (hp_sliceEqualsNoCase(buf, value, "br"))
+        return BROTLI;
+    if (value.length == 0 || hp_sliceEqualsNoCase(buf, value, "identity"))
+        return NO_ENCODE;
+    return OTHER_ENCODING;
+}
+
+// A list of codings ("gzip, br") was applied one after the other, and is
+// kept in that order. Too many to undo end the list with OTHER_ENCODING
+static void contentEncodings(Header *header, const char *buf, HttpSlice value) {
+    int end = value.offset + value.length;
+    for (int start = value.offset; start < end; ) {
+        int stop = start;
+        while (stop < end && buf[stop] != ',')
+            stop++;
+        HttpSlice coding = { start, stop - start };
+        start = stop + 1;
+        while (coding.length > 0 && (buf[coding.offset] == ' ' || buf[coding.offset] == '\t')) {
+            coding.offset++;
+            coding.length--;
+        }
+        while (coding.length > 0 && (buf[coding.offset + coding.length - 1] == ' ' ||
+                                     buf[coding.offset + coding.length - 1] == '\t'))
+            coding.length--;
+
+        Encoding encoding = contentEncoding(buf, coding);
+        if (encoding == NO_ENCODE)
+            continue;
+        if (header->numEncodings == MAX_CODINGS) {
+            header->encodings[MAX_CODINGS - 1] = OTHER_ENCODING;
+            return;
+        }
+        header->encodings[header->numEncodings++] = encoding;
+    }
+}
+
+bool splitAuthority(char *buf, int start, int end, char *domain, char *port, const char *defaultPort) {
+    int hostEnd = end;
+    int portStart = -1;
 
-    z_stream stream;
-    stream.zalloc = Z_NULL;
-    stream.zfree = Z_NULL;
-    stream.opaque = Z_NULL;
-    stream.avail_in = inSize;
-    stream.next_in = (Bytef*)inBuff;
-    stream.avail_out = (uInt)chunkSize;
-    stream.next_out = (Bytef*)chunk;
+    // A NUL or control byte would cut the strings we copy into short, or
+    // end up in the lines we build from them
+    for (int i = start; i < end; i++) {
+        unsigned char c = buf[i];
+        if (c <= ' ' || c == 0x7f)
+            return false;
+    }
 
-    int res = inflateInit2(&stream, 16);
-    if (res != Z_OK) {
-        free(chunk);
-        return NULL;
+    // Skip over an IPv6 literal so its colons aren't taken for the port
+    int searchFrom = start;
+    if (start < end && buf[start] == '[') {
+        char *close = memchr(buf + start, ']', end - start);
+        if (close == NULL)
+            return false;
+        searchFrom = close - buf;
     }
+    char *colon = memchr(buf + searchFrom, ':', end - searchFrom);
+    if (colon != NULL) {
+        hostEnd = colon - buf;
+        portStart = hostEnd + 1;
+    }
+
+    int hostLen = hostEnd - start;
+    if (hostLen <= 0 || hostLen >= sizeof(((Header*)0)->domain))
+        return false;
+    memcpy(domain, buf + start, hostLen);
+    domain[hostLen] = '\0';
 
-    // Continue to inflate until we consummed all input
-    do {
-        res = inflate(&stream, Z_SYNC_FLUSH);
-        memcpy(outBuff + uncomSize, chunk, chunkSize);
-        uncomSize += chunkSize;
-
-        // resize outBuff to accomodate increased size
-        // from compressed to uncompressed
-        if (uncomSize + chunkSize >= uncomMaxSize) {
-            uncomMaxSize *= 2;
-            outBuff = realloc(outBuff, uncomMaxSize);
+    int portLen = portStart == -1 ? 0 : end - portStart;
+    if (portLen == 0) {
+        strcpy(port, defaultPort);
+    } else {
+        if (portLen >= sizeof(((Header*)0)->port))
+            return false;
+        memcpy(port, buf + portStart, portLen);
+        port[portLen] = '\0';
+    }
+    return true;
+}
+
+HpStatus parseHeader(Header *outHeader, HttpParser *parser, DynamicArray *buff) {
+    // The parser keeps its place between calls, so bytes that were already
+    // looked at on an earlier read aren't scanned again
+    HpStatus status = hp_feed(parser, buff->buff, buff->size);
+    if (status != HP_COMPLETE)
+        return status;
+
+    outHeader->contentLength = -1;
+    outHeader->chunkedEncoding = false;
+    outHeader->age = 0;
+    outHeader->numEncodings = 0;
+    outHeader->url[0] = '\0';
+    outHeader->domain[0] = '\0';
+    outHeader->port[0] = '\0';
+
+    // The tokenizer only records slices, so nothing gets copied until we
+    // pull out the few fields the proxy cares about
+    HttpMessage *msg = &parser->msg;
+    char *buf = buff->buff;
+    outHeader->headerLength = msg->headerLength;
+
+    bool originForm = false;
+    if (msg->isResponse) {
+        outHeader->status = hp_sliceToLong(buf, msg->status, 10);
+    } else {
+        HttpSlice target = msg->target;
+        if (target.length >= sizeof(outHeader->url) || memchr(buf + target.offset, '\0', target.length) != NULL)
+            return HP_ERROR;
+
+        static const char *methodNames[] = {
+            [GET] = "GET", [CONNECT] = "CONNECT", [POST] = "POST", [HEAD] = "HEAD",
+            [PUT] = "PUT", [DELETE] = "DELETE", [OPTIONS] = "OPTIONS", [PATCH] = "PATCH"
+        };
+        outHeader->method = OTHER_METHOD;
+        for (Method method = GET; method < OTHER_METHOD; method++) {
+            if (hp_sliceEquals(buf, msg->method, methodNames[method])) {
+                outHeader->method = method;
+                break;
+            }
+        }
+
+        memcpy(outHeader->url, buf + target.offset, target.length);
+        outHeader->url[target.length] = '\0';
+
+        // CONNECT has just "host:port", everything else is either an
+        // absolute URL or a path with the host in the Host field
+        int targetEnd = target.offset + target.length;
+        if (outHeader->method == CONNECT) {
+            if (!splitAuthority(buf, target.offset, targetEnd, outHeader->domain, outHeader->port, "443"))
+                return HP_ERROR;
+        } else if (target.length > 7 && strncasecmp(buf + target.offset, "http://", 7) == 0) {
+            int authStart = target.offset + 7;
+            char *slash = memchr(buf + authStart, '/', targetEnd - authStart);
+            int authEnd = slash == NULL ? targetEnd : slash - buf;
+            if (!splitAuthority(buf, authStart, authEnd, outHeader->domain, outHeader->port, "80"))
+                return HP_ERROR;
+        } else {
+            originForm = true;
         }
-        stream.avail_out = (uInt)chunkSize;
-        stream.next_out = (Bytef*)chunk;
-    } while (res == Z_OK);
-
-    if (res != Z_STREAM_END) {
-        fprintf(stderr, "Gzip inflate error: %d\n", res);
-        inflateEnd(&stream);
-        free(chunk);
-        return NULL;
     }
 
-    res = inflateEnd(&stream);
-    if (res != Z_OK) {
-        free(chunk);
-        return NULL;
+    // The parser already tagged each field with its name, so indexing them
+    // is one pass with no string compares. The first of a repeated field
+    // wins, except Content-Length, where copies that disagree are an error
+    memset(outHeader->fields, 0, sizeof(outHeader->fields));
+    for (int i = 0; i < msg->numFields; i++) {
+        HttpField *field = &msg->fields[i];
+        if (field->id == HDR_OTHER)
+            continue;
+
+        HttpField *first = &outHeader->fields[field->id];
+        if (first->line.length == 0) {
+            *first = *field;
+        } else if (field->id == HDR_CONTENT_LENGTH &&
+                   hp_sliceToLong(buf, field->value, 10) != hp_sliceToLong(buf, first->value, 10)) {
+            return HP_ERROR;
+        }
     }
 
-    // Uncompress worked
-    *outSize = stream.total_out;
-    free(chunk);
-    return outBuff;
-}
\ No newline at end of file
+    HttpField *field;
+    if ((field = getField(outHeader, HDR_HOST)) != NULL && outHeader->domain[0] == '\0') {
+        // The URL's host wins over the Host field if they differ
+        int valueEnd = field->value.offset + field->value.length;
+        if (!splitAuthority(buf, field->value.offset, valueEnd, outHeader->domain, outHeader->port, "80"))
+            return HP_ERROR;
+    }
+    if ((field = getField(outHeader, HDR_TRANSFER_ENCODING)) != NULL)
+        outHeader->chunkedEncoding = hp_sliceHasToken(buf, field->value, "chunked");
+    if ((field = getField(outHeader, HDR_CONTENT_LENGTH)) != NULL) {
+        long contentLength = hp_sliceToLong(buf, field->value, 10);
+        if (contentLength < 0 || contentLength > INT_MAX)
+            return HP_ERROR;
+        outHeader->contentLength = contentLength;
+    }
+    if ((field = getField(outHeader, HDR_AGE)) != NULL) {
+        // The line itself stays in the buffer. It gets skipped when we send
+        // our own Age field
+        long age = hp_sliceToLong(buf, field->value, 10);
+        outHeader->age = age < 0 ? 0 : age;
+    }
+    if ((field = getField(outHeader, HDR_CONTENT_ENCODING)) != NULL)
+        contentEncodings(outHeader, buf, field->value);
+
+    // Message length rules, in the order HTTP/1.1 applies them. A
+    // response to HEAD has no body either, but only the caller knows
+    // what the request was
+    if (msg->isResponse && ((outHeader->status >= 100 && outHeader->status < 200) ||
+                            outHeader->status == 204 || outHeader->status == 304))
+        outHeader->framing = BODY_NONE;
+    else if (outHeader->chunkedEncoding)
+        outHeader->framing = BODY_CHUNKED;
+    else if (getField(outHeader, HDR_TRANSFER_ENCODING) != NULL) {
+        // Some other coding we can't take apart. A response like that
+        // runs until close; a request like that can't be framed at all
+        if (!msg->isResponse)
+            return HP_ERROR;
+        outHeader->framing = BODY_UNTIL_CLOSE;
+    }
+    else if (outHeader->contentLength != -1)
+        outHeader->framing = outHeader->contentLength > 0 || msg->isResponse ? BODY_LENGTH : BODY_NONE;
+    else
+        outHeader->framing = msg->isResponse ? BODY_UNTIL_CLOSE : BODY_NONE;
+
+    // HTTP/1.1 connections stay open unless someone says otherwise, 1.0
+    // ones close unless someone asks for keep-alive. Clients talking to a
+    // proxy sometimes say it with Proxy-Connection instead
+    HttpField *connection = getField(outHeader, HDR_CONNECTION);
+    if (connection == NULL && !msg->isResponse)
+        connection = getField(outHeader, HDR_PROXY_CONNECTION);
+    if (connection != NULL && hp_sliceHasToken(buf, connection->value, "close"))
+        outHeader->keepAlive = false;
+    else if (hp_sliceEquals(buf, msg->version, "HTTP/1.0"))
+        outHeader->keepAlive = connection != NULL && hp_sliceHasToken(buf, connection->value, "keep-alive");
+    else
+        outHeader->keepAlive = true;
+
+    if (originForm) {
+        // Give path-only requests a full URL so cache keys from
+        // different hosts don't collide
+        if (outHeader->domain[0] == '\0')
+            return HP_ERROR;
+        int urlLen = snprintf(outHeader->url, sizeof(outHeader->url), "http://%s%.*s",
+                              outHeader->domain, msg->target.length, buf + msg->target.offset);
+        if (urlLen >= sizeof(outHeader->url))
+            return HP_ERROR;
+    }
+
+    return HP_COMPLETE;
+}
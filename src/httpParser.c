@@ -0,0 +1,323 @@
+#include "httpParser.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include "scan.h"
+
+static const ByteSet fieldDelims = { .bytes = ":\n", .count = 2, .member = { [':'] = true, ['\n'] = true } };
+
+static inline char foldCase(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Every name we know has a different (length, first letter) pair, so that
+// pair is a perfect hash: it picks the one candidate, and a single compare
+// confirms it. Adding a name that collides with another will trip the
+// check in the benchmark's cross-check.
+#define HDR_MAX_NAME 19
+
+static const struct {
+    const char *name;
+    int length;
+} headerNames[HDR_COUNT] = {
+#define NAME(id, str) [id] = { str, sizeof(str) - 1 }
+    NAME(HDR_OTHER, ""),
+    NAME(HDR_TE, "TE"),
+    NAME(HDR_AGE, "Age"),
+    NAME(HDR_VIA, "Via"),
+    NAME(HDR_HOST, "Host"),
+    NAME(HDR_ETAG, "ETag"),
+    NAME(HDR_DATE, "Date"),
+    NAME(HDR_VARY, "Vary"),
+    NAME(HDR_RANGE, "Range"),
+    NAME(HDR_COOKIE, "Cookie"),
+    NAME(HDR_PRAGMA, "Pragma"),
+    NAME(HDR_EXPECT, "Expect"),
+    NAME(HDR_EXPIRES, "Expires"),
+    NAME(HDR_UPGRADE, "Upgrade"),
+    NAME(HDR_TRAILER, "Trailer"),
+    NAME(HDR_LOCATION, "Location"),
+    NAME(HDR_CONNECTION, "Connection"),
+    NAME(HDR_KEEP_ALIVE, "Keep-Alive"),
+    NAME(HDR_USER_AGENT, "User-Agent"),
+    NAME(HDR_SET_COOKIE, "Set-Cookie"),
+    NAME(HDR_CONTENT_TYPE, "Content-Type"),
+    NAME(HDR_CACHE_CONTROL, "Cache-Control"),
+    NAME(HDR_LAST_MODIFIED, "Last-Modified"),
+    NAME(HDR_IF_NONE_MATCH, "If-None-Match"),
+    NAME(HDR_CONTENT_LENGTH, "Content-Length"),
+    NAME(HDR_ACCEPT_ENCODING, "Accept-Encoding"),
+    NAME(HDR_CONTENT_ENCODING, "Content-Encoding"),
+    NAME(HDR_PROXY_CONNECTION, "Proxy-Connection"),
+    NAME(HDR_TRANSFER_ENCODING, "Transfer-Encoding"),
+    NAME(HDR_IF_MODIFIED_SINCE, "If-Modified-Since"),
+    NAME(HDR_PROXY_AUTHENTICATE, "Proxy-Authenticate"),
+    NAME(HDR_PROXY_AUTHORIZATION, "Proxy-Authorization"),
+#undef NAME
+};
+
+// [length][first letter - 'a'], 0 (HDR_OTHER) where nothing fits
+static const unsigned char nameSlots[HDR_MAX_NAME + 1][26] = {
+#define SLOT(id, length, first) [length][first - 'a'] = id
+    SLOT(HDR_TE, 2, 't'),
+    SLOT(HDR_AGE, 3, 'a'),
+    SLOT(HDR_VIA, 3, 'v'),
+    SLOT(HDR_HOST, 4, 'h'),
+    SLOT(HDR_ETAG, 4, 'e'),
+    SLOT(HDR_DATE, 4, 'd'),
+    SLOT(HDR_VARY, 4, 'v'),
+    SLOT(HDR_RANGE, 5, 'r'),
+    SLOT(HDR_COOKIE, 6, 'c'),
+    SLOT(HDR_PRAGMA, 6, 'p'),
+    SLOT(HDR_EXPECT, 6, 'e'),
+    SLOT(HDR_EXPIRES, 7, 'e'),
+    SLOT(HDR_UPGRADE, 7, 'u'),
+    SLOT(HDR_TRAILER, 7, 't'),
+    SLOT(HDR_LOCATION, 8, 'l'),
+    SLOT(HDR_CONNECTION, 10, 'c'),
+    SLOT(HDR_KEEP_ALIVE, 10, 'k'),
+    SLOT(HDR_USER_AGENT, 10, 'u'),
+    SLOT(HDR_SET_COOKIE, 10, 's'),
+    SLOT(HDR_CONTENT_TYPE, 12, 'c'),
+    SLOT(HDR_CACHE_CONTROL, 13, 'c'),
+    SLOT(HDR_LAST_MODIFIED, 13, 'l'),
+    SLOT(HDR_IF_NONE_MATCH, 13, 'i'),
+    SLOT(HDR_CONTENT_LENGTH, 14, 'c'),
+    SLOT(HDR_ACCEPT_ENCODING, 15, 'a'),
+    SLOT(HDR_CONTENT_ENCODING, 16, 'c'),
+    SLOT(HDR_PROXY_CONNECTION, 16, 'p'),
+    SLOT(HDR_TRANSFER_ENCODING, 17, 't'),
+    SLOT(HDR_IF_MODIFIED_SINCE, 17, 'i'),
+    SLOT(HDR_PROXY_AUTHENTICATE, 18, 'p'),
+    SLOT(HDR_PROXY_AUTHORIZATION, 19, 'p'),
+#undef SLOT
+};
+
+static HttpSlice makeSlice(int start, int end) {
+    HttpSlice slice = { start, end - start };
+    return slice;
+}
+
+// Slice of [start, end) without the spaces and tabs around it
+static HttpSlice trimSlice(const char *buf, int start, int end) {
+    while (start < end && isSpace(buf[start]))
+        start++;
+    while (end > start && isSpace(buf[end - 1]))
+        end--;
+    return makeSlice(start, end);
+}
+
+// Splits "GET /index.html HTTP/1.1" or "HTTP/1.1 200 OK" into its pieces.
+// end points at the line ending, so it's excluded
+static bool parseStartLine(HttpMessage *msg, const char *buf, int start, int end) {
+    const char *firstSp = memchr(buf + start, ' ', end - start);
+    if (firstSp == NULL)
+        return false;
+    int first = firstSp - buf;
+
+    // The reason phrase in a status line can be empty, so the second space
+    // is optional there
+    const char *secondSp = memchr(buf + first + 1, ' ', end - first - 1);
+    int second = secondSp == NULL ? end : secondSp - buf;
+
+    msg->startLine = makeSlice(start, end);
+    msg->isResponse = end - start >= 5 && memcmp(buf + start, "HTTP/", 5) == 0;
+
+    if (msg->isResponse) {
+        msg->version = makeSlice(start, first);
+        msg->status = makeSlice(first + 1, second);
+        msg->reason = second == end ? makeSlice(end, end) : makeSlice(second + 1, end);
+        return msg->status.length == 3;
+    }
+
+    if (secondSp == NULL)
+        return false;
+    msg->method = makeSlice(start, first);
+    msg->target = makeSlice(first + 1, second);
+    msg->version = makeSlice(second + 1, end);
+    return msg->method.length > 0 && msg->target.length > 0 &&
+           msg->version.length >= 5 && memcmp(buf + second + 1, "HTTP/", 5) == 0;
+}
+
+void hp_init(HttpParser *parser) {
+    parser->msg.numFields = 0;
+    parser->msg.headerLength = 0;
+    parser->msg.startLine = makeSlice(0, 0);
+    parser->status = HP_NEED_MORE;
+    parser->pos = 0;
+    parser->scanned = 0;
+    parser->colon = -1;
+    parser->sawStartLine = false;
+}
+
+HpStatus hp_feed(HttpParser *parser, const char *buf, int size) {
+    if (parser->status != HP_NEED_MORE)
+        return parser->status;
+
+    HttpMessage *msg = &parser->msg;
+
+    // Never look past the longest header we'd accept, so a client that
+    // never sends the blank line can't make us scan forever
+    int limit = size < HP_MAX_HEADER ? size : HP_MAX_HEADER;
+    if (limit <= parser->scanned)
+        return HP_NEED_MORE;
+
+    // One vectorized pass over the new bytes picks out every colon and
+    // newline. Colons after the first one on a line (in dates, URLs) are
+    // just skipped
+    ScanCursor cursor;
+    scan_cursorInit(&cursor, buf + parser->scanned, limit - parser->scanned, &fieldDelims);
+
+    const char *hit;
+    while ((hit = scan_next(&cursor)) != NULL) {
+        int offset = hit - buf;
+        if (*hit == ':') {
+            if (parser->colon == -1)
+                parser->colon = offset;
+            continue;
+        }
+
+        int pos = parser->pos;
+        int colon = parser->colon;
+        if (offset - pos > HP_MAX_LINE)
+            return parser->status = HP_ERROR;
+        int contentEnd = offset;
+        if (contentEnd > pos && buf[contentEnd - 1] == '\r')
+            contentEnd--;
+        int next = offset + 1;
+
+        if (!parser->sawStartLine) {
+            // Clients can send stray blank lines between requests
+            if (contentEnd != pos) {
+                if (!parseStartLine(msg, buf, pos, contentEnd))
+                    return parser->status = HP_ERROR;
+                parser->sawStartLine = true;
+            }
+        } else if (contentEnd == pos) {
+            msg->headerLength = next;
+            parser->pos = parser->scanned = next;
+            return parser->status = HP_COMPLETE;
+        } else {
+            // Folded header lines are obsolete, and a name can't have
+            // whitespace before the colon
+            if (isSpace(buf[pos]))
+                return parser->status = HP_ERROR;
+            if (colon == -1 || colon == pos || isSpace(buf[colon - 1]))
+                return parser->status = HP_ERROR;
+            if (msg->numFields == HP_MAX_FIELDS)
+                return parser->status = HP_ERROR;
+
+            HttpField *field = &msg->fields[msg->numFields++];
+            field->name = makeSlice(pos, colon);
+            field->value = trimSlice(buf, colon + 1, contentEnd);
+            field->line = makeSlice(pos, next);
+            field->id = hp_lookupName(buf + pos, colon - pos);
+        }
+        parser->colon = -1;
+        parser->pos = next;
+    }
+
+    parser->scanned = limit;
+    if (size >= HP_MAX_HEADER || limit - parser->pos > HP_MAX_LINE)
+        return parser->status = HP_ERROR;
+    return HP_NEED_MORE;
+}
+
+int hp_parse(HttpMessage *msg, const char *buf, int size) {
+    HttpParser parser;
+    hp_init(&parser);
+    HpStatus status = hp_feed(&parser, buf, size);
+
+    *msg = parser.msg;
+    if (status == HP_COMPLETE)
+        return msg->headerLength;
+    return status == HP_ERROR ? -1 : 0;
+}
+
+HeaderName hp_lookupName(const char *name, int length) {
+    if (length <= 0 || length > HDR_MAX_NAME)
+        return HDR_OTHER;
+    unsigned first = (unsigned char)foldCase(name[0]) - 'a';
+    if (first >= 26)
+        return HDR_OTHER;
+
+    HeaderName id = nameSlots[length][first];
+    if (id == HDR_OTHER)
+        return HDR_OTHER;
+
+    const char *expected = headerNames[id].name;
+    for (int i = 1; i < length; i++) {
+        if (foldCase(name[i]) != foldCase(expected[i]))
+            return HDR_OTHER;
+    }
+    return id;
+}
+
+const char *hp_headerName(HeaderName id) {
+    return id > HDR_OTHER && id < HDR_COUNT ? headerNames[id].name : NULL;
+}
+
+bool hp_sliceEquals(const char *buf, HttpSlice slice, const char *str) {
+    size_t len = strlen(str);
+    return (size_t)slice.length == len && memcmp(buf + slice.offset, str, len) == 0;
+}
+
+bool hp_sliceEqualsNoCase(const char *buf, HttpSlice slice, const char *str) {
+    if ((size_t)slice.length != strlen(str))
+        return false;
+
+    const char *cur = buf + slice.offset;
+    for (int i = 0; i < slice.length; i++) {
+        if (foldCase(cur[i]) != foldCase(str[i]))
+            return false;
+    }
+    return true;
+}
+
+bool hp_sliceHasToken(const char *buf, HttpSlice slice, const char *token) {
+    int end = slice.offset + slice.length;
+    int start = slice.offset;
+    while (start <= end) {
+        const char *comma = memchr(buf + start, ',', end - start);
+        int tokenEnd = comma == NULL ? end : comma - buf;
+        if (hp_sliceEqualsNoCase(buf, trimSlice(buf, start, tokenEnd), token))
+            return true;
+        start = tokenEnd + 1;
+    }
+    return false;
+}
+
+long hp_sliceToLong(const char *buf, HttpSlice slice, int base) {
+    if (slice.length == 0)
+        return -1;
+
+    long value = 0;
+    for (int i = 0; i < slice.length; i++) {
+        char c = foldCase(buf[slice.offset + i]);
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return -1;
+
+        if (value > (LONG_MAX - digit) / base)
+            return -1;
+        value = value * base + digit;
+    }
+    return value;
+}
+
+int hp_findField(HttpMessage *msg, const char *buf, const char *name) {
+    for (int i = 0; i < msg->numFields; i++) {
+        if (hp_sliceEqualsNoCase(buf, msg->fields[i].name, name))
+            return i;
+    }
+    return -1;
+}
@@ -1,67 +1,217 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bodyDecoder.h"
 #include "cache.h"
+#include "chunkDecoder.h"
 #include "dynamicArray.h"
+#include "filterReload.h"
+#include "headerRewrite.h"
 #include "httpData.h"
+#include "httpParser.h"
+#include "htmlScanner.h"
+#include "prefetcher.h"
+#include "prefetchStore.h"
+#include "responseQueue.h"
+#include "siteBlocklist.h"
 #include "bloomFilter.h"
 #include "tokenBucket.h"
 #include "contentFilter.h"
+#include "workerPool.h"
+
+// Everything the event loop keeps from one event to the next
+typedef struct {
+    int epollfd;
+    ContentFilter *filter;
+    SiteBlocklist *sites;
+    HashTable *cache;
+    BloomFilter *oneHitBloom; // a set of URLs that had at least one hit
+    TokenBuckets *rateLimitTB;
+    DynamicArray reqBuff;     // the response being read
+    DataList *connections;    // ConnectionData
+    DataList *clients;        // ClientData
+    DataList *servers;        // ServerData
+    PrefetchStore images;     // what the prefetcher brought in
+    WorkerPool workers;       // decodes and scans big bodies
+    Prefetcher prefetcher;    // fetches what pages load along with them
+} Proxy;
+
+// Called as a body comes in, with how much of the message has arrived so
+// far. Returns how many bytes it let go of from the front of the buffer,
+// which the read carries on without, or -1 to stop the read
+typedef int (*BodyProgress)(void *ctx, int messageSize);
+
+// A response on its way from a server to a client. The body is decoded
+// as it arrives and handed to the filter and the page scanner a window
+// at a time, and the client gets it once it's been scanned.
+//
+// The start of a body is inspected on the loop as it's read. Past
+// INLINE_INSPECT_BYTES, what arrives is queued for a worker, which decodes
+// and scans it while the loop reads on. The worker has the decoder,
+// filter and scanner to itself while it runs, and what it shares with the
+// loop is behind lock. If it's still going once the body is all in, the
+// response is parked along with its buffer, the loop gets on with other
+// clients, and resumeClient sends it when the worker's done.
+//
+// Only a response the cache is going to take is held whole. Any other
+// one goes through a window: what the client has is shifted out of the
+// buffer, and a chunked body's data is dropped once it's been inspected
+typedef struct {
+    Proxy *proxy;
+    int clientConn;
+    Header request;
+    Header response;
+    DynamicArray *buffer;       // the response as it came in, from dropped on
+    DynamicArray parkedBuffer;  // what buffer points to once it's parked
+    DynamicArray dechunked;
+    DynamicArray *decoded;      // a chunked body's data without the framing, or NULL
+    int dropped;                // bytes of the message let go of from buffer
+    bool keep;                  // all of it is held for the cache
+    BodyDecoder decoder;        // undoes the Content-Encoding
+    FilterStream filter;
+    HtmlScanner resources;      // what the page loads along with it
+    int fed;                    // body bytes inspected or queued so far
+    int sent;                   // bytes of the message the client already has
+    bool closing;               // what the Connection line we send says
+    bool clientGone;            // a write to the client failed, so it's closed after
+    bool unscannable;           // in a coding we can't undo, so it's refused
+    bool offloaded;             // the rest of the body goes to a worker
+
+    // Shared with the worker
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        // signalled when running goes false
+    DynamicArray queued;        // body bytes the worker hasn't taken yet
+    DynamicArray taking;        // the ones it's working through
+    int queuedThrough;          // how much of the message is queued or inspected
+    int cleanThrough;           // how much of it is inspected and clean
+    bool running;               // a worker has it, or is about to
+    bool parked;                // the body is in, and waits on the worker
+    bool matched;               // the worker found a term
+    bool inspectDone;           // the worker won't look at any more of it
+
+    // How the rest of the request went, for finishing it
+    bool cacheable;
+    bool closeAfter;
+    int bodySize;
+    int requestLength;
+} ResponseRelay;
 
 /************ Proxy Helpers ************/
 int createClientSock(const char* port);
 int createServerSock(char* domain, char* port);
-bool parseHeader(Header* outHeader, DynamicArray* buff);
-int readBody(int sock, Header* header, DynamicArray* buffer);
-void prefetchImgTags(char *html, DataList **imageServers, int epollfd);
+bool readResponseHeader(int sock, int clientSock, Header *header, DynamicArray *buffer);
+HpStatus parseFinalHeader(int clientSock, Header *header, HttpParser *parser, DynamicArray *buffer);
+int takeRequestBody(Header *request, ChunkDecoder *decoder, long *remaining, const char *data, int len);
+int forwardRequestBody(int clientConn, int serverSock, Header *request, DynamicArray *clientBuff, DynamicArray *responseBuff, bool *answeredEarly);
+bool serverAnswered(int serverSock, int clientConn, DynamicArray *responseBuff, bool *answeredEarly);
+int readMore(int sock, DynamicArray *buffer);
+int readBody(int sock, Header* header, DynamicArray* buffer, DynamicArray *decoded, bool *complete, BodyProgress progress, void *ctx);
+void serveRequests(Proxy *proxy, ClientData *clientData);
+bool finishResponse(ResponseRelay *relay);
+void resumeClient(ResponseRelay *relay);
+ResponseRelay *relayCreate(Proxy *proxy, int clientConn, Header *request, Header *response, bool closing, bool cacheable);
+void relayInspect(ResponseRelay *relay, const char *data, int len);
+bool relayWork(ResponseRelay *relay);
+int relayQueue(ResponseRelay *relay, const char *data, int len, int messageSize);
+int relayCatchUp(ResponseRelay *relay);
+int relayProgress(ResponseRelay *relay, int messageSize);
+bool relayPark(ResponseRelay *relay);
+void relayDelete(ResponseRelay *relay);
+void closeClient(Proxy *proxy, int clientConn);
+bool idleSockOpen(int sock);
+int upstreamSock(DataList **servers, Header *request, bool *reused);
+void sendAhead(ResponseQueue *queue, DynamicArray *clientBuff, DataList **servers, PrefetchStore *images, HashTable *cache, SiteBlocklist *sites);
+bool siteBlocked(SiteBlocklist *sites, Header *request);
 void socketError(char* funcName);
-ssize_t writeResponseWithAge(int writeSock, char *data, int headerSize, int dataSize, time_t age);
+bool addProxyFields(HeaderRewrite *rw, HttpMessage *msg);
+ssize_t writeRequestHeader(int sock, const char *data, int headerLength);
+ssize_t writeResponse(int writeSock, char *data, int dataSize, time_t age, const char *xCache, bool closing);
 char *getErrorHTML();
 void getBlockedHttp(char *out, char *html);
 /******************************************/
 
+#define VIA_NAME "comp112-proxy" // how we show up in Via
 #define MAX_EVENTS 100  // For epoll_wait()
 #define BYTES_PER_MIN 40000 // For rate-limiting
+// Seconds a request body can go without either side moving before both
+// connections are dropped. Until then the loop waits on that one upload
+#define UPLOAD_IDLE_TIMEOUT 10
+// The blacklist, reloaded when either file changes or on SIGHUP. The
+// compiled one (see tools/compileBlacklist.c) is mapped rather than built,
+// so it's used unless the text list was edited after it was compiled
+#define BLACKLIST_FILE "res/contentBlacklist.txt"
+#define BLACKLIST_COMPILED "res/contentBlacklist.bin"
+#define SITE_BLOCKLIST_FILE "res/siteBlocklist.txt" // refused before connecting
+
+// How much of a response is held back waiting for the filter. Bodies that
+// fit are only sent once all of them has been scanned, so a match still
+// gets the blocked page. Past this, scanned bytes go out as they arrive,
+// and a match can only cut the response off
+#define HOLD_BACK_BYTES (256 * 1024)
+
+// Biggest response the cache takes. Only ones that may fit are read in
+// whole; the rest are let go of as they're sent, and reading waits for a
+// worker that's fallen more than RELAY_WINDOW behind
+#define CACHE_MAX_RESPONSE (2 * 1024 * 1024)
+#define RELAY_WINDOW (1024 * 1024)
+#define READ_BYTES (64 * 1024) // most of a body taken in per read
+
+// Most of a body that gets decoded and scanned. Whatever comes after this
+// goes through unlooked at, so a huge (or highly compressed) body costs no
+// more to inspect than one this size
+#define INSPECT_LIMIT (16 * 1024 * 1024)
+
+// Bodies are inspected on the loop up to this size, since handing them to
+// a worker costs more than it saves, and the rest of a bigger one is left
+// to one of WORKER_THREADS. A coded body can decode to a thousand times
+// its size, so those go to a worker past INLINE_CODED_BYTES of what's read
+#define INLINE_INSPECT_BYTES (64 * 1024)
+#define INLINE_CODED_BYTES (2 * 1024)
+#define WORKER_THREADS 4
+
+// Prefetched responses held for clients to ask for, across every page.
+// Past this, the ones least recently asked about make way
+#define PREFETCH_BYTES (32 * 1024 * 1024)
+
+// Whether a body in a Content-Encoding we can't undo, so can't scan, is
+// refused with the blocked page. Passing them lets the blacklist be
+// dodged by naming a coding we don't know
+#define REFUSE_UNKNOWN_CODINGS true
 
 int main(int argc, char **argv) {
     // For epoll
-    int epollfd;
     struct epoll_event ev;                  // epoll_ctl()
     struct epoll_event events[MAX_EVENTS];  // epoll_wait()
     int nfds;
 
-    // Caching, filtering, and rate-limiting
-    ContentFilter *filter;
-    HashTable *cache;
-    BloomFilter *oneHitBloom; // a set of URLs that had at least one hit
-    TokenBuckets *rateLimitTB;
+    // Caching, filtering, rate-limiting, and every connection we have
+    Proxy proxy = { 0 };
+    const char *blacklist;
+    FilterReloader reloader;
 
     // Client-side communication
     int clientSock, clientConn;
 
-    // Server-side communication
-    DynamicArray reqBuff;
-
-    // DataLists
-    DataList *connections = NULL; // ConnectionData
-    DataList *clients = NULL; // ClientData
-    DataList *servers = NULL; // ServerData
-    DataList *images = NULL; // PrefetchData
-    DataList *imageServers = NULL; // ServerData
-
     signal(SIGPIPE, SIG_IGN);  // ignore sigpipe, handle with write call
 
     if (argc != 2) {
@@ -71,20 +221,26 @@ int main(int argc, char **argv) {
     }
 
     // Data structures initialization
-    da_init(&reqBuff, 2048);
-    filter = cf_create("res/contentBlacklist.txt");
-    cache = malloc(sizeof(HashTable));
-    ht_init(cache, 10, keyHash, keyCmp, termCacheObj);
-    oneHitBloom = bf_create();
-    rateLimitTB = tb_create(BYTES_PER_MIN);
+    da_init(&(proxy.reqBuff), 2048);
+    blacklist = fr_pick(BLACKLIST_FILE, BLACKLIST_COMPILED);
+    if (blacklist == NULL)
+        blacklist = BLACKLIST_FILE; // builds empty, until one shows up
+    printf("Using blacklist %s\n", blacklist);
+    proxy.filter = cf_create((char*)blacklist);
+    proxy.sites = sb_create(SITE_BLOCKLIST_FILE);
+    proxy.cache = malloc(sizeof(HashTable));
+    ht_init(proxy.cache, 10, keyHash, keyCmp, termCacheObj);
+    proxy.oneHitBloom = bf_create();
+    proxy.rateLimitTB = tb_create(BYTES_PER_MIN);
+    ps_init(&(proxy.images), PREFETCH_BYTES);
 
     // Create socket for client-side communication
     if ((clientSock = createClientSock(argv[1])) == -1)
         return 1;
 
     // Create epoll instance
-    epollfd = epoll_create1(0);
-    if (epollfd == -1) {
+    proxy.epollfd = epoll_create1(0);
+    if (proxy.epollfd == -1) {
         fprintf(stderr, "Error on epoll_create1()\n");
         exit(EXIT_FAILURE);
     }
@@ -92,14 +248,24 @@ int main(int argc, char **argv) {
     // Register clientSock to the epoll instance
     ev.events = EPOLLIN;
     ev.data.fd = clientSock;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientSock, &ev) == -1) {
+    if (epoll_ctl(proxy.epollfd, EPOLL_CTL_ADD, clientSock, &ev) == -1) {
         fprintf(stderr, "Error on epoll_ctl() on clientSock\n");
         exit(EXIT_FAILURE);
     }
 
+    // Rebuilt on another thread, and swapped in between events. Without
+    // it the proxy still runs, with the list it started with
+    fr_init(&reloader, BLACKLIST_FILE, BLACKLIST_COMPILED, proxy.epollfd);
+
+    // Started after the reloader, so the workers don't take SIGHUP either.
+    // Without them every body is inspected on the loop
+    wp_init(&(proxy.workers), WORKER_THREADS, proxy.epollfd);
+    pf_init(&(proxy.prefetcher), proxy.epollfd, &(proxy.workers));
+
     for (;;) {
-        // Blocking wait, waits for events to happen
-        nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        // Blocking wait, waits for events to happen, or until the next
+        // prefetched response goes stale
+        nfds = epoll_wait(proxy.epollfd, events, MAX_EVENTS, ps_expire(&(proxy.images)));
         if (nfds == -1) {
             fprintf(stderr, "Error on epoll_wait()\n");
             exit(EXIT_FAILURE);
@@ -123,24 +289,30 @@ int main(int argc, char **argv) {
                     fprintf(stderr, "Error on fcntl()\n");
                 }
 
-                clients = addData(clients, createClientData(clientConn));
+                proxy.clients = addData(proxy.clients, createClientData(clientConn));
 
                 // Register the clientConn socket to the epoll instance
                 ev.events = EPOLLIN; // | EPOLLET;
                 ev.data.fd = clientConn;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientConn, &ev) == -1) {
+                if (epoll_ctl(proxy.epollfd, EPOLL_CTL_ADD, clientConn, &ev) == -1) {
                     fprintf(stderr, "Error on epoll_ctl() on clientConn\n");
                 }
+            } else if (fr_handle(&reloader, events[n].data.fd, &(proxy.filter))) {
+                // The blacklist changed, or a new one is ready to use
+            } else if (wp_handle(&(proxy.workers), events[n].data.fd)) {
+                // Parked responses the workers finished with went out
+            } else if (pf_handle(&(proxy.prefetcher), events[n].data.fd, &(proxy.images), proxy.filter)) {
+                // Something being prefetched got further
             } else { // HTTP request from a client
                 clientConn = events[n].data.fd;
                 //printf("clientConn: %d\n", clientConn);
                 // First check to see if it's an active connection
                 // If so, forward data between
-                DataList *connDl = findData(connections, (CmpFunc)connSockCmp, &clientConn);
+                DataList *connDl = findData(proxy.connections, (CmpFunc)connSockCmp, &clientConn);
                 if (connDl) {
                     ConnectionData *connData = connDl->data;
                     int otherSock = connData->first == clientConn ? connData->second : connData->first;
-                    if (tb_ratelimit(rateLimitTB, clientConn)) {
+                    if (tb_ratelimit(proxy.rateLimitTB, clientConn)) {
                         // printf("Rate limited\n");
                         continue;
                     } else {
@@ -153,233 +325,39 @@ int main(int argc, char **argv) {
 
                         write(otherSock, connData->buffer.buff, connData->buffer.size);
                         da_clear(&(connData->buffer));
-                        tb_update(rateLimitTB, clientConn, bytesRead);
+                        tb_update(proxy.rateLimitTB, clientConn, bytesRead);
                         continue;
                     }
                 }
 
-                DataList *imgServDl = findData(imageServers, (CmpFunc)servSockCmp, &clientConn);
-                if (imgServDl != NULL) {
-                    ServerData *imgData = imgServDl->data;
-                    // printf("%d - Received Image For: %s\n", clientConn, imgData->domain);
-
-                    int amt = readAll(clientConn, &reqBuff);
-
-                    Header imgHeader;
-                    parseHeader(&imgHeader, &reqBuff);
-                    readBody(clientConn, &imgHeader, &reqBuff);
-
-                    images = addData(images, createPrefetchData(imgData->domain, &reqBuff));
-
-                    da_clear(&reqBuff);
-                    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, clientConn, NULL) == -1) {
-                        fprintf(stderr, "Error on epoll_ctl() delete on clientConn %s\n", strerror(errno));
-                    }
-                    close(clientConn);
-
-                    imageServers = deleteData(imageServers, (CmpFunc)servSockCmp, &clientConn, (TermFunc)termServerData);
-                    continue;
-                }
-
                 // This can throw an error if clients doesn't contain clientConn
-                ClientData *clientData = findData(clients, (CmpFunc)clientSockCmp, &clientConn)->data;
+                ClientData *clientData = findData(proxy.clients, (CmpFunc)clientSockCmp, &clientConn)->data;
                 int bytesRead = readAll(clientConn, &(clientData->buffer));
 
-                if (bytesRead == 0)
+                if (bytesRead == 0) {
+                    // Client hung up
+                    closeClient(&proxy, clientConn);
                     continue;
+                }
 
-                Header clientHeader;
-                parseHeader(&clientHeader, &(clientData->buffer));
-                // TODO: do we need to read bodies for requests?
-
-                do {
-                    printf("Client Url: %s\n", clientHeader.url);
-
-                    // TODO: should we handle POST differently?
-                    if (clientHeader.method == POST) {
-                        // close(clientConn);  // TODO: remove from epoll
-                        int bodyLen = readBody(clientConn, &clientHeader, &(clientData->buffer));
-                        da_shift(&(clientData->buffer), clientHeader.headerLength + bodyLen);
-                        continue;
-                    }
-
-                    // Check to see if record is an image that was already received
-                    DataList *imgDl = findData(images, (CmpFunc)prefetchUrlCmp, clientHeader.url);
-                    if (imgDl) {
-                        PrefetchData *imgData = imgDl->data;
-                        printf("Found Url in Prefetch Images of size %d\n\n", imgData->contentLen);
-                        write(clientConn, imgData->content, imgData->contentLen);
-                        
-                        images = deleteData(images, (CmpFunc)prefetchUrlCmp, clientHeader.url, (TermFunc)termPrefetchData);
-                        da_shift(&(clientData->buffer), clientHeader.headerLength);
-                        continue;
-                    }
-
-                    // Check to see if record is cached
-                    CacheObj *record = cache_get(&clientHeader, cache);
-                    if (record != NULL) {
-                        printf("Found Data in cache\n\n");
-
-                        time_t age = time(NULL) - record->timeCreated;
-
-                        char* cur = record->data;
-                        writeResponseWithAge(clientConn, record->data, record->headerSize, record->dataSize, age);
-
-                        record->lastAccess = time(NULL);
-
-                        da_shift(&clientData->buffer, clientHeader.headerLength);
-                        continue;
-                    }
-
-                    // If we get to this point, either the key wasn't in the cache,
-                    // or it was stale
-                    // So connect to the server, and send them the request
-                    int serverSock;
-                    DataList *servDl;
-                    if (clientHeader.method == GET && (servDl = findData(servers, (CmpFunc)servDomainCmp, clientHeader.domain)) != NULL) {
-                        serverSock = ((ServerData*)servDl->data)->sock;
-                        printf("Reusing socket for %s\n", clientHeader.domain);
-                    }
-                    else {
-                        printf("Opening new socket for %s:%s\n", clientHeader.domain, clientHeader.port);
-                        if ((serverSock = createServerSock(clientHeader.domain, clientHeader.port)) == -1) {
-                            close(clientConn);  // TODO: Handle this error more gracefully
-                            continue;
-                        }
-                        servers = addData(servers, createServerData(serverSock, clientHeader.domain));
-                        servDl = servers;
-                    }
-                    ServerData *servData = servDl->data;                    
-
-                    // Connection successful
-                    switch (clientHeader.method) {
-                        case GET: {
-                            int val = write(serverSock, clientData->buffer.buff, clientHeader.headerLength);
-                            if (val == -1) {  // This means SIGPIPE
-                                // Server closed, so open up a new one
-                                close(serverSock);
-                                serverSock = createServerSock(clientHeader.domain, clientHeader.port);
-                                if (serverSock == -1)
-                                    break;
-                                servData->sock = serverSock;
-                                write(serverSock, clientData->buffer.buff, clientHeader.headerLength);
-                            }
-
-                            int servBytesRead = 0;
-                            do {
-                                servBytesRead = readAll(serverSock, &reqBuff);
-                            } while (servBytesRead == 0);
-
-                            Header serverHeader;
-                            memset(&serverHeader, 0, sizeof(Header));
-                            parseHeader(&serverHeader, &reqBuff);
-
-                            serverHeader.timeToLive = 7200;
-
-                            int responseSize = serverHeader.headerLength;
-
-                            int bodySize = readBody(serverSock, &serverHeader, &reqBuff);
-                            responseSize += bodySize;
-
-                            bool foundBadContent = false;
-
-                            // Search for IMG tags in html and pull them before client asks
-                            // If data is compressed, we need to uncompress it
-                            if (serverHeader.encoding == GZIP && serverHeader.contentLength > 0) {
-                                // printf("\nCompressed: \n");
-                                // write(1, reqBuff.buff + serverHeader.headerLength, 30);
-                                int uncompressSize = serverHeader.contentLength;
-                                // printf("Uncom size: %d\n", uncompressSize);
-                                char *uncompressed = malloc(sizeof(char) * uncompressSize);
-                                uncompressed = uncompressGzip(uncompressed, &uncompressSize, reqBuff.buff + serverHeader.headerLength, serverHeader.contentLength);
-                                // printf("Uncom size: %d\n", uncompressSize);
-                                // printf("\nUncompressed: \n\n");
-                                // write(1, uncompressed, 30);
-                                // printf("\n");
-
-                                foundBadContent = cf_searchText(filter, uncompressed, uncompressSize);
-                                
-                                if (!foundBadContent)
-                                    prefetchImgTags(uncompressed, &imageServers, epollfd);
-                                
-                                free(uncompressed);
-                            }
-                            else {
-                                char *bodyStart = reqBuff.buff + serverHeader.headerLength;
-                                int length = reqBuff.size - serverHeader.headerLength;
-                                foundBadContent = cf_searchText(filter, bodyStart, length);
-
-                                if (!foundBadContent)
-                                    prefetchImgTags(reqBuff.buff, &imageServers, epollfd);
-                            }
-
-                            if (foundBadContent) {
-                                // printf("Found Blocked Content\n");
-                                char blacklistText[512];
-                                getBlockedHttp(blacklistText, getErrorHTML());
-                                write(clientConn, blacklistText, strlen(blacklistText));
-                                if (epoll_ctl(epollfd, EPOLL_CTL_DEL, clientConn, NULL) == -1) {
-                                    fprintf(stderr, "Error on epoll_ctl() delete on clientConn %s\n", strerror(errno));
-                                }
-                                close(clientConn);
-                                da_clear(&reqBuff);
-                                break;
-                            }
-
-                            printf("Sending Data to client\n\n");
-
-                            clientHeader.timeToLive = 60;
-
-                            // Add to cache only when the URL has been through at least once
-                            if (bf_query(oneHitBloom, clientHeader.url))
-                                cache_add(&clientHeader, &serverHeader, responseSize, &reqBuff, cache);
-                            else
-                                bf_add(oneHitBloom, clientHeader.url);
-
-                            writeResponseWithAge(clientConn, reqBuff.buff, serverHeader.headerLength, reqBuff.size, serverHeader.age);
-
-                            da_clear(&reqBuff);
-                            break;
-                        }
-                        case CONNECT: {
-                            char ok[] = "HTTP/1.1 200 OK\r\n\r\n";
-                            write(clientConn, ok, strlen(ok));
-
-                            clients = deleteData(clients, (CmpFunc)clientSockCmp, &clientConn, (TermFunc)termClientData);
-                            connections = addData(connections, createConnectionData(clientConn, serverSock));
-
-                            ev.events = EPOLLIN; // | EPOLLET;
-                            ev.data.fd = serverSock;
-                            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, serverSock, &ev) == -1) {
-                                fprintf(stderr, "Error on epoll_ctl() on serverSock: %s\n", strerror(errno));
-                            }
-
-                            break;
-                        }
-                    }  // switch
-
-                    da_clear(&reqBuff);
-
-                    DataList *lst = findData(clients, (CmpFunc)clientSockCmp, &clientConn);
-                    if (lst) {
-                        clientData = lst->data;
-                        da_shift(&(clientData->buffer), clientHeader.headerLength);
-                    } 
-                    else
-                        clientData = NULL;
-                } while (clientData && clientData->buffer.size > 0);
+                serveRequests(&proxy, clientData);
             }  // if (events[n].data.fd != clientSock)
         } // for (n = 0; n < nfds; ++n)
     } // for (;;)
 
     // terminate buffers and free memory
-    cf_delete(filter);
-    ht_term(cache);
-    bf_delete(oneHitBloom);
-    tb_delete(rateLimitTB);
-    da_term(&reqBuff);
+    wp_term(&(proxy.workers));
+    pf_term(&(proxy.prefetcher));
+    fr_term(&reloader);
+    cf_release(proxy.filter);
+    sb_delete(proxy.sites);
+    ht_term(proxy.cache);
+    bf_delete(proxy.oneHitBloom);
+    tb_delete(proxy.rateLimitTB);
+    ps_term(&(proxy.images));
+    da_term(&(proxy.reqBuff));
     close(clientSock);
-    close(epollfd);
+    close(proxy.epollfd);
     return 0;
 }
 
@@ -450,288 +428,993 @@ int createServerSock(char *domain, char *port) {
     return serverSock;
 }
 
-bool parseHeader(Header *outHeader, DynamicArray *buff) {
-    outHeader->contentLength = -1;
-    outHeader->chunkedEncoding = false;
-    outHeader->age = 0;
-    outHeader->encoding = NO_ENCODE;
-    int headerLen = 0;
+// Reads until a final header is in, relaying any 1xx before it to the client
+bool readResponseHeader(int sock, int clientSock, Header *header, DynamicArray *buffer) {
+    HttpParser parser;
+    hp_init(&parser);
 
-    const char delim[] = "\r";
-    char *line = buff->buff;
-    unsigned long lineLen = strstr(line, delim) - line;
+    HpStatus status;
+    while ((status = parseFinalHeader(clientSock, header, &parser, buffer)) == HP_NEED_MORE) {
+        if (readAll(sock, buffer) <= 0)
+            return false; // server hung up (or errored) before the header was done
+    }
+    return status == HP_COMPLETE;
+}
 
-    while (line) {
-        // printf("Line: %s\n", line);
+HpStatus parseFinalHeader(int clientSock, Header *header, HttpParser *parser, DynamicArray *buffer) {
+    // Interim responses (100 Continue, 103 Early Hints) go straight to the
+    // client, and parsing starts over on whatever follows them
+    HpStatus status;
+    while ((status = parseHeader(header, parser, buffer)) == HP_COMPLETE &&
+           header->status >= 100 && header->status < 200 && header->status != 101) {
+        writeAll(clientSock, buffer->buff, header->headerLength);
+        da_shift(buffer, header->headerLength);
+        hp_init(parser);
+    }
+    return status;
+}
 
-        headerLen += (lineLen + 2);
+int takeRequestBody(Header *request, ChunkDecoder *decoder, long *remaining, const char *data, int len) {
+    // How many of the len bytes at data belong to the body, or -1 if the
+    // chunk framing is bad
+    if (request->chunkedEncoding)
+        return cd_feed(decoder, data, len, NULL, NULL);
 
-        char *getStr = strstr(line, "GET ");
-        char *connectStr = strstr(line, "CONNECT ");
-        if ((getStr != NULL && getStr - line <= lineLen) ||
-            (connectStr != NULL && connectStr - line <= lineLen)) {
-            bool useSSL = connectStr != NULL;
-            outHeader->method = useSSL ? CONNECT : GET;
+    int take = len < *remaining ? len : *remaining;
+    *remaining -= take;
+    return take;
+}
 
-            char *getUrl = useSSL ? line + 8 : line + 4;
-            char *urlPortSep;
-            char *urlEnd;
-            urlPortSep = strstr(strstr(getUrl, ":") + 1, ":");  // Second occurence
-            if ((urlEnd = strstr(getUrl, " ")) == NULL) {
-                return false;
+bool serverAnswered(int serverSock, int clientConn, DynamicArray *responseBuff, bool *answeredEarly) {
+    // The server stopped taking the body. It may have answered and closed
+    // before we noticed, and that answer should still reach the client
+    Header response;
+    *answeredEarly = readResponseHeader(serverSock, clientConn, &response, responseBuff);
+    return *answeredEarly;
+}
+
+int forwardRequestBody(int clientConn, int serverSock, Header *request, DynamicArray *clientBuff, DynamicArray *responseBuff, bool *answeredEarly) {
+    // Returns how much of the body was already in clientBuff after the
+    // header, or -1 if either side went away mid-upload. At most one piece
+    // of the body is held at a time: nothing more is read from the client
+    // until the server has taken the last piece, so a slow server slows the
+    // client down instead of filling our memory. A client that goes quiet
+    // for UPLOAD_IDLE_TIMEOUT is given up on
+    ChunkDecoder decoder;
+    cd_init(&decoder);
+    long remaining = request->contentLength < 0 ? 0 : request->contentLength;
+    *answeredEarly = false;
+
+    char *start = clientBuff->buff + request->headerLength;
+    int inBuffer = takeRequestBody(request, &decoder, &remaining, start, clientBuff->size - request->headerLength);
+    if (inBuffer == -1)
+        return -1;
+    if (writeAll(serverSock, start, inBuffer) == -1)
+        return serverAnswered(serverSock, clientConn, responseBuff, answeredEarly) ? inBuffer : -1;
+
+    HttpParser responseParser;
+    hp_init(&responseParser);
+    Header response;
+    char piece[16384];
+
+    while (request->chunkedEncoding ? !cd_done(&decoder) : remaining > 0) {
+        // Watch the server too. It can answer before the upload is done,
+        // either with 100 Continue or with a final answer like a 413
+        struct pollfd fds[2] = {
+            { .fd = clientConn, .events = POLLIN },
+            { .fd = serverSock, .events = POLLIN },
+        };
+        int ready = poll(fds, 2, UPLOAD_IDLE_TIMEOUT * 1000);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            return -1;
+
+        if (fds[1].revents != 0) {
+            if (readAll(serverSock, responseBuff) <= 0)
+                return -1;
+            HpStatus status = parseFinalHeader(clientConn, &response, &responseParser, responseBuff);
+            if (status == HP_ERROR)
+                return -1;
+            if (status == HP_COMPLETE) {
+                *answeredEarly = true;
+                return inBuffer;
             }
+            continue;
+        }
 
-            size_t urlLen;
-            if ((urlPortSep - line) >= lineLen) {
-                urlLen = urlEnd - getUrl;
-                strcpy(outHeader->port, useSSL ? "443" : "80");
-            } else {
-                urlLen = urlPortSep - getUrl;
+        int bytesRead = read(clientConn, piece, sizeof(piece));
+        if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            continue;
+        if (bytesRead <= 0)
+            return -1; // client gave up mid-upload
+
+        int used = takeRequestBody(request, &decoder, &remaining, piece, bytesRead);
+        if (used == -1)
+            return -1;
+        if (writeAll(serverSock, piece, used) == -1)
+            return serverAnswered(serverSock, clientConn, responseBuff, answeredEarly) ? inBuffer : -1;
+
+        // Anything past the end of the body is the next pipelined request
+        if (used < bytesRead)
+            da_append(clientBuff, piece + used, bytesRead - used);
+    }
+    return inBuffer;
+}
 
-                size_t portLen = urlEnd - (urlPortSep + 1);
-                memcpy(outHeader->port, urlPortSep + 1, portLen);
-                outHeader->port[portLen] = '\0';
-            }
+int readMore(int sock, DynamicArray *buffer) {
+    // A socket may be non-blocking, but by the time we're reading a body we
+    // want all of it, so wait for the next segment instead of giving up.
+    // A read at a time, so the body's looked at (and let go of) as it goes
+    int bytesRead;
+    while ((bytesRead = readSome(sock, buffer, READ_BYTES)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        poll(&pfd, 1, -1);
+    }
+    return bytesRead;
+}
 
-            memcpy(outHeader->url, getUrl, urlLen);
-            outHeader->url[urlLen] = '\0';
+int readBody(int sock, Header *header, DynamicArray *buffer, DynamicArray *decoded, bool *complete, BodyProgress progress, void *ctx) {
+    // Returns how many bytes the body takes up, framing and all, counting
+    // what progress let go of. If decoded isn't NULL, a chunked body's data
+    // is also appended to it without the framing. complete is false if the
+    // server hung up, sent something malformed, or progress said to stop
+    // before the body was done. Offsets are into buffer, so they move back
+    // by whatever progress shifts out of it
+    int start = header->headerLength;
+    int shifted = 0;
+    int dropped;
+    *complete = true;
+
+    switch (header->framing) {
+        case BODY_CHUNKED: {
+            // The decoder keeps its place between reads, so each byte is
+            // only looked at once no matter how the chunks are split up
+            ChunkDecoder decoder;
+            cd_init(&decoder);
+            int fed = start;
+            for (;;) {
+                int used = cd_feed(&decoder, buffer->buff + fed, buffer->size - fed,
+                                   decoded == NULL ? NULL : (ChunkSink)da_append, decoded);
+                if (used == -1)
+                    break; // bad framing, pass along what we have
+                fed += used;
+                if (progress != NULL) {
+                    if ((dropped = progress(ctx, shifted + fed)) == -1)
+                        break;
+                    shifted += dropped;
+                    fed -= dropped;
+                }
+                if (cd_done(&decoder) || readMore(sock, buffer) <= 0)
+                    break;
+            }
+            *complete = cd_done(&decoder);
+            return shifted + fed - start;
         }
+        case BODY_LENGTH: {
+            int end = start + header->contentLength;
+            for (;;) {
+                int messageSize = buffer->size < end ? buffer->size : end;
+                if (progress != NULL) {
+                    if ((dropped = progress(ctx, shifted + messageSize)) == -1) {
+                        *complete = messageSize == end;
+                        return shifted + messageSize - start;
+                    }
+                    shifted += dropped;
+                    messageSize -= dropped;
+                    end -= dropped;
+                }
+                if (messageSize == end)
+                    return header->contentLength;
+                if (readMore(sock, buffer) <= 0) {
+                    *complete = false;
+                    return shifted + buffer->size - start;
+                }
+            }
+        }
+        case BODY_UNTIL_CLOSE: {
+            // Everything up to the server closing is body. An error rather
+            // than a clean close means some of it may be missing
+            int bytesRead;
+            do {
+                if (progress != NULL) {
+                    if ((dropped = progress(ctx, shifted + buffer->size)) == -1) {
+                        *complete = false;
+                        return shifted + buffer->size - start;
+                    }
+                    shifted += dropped;
+                }
+            } while ((bytesRead = readMore(sock, buffer)) > 0);
+            *complete = bytesRead == 0;
+            return shifted + buffer->size - start;
+        }
+        default:
+            return 0;
+    }
+}
 
-        char *postStr = strstr(line, "POST");
-        if (postStr != NULL && postStr - line <= lineLen) {
-            outHeader->method = POST;
+// Answers the requests at the front of a client's buffer in the order
+// they came in, until it runs out of complete ones or the client's
+// connection closes. A response left with a worker to finish scanning
+// parks the client: it's taken out of epoll, and resumeClient carries on
+// from there once the response has gone out
+void serveRequests(Proxy *proxy, ClientData *clientData) {
+    int clientConn = clientData->sock;
+    Header clientHeader;
+    struct epoll_event ev;
+
+    // Pipelined requests are all sent upstream before any of their
+    // responses are read, so the round trips overlap. The loop below then
+    // answers them in the order they came in
+    do {
+        if (rq_empty(&(clientData->pipeline)))
+            sendAhead(&(clientData->pipeline), &(clientData->buffer), &(proxy->servers), &(proxy->images), proxy->cache, proxy->sites);
+
+        // Parse each request in the buffer in turn, so pipelined
+        // requests don't reuse the first one's header
+        HpStatus status = parseHeader(&clientHeader, &(clientData->parser), &(clientData->buffer));
+        if (status == HP_NEED_MORE)
+            break; // the rest of the header is still on its way
+
+        if (status == HP_ERROR) {
+            char badRequest[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+            write(clientConn, badRequest, strlen(badRequest));
+            closeClient(proxy, clientConn);
+            clientData = NULL;
+            break;
         }
 
-        char *hostStr = strstr(line, "Host: ");
-        if (hostStr != NULL && hostStr - line <= lineLen) {
-            char *domain = line + 6;
-            char *portSep = strstr(domain, ":");
+        // Everything we need was copied into clientHeader, so
+        // the parser can start over on the next request
+        hp_init(&(clientData->parser));
+
+        printf("Client Url: %s\n", clientHeader.url);
 
-            int domainLen = (portSep - line) > lineLen ? lineLen - 6 : portSep - domain;
-            memcpy(outHeader->domain, domain, domainLen);
-            outHeader->domain[domainLen] = '\0';
+        // Blocked sites are turned away before anything is
+        // fetched from them, or sent from the cache
+        if (siteBlocked(proxy->sites, &clientHeader)) {
+            char blockedText[512];
+            getBlockedHttp(blockedText, getErrorHTML());
+            write(clientConn, blockedText, strlen(blockedText));
+            closeClient(proxy, clientConn);
+            clientData = NULL;
+            break;
         }
 
-        char *chunkStr = strstr(line, "Transfer-Encoding: chunked");
-        if (chunkStr != NULL && chunkStr - line <= lineLen) {
-            outHeader->chunkedEncoding = true;
+        // Requests only have a body if they say so; they can't be
+        // delimited by closing the connection like responses can
+        bool hasBody = clientHeader.framing != BODY_NONE;
+        int requestLength = clientHeader.headerLength; // grows by the body we take
+        bool closeAfter = !clientHeader.keepAlive; // they get their answer first
+
+        // Only plain GETs can be answered without asking the server
+        bool cacheable = clientHeader.method == GET && !hasBody;
+
+        // If it was sent ahead, its response is already on the way
+        PendingRequest pending = { .sent = false, .reusedSock = false };
+        rq_pop(&(clientData->pipeline), &pending);
+        bool lookup = cacheable && !pending.sent;
+
+        // Check to see if it's something that was already prefetched
+        PsEntry *imgData = lookup ? ps_find(&(proxy->images), clientHeader.url) : NULL;
+        if (imgData) {
+            printf("Found Url in Prefetch Images of size %d\n\n", imgData->contentLen);
+            if (writeResponse(clientConn, imgData->content, imgData->contentLen, 0, "HIT", closeAfter) == -1)
+                closeAfter = true; // stopped reading, or went away
+
+            ps_remove(&(proxy->images), clientHeader.url);
+            if (closeAfter) {
+                closeClient(proxy, clientConn);
+                clientData = NULL;
+                break;
+            }
+            da_shift(&(clientData->buffer), clientHeader.headerLength);
+            continue;
         }
 
-        char *contentLenStr = strstr(line, "Content-Length: ");
-        if (contentLenStr != NULL && contentLenStr - line <= lineLen) {
-            char *start = strstr(line, ":") + 2;
+        // Check to see if record is cached
+        CacheObj *record = lookup ? cache_get(&clientHeader, proxy->cache) : NULL;
+        if (record != NULL) {
+            printf("Found Data in cache\n\n");
 
-            int contentLength = atoi(start);
-            outHeader->contentLength = contentLength;
-        }
+            time_t age = time(NULL) - record->timeCreated;
 
-        char *ageStr = strstr(line, "Age: ");
-        if (ageStr != NULL && ageStr - line <= lineLen) {
-            // If the age field is already here, we remove it. This reduces the
-            // cost of re-iterating through the header to find the age field
-            // again, when we send the response
-
-            // Log size
-            char *start = strstr(line, ":") + 2;
-            int age = atoi(start);
-            outHeader->age = age;
-
-            // Remove age field
-            memcpy(line, line + lineLen + 2, buff->size - headerLen);
-
-            // Update lengths
-            headerLen -= (lineLen + 2);
-            int oldSize = buff->size;
-            buff->size -= (lineLen + 2);
-
-            // Clean the tailing data
-            for (int i = buff->size; i < oldSize; ++i)
-            {
-                buff->buff[i] = 0; // null
-            }
-            line -= (lineLen + 2);
-        }        
+            if (writeResponse(clientConn, record->data, record->dataSize, age, "HIT", closeAfter) == -1)
+                closeAfter = true;
 
-        char *encodingStr = strstr(line, "Content-Encoding: gzip");
-        if (encodingStr != NULL && encodingStr - line <= lineLen) {
-            outHeader->encoding = GZIP;
-        }
+            record->lastAccess = time(NULL);
 
-        if (outHeader->chunkedEncoding && atoi(line) != 0) {
-            outHeader->headerLength = headerLen - lineLen;
-            return true;
+            if (closeAfter) {
+                closeClient(proxy, clientConn);
+                clientData = NULL;
+                break;
+            }
+            da_shift(&clientData->buffer, clientHeader.headerLength);
+            continue;
         }
 
-        if (lineLen == 0 || line - buff->buff + lineLen + 2 > buff->size) {
-            if (headerLen > buff->size)
-                headerLen = buff->size;
-            outHeader->headerLength = headerLen;
-            return true;  // reached header end
-        }
-        // else
-        //   printf("Unknown Header: %s\n", line);
-        line += lineLen + 2;
-        char *next = strstr(line, delim);
-        if (next == NULL)
+        bool parked = false; // left for a worker to finish scanning
+
+        // If we get to this point, either the key wasn't in the cache,
+        // or it was stale
+        // So connect to the server, and send them the request
+        int serverSock = pending.serverSock;
+        bool reusedSock = pending.reusedSock;
+        if (!pending.sent)
+            serverSock = upstreamSock(&(proxy->servers), &clientHeader, &reusedSock);
+        if (serverSock == -1) {
+            char badGateway[] = "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+            write(clientConn, badGateway, strlen(badGateway));
+            closeClient(proxy, clientConn);
+            clientData = NULL;
             break;
-        lineLen = next - line;
-    }
+        }
+        ServerData *servData = findData(proxy->servers, (CmpFunc)servSockCmp, &serverSock)->data;
+
+        // Connection successful
+        switch (clientHeader.method) {
+            default: {
+                // Every method but CONNECT goes through here. The
+                // header is sent as is, and then the body if there is one
+                int val = pending.sent ? 0 : writeRequestHeader(serverSock, clientData->buffer.buff, clientHeader.headerLength);
+                if (val == -1) {  // This means SIGPIPE
+                    // Server closed, so open up a new one
+                    close(serverSock);
+                    serverSock = createServerSock(clientHeader.domain, clientHeader.port);
+                    if (serverSock == -1)
+                        break;
+                    servData->sock = serverSock;
+                    writeRequestHeader(serverSock, clientData->buffer.buff, clientHeader.headerLength);
+                }
 
-    outHeader->headerLength = headerLen;
-    return true;
-}
+                // The body is streamed as it comes in rather than
+                // read in full first, so uploads of any size pass
+                // through in a fixed amount of memory
+                bool answeredEarly = false;
+                if (hasBody) {
+                    int bodyInBuffer = forwardRequestBody(clientConn, serverSock, &clientHeader,
+                                                          &(clientData->buffer), &(proxy->reqBuff), &answeredEarly);
+                    if (bodyInBuffer == -1) {
+                        char badGateway[] = "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+                        write(clientConn, badGateway, strlen(badGateway));
+
+                        close(serverSock);
+                        proxy->servers = deleteData(proxy->servers, (CmpFunc)servSockCmp, &(servData->sock), (TermFunc)termServerData);
+                        closeAfter = true;
+                        break;
+                    }
+                    requestLength += bodyInBuffer;
 
-int readBody(int sock, Header *header, DynamicArray *buffer) {
-    // A couple things could happen here.
-    // If content length set, then just read content length
-    // If chunked encoding, find chunk size and read chunks
-    // Right now we're only handling chunked encoding
-    int bodySize = 0;
+                    // If the server answered before the upload was
+                    // done, the rest of it is still coming from the
+                    // client and neither connection can be reused
+                    closeAfter = closeAfter || answeredEarly;
+                }
 
-    int start = header->headerLength;
-    while (header->chunkedEncoding) {
-        // Figure out how many characters are in the chunk size
-        char *endOfChunkLine = strstr(buffer->buff + start, "\r\n");
-        int size = endOfChunkLine - (buffer->buff + start);
+                Header serverHeader;
+                memset(&serverHeader, 0, sizeof(Header));
+                bool gotHeader = readResponseHeader(serverSock, clientConn, &serverHeader, &(proxy->reqBuff));
+
+                if (!gotHeader && proxy->reqBuff.size == 0 && reusedSock && !hasBody) {
+                    // The server closed the idle connection we
+                    // reused, so try once more on a new one. A body
+                    // has already been streamed, so it can't be
+                    // sent again
+                    close(serverSock);
+                    serverSock = createServerSock(clientHeader.domain, clientHeader.port);
+                    servData->sock = serverSock;
+                    if (serverSock != -1) {
+                        writeRequestHeader(serverSock, clientData->buffer.buff, clientHeader.headerLength);
+                        gotHeader = readResponseHeader(serverSock, clientConn, &serverHeader, &(proxy->reqBuff));
+                    }
+                }
 
-        // Get the chunk size string
-        char chunkSizeBuff[20];
-        memcpy(chunkSizeBuff, (buffer->buff + start), size);
-        chunkSizeBuff[size] = '\0';
+                if (!gotHeader) {
+                    char badGateway[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+                    write(clientConn, badGateway, strlen(badGateway));
 
-        // Convert the chunk size string to int. It's a hex number,
-        // so we use base 16
-        int chunkSize = (int)strtol(chunkSizeBuff, NULL, 16);
+                    if (serverSock != -1)
+                        close(serverSock);
+                    proxy->servers = deleteData(proxy->servers, (CmpFunc)servSockCmp, &(servData->sock), (TermFunc)termServerData);
+                    da_clear(&(proxy->reqBuff));
+                    break;
+                }
 
-        bodySize += 2 + chunkSize + 2 + size;
+                serverHeader.timeToLive = 7200;
+
+                // HEAD responses describe a body but never carry one
+                if (clientHeader.method == HEAD)
+                    serverHeader.framing = BODY_NONE;
+
+                // The filter scans the body while it's read, and
+                // big bodies start going out before they're done
+                ResponseRelay *relay = relayCreate(proxy, clientConn, &clientHeader, &serverHeader,
+                                                   closeAfter || serverHeader.framing == BODY_UNTIL_CLOSE, cacheable);
+
+                bool complete;
+                int bodySize = readBody(serverSock, &serverHeader, relay->buffer, relay->decoded, &complete,
+                                        (BodyProgress)relayProgress, relay);
+
+                // The server connection can only carry another
+                // request if this response ended where its framing
+                // said it would, and nothing came after it, since
+                // we didn't ask for anything more. A body that ran
+                // until close, or was cut short, also leaves the
+                // client with no other way to find its end
+                bool overran = relay->dropped + relay->buffer->size > serverHeader.headerLength + bodySize;
+                bool reuseServer = complete && serverHeader.keepAlive && serverHeader.framing != BODY_UNTIL_CLOSE && !overran;
+                if (!complete || serverHeader.framing == BODY_UNTIL_CLOSE)
+                    closeAfter = true;
+
+                if (answeredEarly || !reuseServer) {
+                    close(serverSock);
+                    proxy->servers = deleteData(proxy->servers, (CmpFunc)servSockCmp, &(servData->sock), (TermFunc)termServerData);
+                }
+                else
+                    servData->busy = false;
+
+                relay->cacheable = cacheable && complete;
+                relay->closeAfter = closeAfter;
+                relay->bodySize = bodySize;
+                relay->requestLength = requestLength;
+
+                // If a worker is still scanning the body, the client
+                // waits for it, but nobody else does
+                parked = relayPark(relay);
+                if (!parked)
+                    closeAfter = finishResponse(relay);
+                break;
+            }
+            case CONNECT: {
+                char ok[] = "HTTP/1.1 200 OK\r\n\r\n";
+                write(clientConn, ok, strlen(ok));
 
-        // This means there are no more chunks, so we read all the data
-        if (chunkSize == 0)
-            break;
+                proxy->clients = deleteData(proxy->clients, (CmpFunc)clientSockCmp, &clientConn, (TermFunc)termClientData);
+                proxy->connections = addData(proxy->connections, createConnectionData(clientConn, serverSock));
 
-        // Add 2 for the \r\n
-        start += 2 + size;
+                ev.events = EPOLLIN; // | EPOLLET;
+                ev.data.fd = serverSock;
+                if (epoll_ctl(proxy->epollfd, EPOLL_CTL_ADD, serverSock, &ev) == -1) {
+                    fprintf(stderr, "Error on epoll_ctl() on serverSock: %s\n", strerror(errno));
+                }
 
-        // While the amount of bytes that we've read in the chunk
-        // is less than the size of the chunk, read more data
-        while (buffer->size - start < chunkSize) {
-            int bytesRead = readAll(sock, buffer);
-            if (bytesRead == -1) {
                 break;
             }
+        }  // switch
+
+        if (parked) {
+            // Its next request is answered once this one is
+            if (epoll_ctl(proxy->epollfd, EPOLL_CTL_DEL, clientConn, NULL) == -1)
+                fprintf(stderr, "Error on epoll_ctl() delete on clientConn %s\n", strerror(errno));
+            return;
         }
 
-        // There's a blank line between chunks
-        start += chunkSize + 2;
+        da_clear(&(proxy->reqBuff));
+
+        if (closeAfter)
+            closeClient(proxy, clientConn);
+
+        DataList *lst = findData(proxy->clients, (CmpFunc)clientSockCmp, &clientConn);
+        if (lst) {
+            clientData = lst->data;
+            da_shift(&(clientData->buffer), requestLength);
+        } 
+        else
+            clientData = NULL;
+    } while (clientData && clientData->buffer.size > 0);
+}
+
+// Sends a response that's been read and scanned, or the blocked page in
+// its place, caches it, and queues what it loads to be prefetched. Deletes
+// the relay. Returns whether the client's connection closes after it
+bool finishResponse(ResponseRelay *relay) {
+    Proxy *proxy = relay->proxy;
+    Header *request = &(relay->request);
+    Header *response = &(relay->response);
+    DynamicArray *buffer = relay->buffer;
+    bool closeAfter = relay->closeAfter;
+    bool foundBadContent = relay->unscannable || cf_streamVerdict(&(relay->filter));
+
+    if (foundBadContent) {
+        // printf("Found Blocked Content\n");
+        // If the start of it already went out, all we can do is cut it off
+        if (relay->sent == 0) {
+            char blacklistText[512];
+            getBlockedHttp(blacklistText, getErrorHTML());
+            write(relay->clientConn, blacklistText, strlen(blacklistText));
+        }
+        relayDelete(relay);
+        return true;
     }
 
-    if (!header->chunkedEncoding && header->contentLength != -1) {
-        // I have no idea why we have to subtract 3 here. I thought it
-        // would only be 2, but it didn't work unless it was 3
-        while (buffer->size < (header->headerLength + header->contentLength - 3)) {
-            readAll(sock, buffer);
+    printf("Sending Data to client\n\n");
+
+    request->timeToLive = 60;
+
+    // Add to cache only when the URL has been through at least once. A
+    // body that ran until close because of a Transfer-Encoding other than
+    // chunked is still coded, and would be stored as if it weren't. One
+    // that wasn't kept whole, being too big, is left out
+    bool transferCoded = response->framing == BODY_UNTIL_CLOSE && getField(response, HDR_TRANSFER_ENCODING) != NULL;
+    if (relay->cacheable && response->status == 200 && !transferCoded) {
+        if (!bf_query(proxy->oneHitBloom, request->url))
+            bf_add(proxy->oneHitBloom, request->url);
+        else if (!relay->keep)
+            printf("Not caching %s, it's bigger than the cache takes\n", request->url);
+        else if (relay->decoded != NULL)
+            cache_addWithLength(request, response, buffer, relay->decoded->buff, relay->decoded->size, proxy->cache);
+        else if (response->framing == BODY_UNTIL_CLOSE)
+            cache_addWithLength(request, response, buffer, buffer->buff + response->headerLength, relay->bodySize, proxy->cache);
+        else
+            cache_add(request, response, response->headerLength + relay->bodySize, buffer, proxy->cache);
+    }
+
+    // A client that stopped reading partway through gets nothing more.
+    // Whatever the server sent past the end of the message isn't part of it
+    int messageLength = response->headerLength + relay->bodySize;
+    ssize_t written = -1;
+    if (!relay->clientGone && relay->sent == 0)
+        written = writeResponse(relay->clientConn, buffer->buff, messageLength, response->age, "MISS", closeAfter);
+    else if (!relay->clientGone)
+        written = writeAll(relay->clientConn, buffer->buff + relay->sent - relay->dropped, messageLength - relay->sent);
+    if (written == -1)
+        closeAfter = true;
+
+    // Pull the page's images, stylesheets and scripts before the client
+    // asks for them. Only now that the page is out, so fetching them
+    // never holds it up
+    const char *url = NULL;
+    while ((url = hs_nextUrl(&(relay->resources), url)) != NULL) {
+        if (!sb_blocksUrl(proxy->sites, url))
+            pf_queue(&(proxy->prefetcher), url, &(proxy->images));
+    }
+
+    relayDelete(relay);
+    return closeAfter;
+}
+
+// A worker is done with a parked response: it goes out, and the client's
+// next request is picked up where serveRequests left off
+void resumeClient(ResponseRelay *relay) {
+    Proxy *proxy = relay->proxy;
+    int clientConn = relay->clientConn;
+    int requestLength = relay->requestLength;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = clientConn;
+    if (epoll_ctl(proxy->epollfd, EPOLL_CTL_ADD, clientConn, &ev) == -1)
+        fprintf(stderr, "Error on epoll_ctl() on clientConn\n");
+
+    if (finishResponse(relay)) {
+        closeClient(proxy, clientConn);
+        return;
+    }
+    ClientData *clientData = findData(proxy->clients, (CmpFunc)clientSockCmp, &clientConn)->data;
+    da_shift(&(clientData->buffer), requestLength);
+    if (clientData->buffer.size > 0)
+        serveRequests(proxy, clientData);
+}
+
+ResponseRelay *relayCreate(Proxy *proxy, int clientConn, Header *request, Header *response, bool closing, bool cacheable) {
+    ResponseRelay *relay = malloc(sizeof(ResponseRelay));
+    relay->proxy = proxy;
+    relay->clientConn = clientConn;
+    relay->request = *request;
+    relay->response = *response;
+    relay->buffer = &(proxy->reqBuff);
+    relay->dropped = 0;
+
+    // Held whole only if finishResponse would cache it: the URL's been
+    // through before, and it may fit. One without a length is let go of
+    // once it's grown past CACHE_MAX_RESPONSE
+    bool transferCoded = response->framing == BODY_UNTIL_CLOSE && getField(response, HDR_TRANSFER_ENCODING) != NULL;
+    relay->keep = cacheable && response->status == 200 && !transferCoded &&
+                  bf_query(proxy->oneHitBloom, request->url) &&
+                  (response->framing != BODY_LENGTH ||
+                   response->contentLength <= CACHE_MAX_RESPONSE - response->headerLength);
+
+    // Chunked bodies are decoded as they're read, so the filter and the
+    // prefetcher see the data without the chunk framing, and the cache
+    // can store it as is. Not kept, it only holds what's still to be
+    // inspected
+    relay->decoded = NULL;
+    if (response->framing == BODY_CHUNKED) {
+        da_init(&(relay->dechunked), 4096);
+        relay->decoded = &(relay->dechunked);
+    }
+
+    bd_init(&(relay->decoder), response->encodings, response->numEncodings, INSPECT_LIMIT);
+    relay->unscannable = false;
+    for (int i = 0; i < response->numEncodings && response->framing != BODY_NONE; i++)
+        relay->unscannable |= REFUSE_UNKNOWN_CODINGS && response->encodings[i] == OTHER_ENCODING;
+    cf_streamInit(&(relay->filter), proxy->filter);
+    // Relative links are resolved against where the page came from. Only
+    // pages and stylesheets load anything
+    char pageUrl[sizeof(request->url) + sizeof(request->domain) + sizeof(request->port) + 8];
+    if (strncasecmp(request->url, "http://", 7) == 0)
+        snprintf(pageUrl, sizeof(pageUrl), "%s", request->url);
+    else
+        snprintf(pageUrl, sizeof(pageUrl), "http://%s:%s%s", request->domain, request->port, request->url);
+    HttpField *type = getField(response, HDR_CONTENT_TYPE);
+    HsKind kind = type == NULL ? hs_kindOf(NULL, 0) :
+                  hs_kindOf(relay->buffer->buff + type->value.offset, type->value.length);
+    hs_init(&(relay->resources), kind, pageUrl);
+    relay->fed = 0;
+    relay->sent = 0;
+    relay->closing = closing;
+    relay->clientGone = false;
+    relay->offloaded = false;
+
+    pthread_mutex_init(&(relay->lock), NULL);
+    pthread_cond_init(&(relay->idle), NULL);
+    da_init(&(relay->queued), 1024);
+    da_init(&(relay->taking), 1024);
+    relay->queuedThrough = 0;
+    relay->cleanThrough = 0;
+    relay->running = false;
+    relay->parked = false;
+    relay->matched = false;
+    relay->inspectDone = false;
+    return relay;
+}
+
+void relayInspect(ResponseRelay *relay, const char *data, int len) {
+    cf_streamFeed(&(relay->filter), data, len);
+    hs_feed(&(relay->resources), data, len);
+}
+
+// Runs on a worker until nothing's left queued. Returns true if the
+// response was parked in the meantime, so the loop has to be told
+bool relayWork(ResponseRelay *relay) {
+    for (;;) {
+        pthread_mutex_lock(&(relay->lock));
+        if (relay->queued.size == 0 || relay->inspectDone) {
+            relay->queued.size = 0;
+            relay->running = false;
+            pthread_cond_signal(&(relay->idle));
+            bool parked = relay->parked;
+            pthread_mutex_unlock(&(relay->lock));
+            return parked;
         }
-        bodySize = header->contentLength - 2;
+        DynamicArray batch = relay->queued;
+        relay->queued = relay->taking;
+        relay->taking = batch;
+        int through = relay->queuedThrough;
+        pthread_mutex_unlock(&(relay->lock));
+
+        bd_feed(&(relay->decoder), relay->taking.buff, relay->taking.size, (DecodeSink)relayInspect, relay);
+        relay->taking.size = 0;
+
+        pthread_mutex_lock(&(relay->lock));
+        relay->matched = relay->filter.matched;
+        relay->inspectDone = relay->matched || relay->decoder.status != BD_MORE;
+        if (!relay->matched)
+            relay->cleanThrough = through;
+        pthread_mutex_unlock(&(relay->lock));
     }
+}
 
-    if (!header->chunkedEncoding && header->contentLength == -1) {
-        // while (true) {
-        //     int bytesRead = readAll(sock, buffer);
-        //     if (bytesRead == -1)
-        //         break;
-        //     bodySize += bytesRead;
-        // }
-        // bodySize -= 2;
-        return 0;
+// Hands more of the body to the worker, starting one if none is on it.
+// Returns how much of the message is known to be clean, or -1 once a
+// term has been found
+int relayQueue(ResponseRelay *relay, const char *data, int len, int messageSize) {
+    bool start = false;
+    pthread_mutex_lock(&(relay->lock));
+    if (relay->inspectDone && !relay->matched) {
+        relay->cleanThrough = messageSize; // nothing more gets looked at
     }
+    else if (!relay->inspectDone && len > 0) {
+        da_append(&(relay->queued), data, len);
+        relay->queuedThrough = messageSize;
+        start = !relay->running;
+        relay->running = true;
+    }
+    int clean = relay->matched ? -1 : relay->cleanThrough;
+    pthread_mutex_unlock(&(relay->lock));
+
+    // With the pool full, the loop does it itself, which slows the reading
+    // down to what it can keep up with
+    if (start && !wp_submit(&(relay->proxy->workers), (WorkFunc)relayWork, (DoneFunc)resumeClient, relay))
+        relayWork(relay);
+    return clean;
+}
 
-    return bodySize + 2;
+// Waits for the worker to get through everything queued. Returns how much
+// of the message is clean then, or -1 if it found a term
+int relayCatchUp(ResponseRelay *relay) {
+    pthread_mutex_lock(&(relay->lock));
+    while (relay->running)
+        pthread_cond_wait(&(relay->idle), &(relay->lock));
+    int clean = relay->matched ? -1 : relay->cleanThrough;
+    pthread_mutex_unlock(&(relay->lock));
+    return clean;
 }
 
-ssize_t writeResponseWithAge(int writeSock, char *data, int headerSize, int dataSize, time_t age) {
-    char *response;
-    char ageStr[256];
-    char ageField[6] = "Age: ";
-    char lineDelim[3] = "\r\n";
-    size_t ageStrLen, ageLineLen;
-    size_t offset;
-    ssize_t retval;
+int relayProgress(ResponseRelay *relay, int messageSize) {
+    // Decode and scan whatever arrived since last time. The decoder, the
+    // filter and the page scanner all keep their place, so terms and
+    // tags split across reads are still found. A body that won't decode
+    // is passed along as is; the client can't read it either
+    if (relay->unscannable)
+        return -1; // it's refused whatever it holds
+
+    // Too big for the cache after all, so from here on it's a window
+    DynamicArray *decoded = relay->decoded;
+    if (relay->keep && messageSize > CACHE_MAX_RESPONSE) {
+        relay->keep = false;
+        if (decoded != NULL) {
+            DynamicArray rest;
+            da_init(&rest, 4096);
+            da_append(&rest, decoded->buff + relay->fed, decoded->size - relay->fed);
+            da_term(decoded);
+            *decoded = rest;
+        }
+    }
 
-    // Create age string
-    sprintf(ageStr, "%ld", age);
-    ageLineLen = strlen(ageField) + strlen(ageStr) + strlen(lineDelim);
+    // What's new since last time, and how much of the body that makes
+    int headerLength = relay->response.headerLength;
+    const char *fresh = relay->buffer->buff + headerLength + relay->fed - relay->dropped;
+    int freshSize = messageSize - headerLength - relay->fed;
+    if (decoded != NULL) {
+        int from = relay->keep ? relay->fed : 0;
+        fresh = decoded->buff + from;
+        freshSize = decoded->size - from;
+    }
+    int bodySize = relay->fed + freshSize;
 
-    // Make a new response with the age field
-    offset = 0;
-    response = malloc(dataSize + ageLineLen);
-    memcpy(response + offset, data, headerSize - 2);
-    offset += (headerSize - 2);
-    memcpy(response + offset, ageField, strlen(ageField));
-    offset += strlen(ageField);
-    memcpy(response + offset, ageStr, strlen(ageStr));
-    offset += strlen(ageStr);
-    memcpy(response + offset, lineDelim, strlen(lineDelim));
-    offset += strlen(lineDelim);
-    memcpy(response + offset, data + headerSize - 2, dataSize - headerSize + 2);
+    int inlineBytes = relay->response.numEncodings == 0 ? INLINE_INSPECT_BYTES : INLINE_CODED_BYTES;
+    if (!relay->offloaded && bodySize > inlineBytes && relay->proxy->workers.numThreads > 0)
+        relay->offloaded = true; // the rest is worth a worker
 
-    // Write to the socket
-    retval = write(writeSock, response, dataSize + ageLineLen);
-    return retval;
+    int clean;
+    if (relay->offloaded) {
+        clean = relayQueue(relay, fresh, freshSize, messageSize);
+        if (clean != -1 && !relay->keep && messageSize - relay->sent > RELAY_WINDOW)
+            clean = relayCatchUp(relay); // or nothing bounds what's held
+    }
+    else {
+        bd_feed(&(relay->decoder), fresh, freshSize, (DecodeSink)relayInspect, relay);
+        clean = relay->filter.matched ? -1 : messageSize;
+        relay->cleanThrough = messageSize;
+    }
+    relay->fed = bodySize;
+    if (decoded != NULL && !relay->keep)
+        decoded->size = 0; // inspected or queued, so done with
+    if (clean == -1)
+        return -1; // no point reading the rest
+
+    // Everything up to clean is, so once too much is waiting it goes
+    if (clean - relay->sent > HOLD_BACK_BYTES) {
+        char *buff = relay->buffer->buff;
+        ssize_t written;
+        if (relay->sent == 0)
+            written = writeResponse(relay->clientConn, buff, clean, relay->response.age, "MISS", relay->closing);
+        else
+            written = writeAll(relay->clientConn, buff + relay->sent - relay->dropped, clean - relay->sent);
+        if (written == -1) {
+            relay->clientGone = true;
+            return -1; // nobody to read the rest for
+        }
+        relay->sent = clean;
+    }
+
+    // Unless the cache is getting it, what the client has can go
+    if (relay->keep)
+        return 0;
+    int dropped = relay->sent - relay->dropped;
+    da_shift(relay->buffer, dropped);
+    relay->dropped = relay->sent;
+    return dropped;
+}
+
+// Called once the body is all in. If a worker's still on it, the relay
+// takes the buffer the response was read into, and the loop is told once
+// the worker's done. Returns whether it did
+bool relayPark(ResponseRelay *relay) {
+    pthread_mutex_lock(&(relay->lock));
+    relay->parked = relay->running;
+    pthread_mutex_unlock(&(relay->lock));
+    if (!relay->parked)
+        return false;
+
+    relay->parkedBuffer = *(relay->buffer);
+    relay->buffer = &(relay->parkedBuffer);
+    da_init(&(relay->proxy->reqBuff), 2048);
+    return true;
 }
 
-void prefetchImgTags(char *html, DataList **imageServers, int epollfd) {
-    char *cur = html;
+void relayDelete(ResponseRelay *relay) {
+    bd_term(&(relay->decoder));
+    cf_streamTerm(&(relay->filter));
+    hs_term(&(relay->resources));
+    if (relay->decoded != NULL)
+        da_term(relay->decoded);
+    if (relay->buffer == &(relay->parkedBuffer))
+        da_term(&(relay->parkedBuffer));
+    da_term(&(relay->queued));
+    da_term(&(relay->taking));
+    pthread_mutex_destroy(&(relay->lock));
+    pthread_cond_destroy(&(relay->idle));
+    free(relay);
+}
 
-    if (strstr(cur, "<!DOCTYPE html") != NULL) {
-        while (true) {
-            char *img = strstr(cur, "<img");
-            if (img == NULL)
-                break;
-            char *endImg = strstr(img, ">");
-            
-            char *srcStart = strstr(img, "src=");
+bool addProxyFields(HeaderRewrite *rw, HttpMessage *msg) {
+    // What's only about the connection it came in on stays behind, and we
+    // add ourselves to the Via chain with the version it came in as.
+    // Returns false if there wasn't room for our line
+    hr_stripHopByHop(rw, msg);
+
+    char via[64];
+    HttpSlice version = msg->version;
+    if (version.length > 5 && hp_sliceEqualsNoCase(rw->buf, (HttpSlice){ version.offset, 5 }, "HTTP/")) {
+        version.offset += 5;
+        version.length -= 5;
+    }
+    snprintf(via, sizeof(via), "%.*s %s", version.length > 8 ? 8 : version.length, rw->buf + version.offset, VIA_NAME);
+    return hr_addField(rw, "Via", via);
+}
 
-            if (srcStart == NULL)
-                continue; // Image has no source
+ssize_t writeRequestHeader(int sock, const char *data, int headerLength) {
+    HttpMessage msg;
+    if (hp_parse(&msg, data, headerLength) != headerLength)
+        return writeAll(sock, data, headerLength);
+
+    // A header we couldn't edit would go out with hop-by-hop lines in it,
+    // so it doesn't go out at all
+    HeaderRewrite rw;
+    hr_init(&rw, data, headerLength);
+    if (!addProxyFields(&rw, &msg)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
-            // Extract image src between quotes
-            char *imgUrlStart = strstr(srcStart, "\"");
-            char *imgUrlEnd = strstr(imgUrlStart + 1, "\"");
+    struct iovec iov[HR_MAX_IOVECS];
+    return writevAll(sock, iov, hr_iovecs(&rw, iov));
+}
 
-            int urlLen = (int)(imgUrlEnd - imgUrlStart) - 1;
-            char urlBuff[urlLen + 1];
-            memcpy(urlBuff, imgUrlStart + 1, urlLen);
-            urlBuff[urlLen] = '\0';
+ssize_t writeResponse(int writeSock, char *data, int dataSize, time_t age, const char *xCache, bool closing) {
+    // The header is sent as the pieces of the original around our edits,
+    // with the body as the last iovec, so nothing gets copied to make room
+    HttpMessage msg;
+    int headerLength = hp_parse(&msg, data, dataSize);
+    if (headerLength <= 0)
+        return writeAll(writeSock, data, dataSize); // nothing we can edit
+
+    HeaderRewrite rw;
+    hr_init(&rw, data, headerLength);
+    bool edited = addProxyFields(&rw, &msg);
+
+    // Our Age replaces the origin's, which it already counts
+    for (int i = 0; i < msg.numFields; i++) {
+        if (msg.fields[i].id == HDR_AGE)
+            hr_remove(&rw, msg.fields[i].line);
+    }
+    char ageValue[24];
+    snprintf(ageValue, sizeof(ageValue), "%ld", (long)age);
+    edited = edited && hr_addField(&rw, "Age", ageValue) && hr_addField(&rw, "X-Cache", xCache) &&
+             hr_addField(&rw, "Connection", closing ? "close" : "keep-alive");
+    if (!edited) {
+        // Without our Connection line the client could guess wrong about
+        // keep-alive, so it's treated like a failed write and closed
+        errno = EMSGSIZE;
+        return -1;
+    }
 
-            char domainBuff[64];
-            sscanf(urlBuff, "http://%[^/]", domainBuff);
+    struct iovec iov[HR_MAX_IOVECS + 1];
+    int count = hr_iovecs(&rw, iov);
+    iov[count].iov_base = data + headerLength;
+    iov[count].iov_len = dataSize - headerLength;
+    return writevAll(writeSock, iov, count + 1);
+}
 
-            char httpGetBuff[urlLen + 200];
-            int numChar = sprintf(httpGetBuff,
-                            "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
-                            urlBuff,
-                            domainBuff);
+bool idleSockOpen(int sock) {
+    // Nothing should arrive on an idle connection, so if it's readable the
+    // server has closed it (or sent something we can't use)
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 0;
+}
 
-            int imgSock = createServerSock(domainBuff, "80");
-            (*imageServers) = addData(*imageServers, createServerData(imgSock, urlBuff));
+// Picks the connection a request goes out on: an idle pooled one for the
+// same domain if it's still open, a new one otherwise. CONNECT always gets
+// its own. Returns -1 if the server can't be reached
+int upstreamSock(DataList **servers, Header *request, bool *reused) {
+    DataList *servDl = NULL;
+    if (request->method != CONNECT)
+        servDl = findData(*servers, (CmpFunc)servIdleDomainCmp, request->domain);
+    if (servDl != NULL && !idleSockOpen(((ServerData*)servDl->data)->sock)) {
+        // The server closed it while it sat idle. Finding that out now is
+        // cheaper than after sending a body we can't send again
+        int staleSock = ((ServerData*)servDl->data)->sock;
+        close(staleSock);
+        *servers = deleteData(*servers, (CmpFunc)servSockCmp, &staleSock, (TermFunc)termServerData);
+        servDl = NULL;
+    }
 
-            write(imgSock, httpGetBuff, numChar);
+    *reused = servDl != NULL;
+    if (servDl != NULL) {
+        printf("Reusing socket for %s\n", request->domain);
+        return ((ServerData*)servDl->data)->sock;
+    }
 
-            if (fcntl(imgSock, F_SETFL,
-                    fcntl(imgSock, F_GETFL, 0) | O_NONBLOCK) == -1) {
-                fprintf(stderr, "Error on fcntl()\n");
-            }
+    printf("Opening new socket for %s:%s\n", request->domain, request->port);
+    int sock = createServerSock(request->domain, request->port);
+    if (sock != -1)
+        *servers = addData(*servers, createServerData(sock, request->domain));
+    return sock;
+}
 
-            struct epoll_event ev;
-            ev.events = EPOLLIN; // | EPOLLET;
-            ev.data.fd = imgSock;
-            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, imgSock, &ev) == -1) {
-                fprintf(stderr, "Error on epoll_ctl() on imgSock: %s\n", strerror(errno));
+// Writes every complete request at the front of the client's buffer that
+// has to go upstream, each on its own connection, and queues them in order.
+// Stops at the first one with a body or a CONNECT, which are handled on
+// their own once everything before them is answered, and after one that
+// closes the connection. Cache and prefetch hits, and requests for blocked
+// sites, are queued unsent
+void sendAhead(ResponseQueue *queue, DynamicArray *clientBuff, DataList **servers, PrefetchStore *images, HashTable *cache, SiteBlocklist *sites) {
+    int offset = 0;
+    while (!rq_full(queue) && offset < clientBuff->size) {
+        // A view of the rest of the buffer, so the next request parses as
+        // if it were at the front
+        DynamicArray rest = { clientBuff->buff + offset, clientBuff->size - offset, clientBuff->size - offset };
+        HttpParser parser;
+        Header request;
+        hp_init(&parser);
+        if (parseHeader(&request, &parser, &rest) != HP_COMPLETE)
+            return;
+        if (request.method == CONNECT || request.framing != BODY_NONE)
+            return;
+
+        PendingRequest pending = { .sent = false, .serverSock = -1, .reusedSock = false };
+        bool answeredHere = siteBlocked(sites, &request) || (request.method == GET &&
+            (ps_find(images, request.url) != NULL || cache_get(&request, cache) != NULL));
+        if (!answeredHere) {
+            int sock = upstreamSock(servers, &request, &(pending.reusedSock));
+            if (sock != -1 && writeRequestHeader(sock, rest.buff, request.headerLength) == -1) {
+                // Left for the loop to retry on a new connection
+                close(sock);
+                *servers = deleteData(*servers, (CmpFunc)servSockCmp, &sock, (TermFunc)termServerData);
+                sock = -1;
+            }
+            if (sock != -1) {
+                ((ServerData*)findData(*servers, (CmpFunc)servSockCmp, &sock)->data)->busy = true;
+                pending.sent = true;
+                pending.serverSock = sock;
             }
-
-            cur = endImg + 1;
         }
+
+        rq_push(queue, pending);
+        offset += request.headerLength;
+        if (!request.keepAlive)
+            return;
+    }
+}
+
+// Everything but CONNECT has an absolute URL by now. Tunnels only say
+// which host they're for, so only whole domains stop them
+bool siteBlocked(SiteBlocklist *sites, Header *request) {
+    if (request->method == CONNECT)
+        return sb_blocks(sites, request->domain, NULL);
+    const char *path = strchr(request->url + 7, '/');
+    return sb_blocks(sites, request->domain, path != NULL ? path : "/");
+}
+
+// Responses still due to it leave their connections mid-response, so
+// those can't be reused
+void closeClient(Proxy *proxy, int clientConn) {
+    if (epoll_ctl(proxy->epollfd, EPOLL_CTL_DEL, clientConn, NULL) == -1) {
+        fprintf(stderr, "Error on epoll_ctl() delete on clientConn %s\n", strerror(errno));
+    }
+    close(clientConn);
+
+    DataList *clientDl = findData(proxy->clients, (CmpFunc)clientSockCmp, &clientConn);
+    PendingRequest leftover;
+    while (clientDl != NULL && rq_pop(&(((ClientData*)clientDl->data)->pipeline), &leftover)) {
+        if (!leftover.sent)
+            continue;
+        close(leftover.serverSock);
+        proxy->servers = deleteData(proxy->servers, (CmpFunc)servSockCmp, &(leftover.serverSock), (TermFunc)termServerData);
     }
+    proxy->clients = deleteData(proxy->clients, (CmpFunc)clientSockCmp, &clientConn, (TermFunc)termClientData);
 }
 
 void socketError(char *funcName) {
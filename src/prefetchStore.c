@@ -0,0 +1,176 @@
+#include "prefetchStore.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a
+static unsigned long hashUrl(const char *url) {
+    unsigned long hash = 14695981039346656037UL;
+    for (; *url != '\0'; url++) {
+        hash ^= (unsigned char)*url;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static PsEntry **bucketOf(PrefetchStore *store, const char *url) {
+    return &(store->buckets[hashUrl(url) % store->numBuckets]);
+}
+
+// What an entry counts against maxBytes
+static long entryBytes(const char *url, int contentLen) {
+    return sizeof(PsEntry) + strlen(url) + 1 + contentLen;
+}
+
+static bool expired(PsEntry *entry, time_t now) {
+    return now - entry->fetchedAt >= PS_TTL;
+}
+
+// Doubles the buckets, so chains stay about one long however many there are
+static void grow(PrefetchStore *store) {
+    int numBuckets = store->numBuckets * 2;
+    PsEntry **buckets = calloc(numBuckets, sizeof(PsEntry*));
+    for (int i = 0; i < store->numBuckets; i++) {
+        while (store->buckets[i] != NULL) {
+            PsEntry *entry = store->buckets[i];
+            store->buckets[i] = entry->chain;
+            PsEntry **bucket = &(buckets[hashUrl(entry->url) % numBuckets]);
+            entry->chain = *bucket;
+            *bucket = entry;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->numBuckets = numBuckets;
+}
+
+static PsEntry *lookup(PrefetchStore *store, const char *url) {
+    PsEntry *entry = *bucketOf(store, url);
+    while (entry != NULL && strcmp(entry->url, url) != 0)
+        entry = entry->chain;
+    return entry;
+}
+
+static void unlinkUse(PrefetchStore *store, PsEntry *entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        store->newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        store->oldest = entry->newer;
+}
+
+static void markUsed(PrefetchStore *store, PsEntry *entry) {
+    entry->newer = NULL;
+    entry->older = store->newest;
+    if (store->newest != NULL)
+        store->newest->newer = entry;
+    else
+        store->oldest = entry;
+    store->newest = entry;
+}
+
+static void drop(PrefetchStore *store, PsEntry *entry) {
+    PsEntry **link = bucketOf(store, entry->url);
+    while (*link != entry)
+        link = &((*link)->chain);
+    *link = entry->chain;
+
+    unlinkUse(store, entry);
+    if (entry->later != NULL)
+        entry->later->earlier = entry->earlier;
+    else
+        store->lastIn = entry->earlier;
+    if (entry->earlier != NULL)
+        entry->earlier->later = entry->later;
+    else
+        store->firstIn = entry->later;
+
+    store->count--;
+    store->bytes -= entryBytes(entry->url, entry->contentLen);
+    free(entry->url);
+    free(entry->content);
+    free(entry);
+}
+
+void ps_init(PrefetchStore *store, long maxBytes) {
+    memset(store, 0, sizeof(PrefetchStore));
+    store->maxBytes = maxBytes;
+    store->numBuckets = PS_MIN_BUCKETS;
+    store->buckets = calloc(store->numBuckets, sizeof(PsEntry*));
+}
+
+void ps_add(PrefetchStore *store, const char *url, const char *message, int length) {
+    PsEntry *old = lookup(store, url);
+    if (old != NULL)
+        drop(store, old);
+    long bytes = entryBytes(url, length);
+    if (bytes > store->maxBytes)
+        return;
+
+    // Whatever's past its time goes first, then the least recently used
+    ps_expire(store);
+    while (store->bytes + bytes > store->maxBytes)
+        drop(store, store->oldest);
+
+    if (store->count >= store->numBuckets)
+        grow(store);
+    PsEntry *entry = malloc(sizeof(PsEntry));
+    entry->url = strdup(url);
+    entry->content = malloc(length);
+    memcpy(entry->content, message, length);
+    entry->contentLen = length;
+    entry->fetchedAt = time(NULL);
+
+    PsEntry **bucket = bucketOf(store, url);
+    entry->chain = *bucket;
+    *bucket = entry;
+    markUsed(store, entry);
+    entry->later = NULL;
+    entry->earlier = store->lastIn;
+    if (store->lastIn != NULL)
+        store->lastIn->later = entry;
+    else
+        store->firstIn = entry;
+    store->lastIn = entry;
+    store->count++;
+    store->bytes += bytes;
+}
+
+PsEntry *ps_find(PrefetchStore *store, const char *url) {
+    PsEntry *entry = lookup(store, url);
+    if (entry == NULL)
+        return NULL;
+    if (expired(entry, time(NULL))) {
+        drop(store, entry);
+        return NULL;
+    }
+    unlinkUse(store, entry);
+    markUsed(store, entry);
+    return entry;
+}
+
+void ps_remove(PrefetchStore *store, const char *url) {
+    PsEntry *entry = lookup(store, url);
+    if (entry != NULL)
+        drop(store, entry);
+}
+
+int ps_expire(PrefetchStore *store) {
+    // They came in in order, so the first one still in is the next to go
+    time_t now = time(NULL);
+    while (store->firstIn != NULL && expired(store->firstIn, now))
+        drop(store, store->firstIn);
+    if (store->firstIn == NULL)
+        return -1;
+    return (store->firstIn->fetchedAt + PS_TTL - now) * 1000;
+}
+
+void ps_term(PrefetchStore *store) {
+    while (store->oldest != NULL)
+        drop(store, store->oldest);
+    free(store->buckets);
+    store->buckets = NULL;
+}
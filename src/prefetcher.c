@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+
+#include "prefetcher.h"
+#include "bodyDecoder.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+static PfFetch *fetchCreate(const char *url, PfHost *host, const char *path) {
+    PfFetch *fetch = malloc(sizeof(PfFetch));
+    fetch->url = strdup(url);
+    da_init(&(fetch->request), 256);
+    da_append(&(fetch->request), "GET ", 4);
+    if (path[0] != '/')
+        da_append(&(fetch->request), "/", 1);
+    da_append(&(fetch->request), path, strcspn(path, "#"));
+    da_append(&(fetch->request), " HTTP/1.1\r\nHost: ", 17);
+    da_append(&(fetch->request), host->name, strlen(host->name));
+    if (strcmp(host->port, "80") != 0) {
+        da_append(&(fetch->request), ":", 1);
+        da_append(&(fetch->request), host->port, strlen(host->port));
+    }
+    da_append(&(fetch->request), "\r\nConnection: keep-alive\r\n\r\n", 28);
+    fetch->tries = 0;
+    fetch->next = NULL;
+    return fetch;
+}
+
+static void fetchDelete(PfFetch *fetch) {
+    free(fetch->url);
+    da_term(&(fetch->request));
+    free(fetch);
+}
+
+// Runs on a worker. Only addr, addrLength and found are written, and the
+// loop leaves those alone until resolveDone
+static bool resolveWork(PfHost *host) {
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    host->found = getaddrinfo(host->name, host->port, &hints, &info) == 0;
+    if (host->found) {
+        memcpy(&(host->addr), info->ai_addr, info->ai_addrlen);
+        host->addrLength = info->ai_addrlen;
+        freeaddrinfo(info);
+    }
+    return true;
+}
+
+static void lookedUp(PfHost *host) {
+    host->owner->lookups--;
+    host->state = host->found ? PF_RESOLVED : PF_UNREACHABLE;
+    host->resolvedAt = time(NULL);
+    if (!host->found)
+        fprintf(stderr, "Couldn't look up %s to prefetch from it\n", host->name);
+}
+
+static void pump(Prefetcher *pf);
+
+static void resolveDone(PfHost *host) {
+    lookedUp(host);
+    pump(host->owner);
+}
+
+// Has epoll watch conn for whatever it's waiting on now
+static bool watch(Prefetcher *pf, PfConn *conn) {
+    unsigned events = !conn->connected ? EPOLLOUT : EPOLLIN | (conn->out.size > 0 ? EPOLLOUT : 0);
+    if (events == conn->events)
+        return true;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = conn->sock;
+    if (epoll_ctl(pf->epollfd, conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->sock, &ev) == -1) {
+        fprintf(stderr, "Error on epoll_ctl() on a prefetch connection: %s\n", strerror(errno));
+        return false;
+    }
+    conn->events = events;
+    return true;
+}
+
+static void connDelete(PfConn *conn) {
+    close(conn->sock);
+    da_term(&(conn->out));
+    da_term(&(conn->buffer));
+    free(conn);
+}
+
+// Connects without waiting; epoll says when it's done. Returns NULL if it
+// failed straight away
+static PfConn *openConn(Prefetcher *pf, PfHost *host) {
+    int sock = socket(host->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return NULL;
+    if (connect(sock, (struct sockaddr*)&(host->addr), host->addrLength) == -1 && errno != EINPROGRESS) {
+        close(sock);
+        return NULL;
+    }
+
+    PfConn *conn = calloc(1, sizeof(PfConn));
+    conn->host = host;
+    conn->sock = sock;
+    conn->lastProgress = time(NULL);
+    da_init(&(conn->out), 1024);
+    da_init(&(conn->buffer), 4096);
+    hp_init(&(conn->parser));
+    if (!watch(pf, conn)) {
+        connDelete(conn);
+        return NULL;
+    }
+
+    host->numConns++;
+    pf->conns[pf->numConns++] = conn;
+    return conn;
+}
+
+// Closes a connection. Requests it never answered go back on the front of
+// their host's queue, in order, unless they've had their tries, or it
+// never connected, since trying again straight away won't go any better.
+// With dropFirst, the oldest one is given up on whatever its tries
+static void closeConn(Prefetcher *pf, int index, bool dropFirst) {
+    PfConn *conn = pf->conns[index];
+    PfHost *host = conn->host;
+    if (epoll_ctl(pf->epollfd, EPOLL_CTL_DEL, conn->sock, NULL) == -1)
+        fprintf(stderr, "Error on epoll_ctl() delete on a prefetch connection: %s\n", strerror(errno));
+
+    PfFetch *retry = NULL, *lastRetry = NULL;
+    for (bool first = true; conn->pipeline != NULL; first = false) {
+        PfFetch *fetch = conn->pipeline;
+        conn->pipeline = fetch->next;
+        fetch->next = NULL;
+        if (!conn->connected || fetch->tries >= PF_MAX_TRIES || (first && dropFirst)) {
+            fetchDelete(fetch);
+            continue;
+        }
+        if (retry == NULL)
+            retry = fetch;
+        else
+            lastRetry->next = fetch;
+        lastRetry = fetch;
+        pf->numQueued++;
+    }
+    if (retry != NULL) {
+        lastRetry->next = host->queued;
+        if (host->queued == NULL)
+            host->lastQueued = lastRetry;
+        host->queued = retry;
+    }
+
+    host->numConns--;
+    pf->conns[index] = pf->conns[--pf->numConns];
+    connDelete(conn);
+}
+
+// Frees a connection slot for a new one, by closing one nothing is using.
+// Returns false if they're all busy
+static bool makeRoom(Prefetcher *pf) {
+    if (pf->numConns < PF_MAX_CONNECTIONS)
+        return true;
+    for (int i = 0; i < pf->numConns; i++) {
+        if (pf->conns[i]->connected && pf->conns[i]->depth == 0) {
+            closeConn(pf, i, false);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The connection to host with the fewest requests due on it, among those
+// that can take another. NULL if there isn't one
+static PfConn *leastBusy(Prefetcher *pf, PfHost *host) {
+    PfConn *best = NULL;
+    for (int i = 0; i < pf->numConns; i++) {
+        PfConn *conn = pf->conns[i];
+        // Nothing goes ahead of a response until the server has shown it
+        // keeps the connection open afterwards
+        int room = conn->keepsAlive ? PF_PIPELINE_DEPTH : 1;
+        if (conn->host != host || conn->closing || conn->depth >= room)
+            continue;
+        if (best == NULL || conn->depth < best->depth)
+            best = conn;
+    }
+    return best;
+}
+
+// Puts fetch on the end of conn's pipeline, for epoll to say when it can
+// be written. A connection that times out while it waits sorts out a
+// failure to watch it
+static void sendOn(Prefetcher *pf, PfConn *conn, PfFetch *fetch) {
+    if (conn->depth == 0)
+        conn->lastProgress = time(NULL); // the idle time doesn't count against it
+    da_append(&(conn->out), fetch->request.buff, fetch->request.size);
+    fetch->tries++;
+    if (conn->pipeline == NULL)
+        conn->pipeline = fetch;
+    else
+        conn->lastPipelined->next = fetch;
+    conn->lastPipelined = fetch;
+    conn->depth++;
+    watch(pf, conn);
+}
+
+// Sends as many of host's queued fetches as its connections have room
+// for, looking it up first if it needs it
+static void pumpHost(Prefetcher *pf, PfHost *host) {
+    if (host->queued == NULL)
+        return;
+
+    bool stale = host->state != PF_RESOLVING && time(NULL) - host->resolvedAt > PF_ADDRESS_TTL;
+    if ((host->state == PF_UNRESOLVED || stale) && pf->lookups < PF_MAX_LOOKUPS) {
+        host->state = PF_RESOLVING;
+        pf->lookups++;
+        if (wp_submit(pf->workers, (WorkFunc)resolveWork, (DoneFunc)resolveDone, host))
+            return;
+        // No worker to take it, so the loop waits on this one
+        resolveWork(host);
+        lookedUp(host);
+    }
+
+    if (host->state == PF_UNREACHABLE) {
+        while (host->queued != NULL) {
+            PfFetch *fetch = host->queued;
+            host->queued = fetch->next;
+            pf->numQueued--;
+            fetchDelete(fetch);
+        }
+        return;
+    }
+    if (host->state != PF_RESOLVED)
+        return;
+
+    while (host->queued != NULL) {
+        // Spread over as many connections as the host is allowed before
+        // lining requests up behind each other
+        PfConn *conn = leastBusy(pf, host);
+        if ((conn == NULL || conn->depth > 0) && host->numConns < PF_MAX_PER_HOST && makeRoom(pf)) {
+            PfConn *fresh = openConn(pf, host);
+            if (fresh != NULL)
+                conn = fresh;
+            else if (conn == NULL) {
+                PfFetch *fetch = host->queued;
+                host->queued = fetch->next;
+                pf->numQueued--;
+                fetchDelete(fetch);
+                continue;
+            }
+        }
+        if (conn == NULL)
+            break;
+
+        PfFetch *fetch = host->queued;
+        host->queued = fetch->next;
+        fetch->next = NULL;
+        pf->numQueued--;
+        sendOn(pf, conn, fetch);
+    }
+}
+
+static void pump(Prefetcher *pf) {
+    for (PfHost *host = pf->hosts; host != NULL; host = host->next)
+        pumpHost(pf, host);
+}
+
+// Gives up on connections that have gone quiet while they owe responses,
+// and closes ones that have sat idle too long. There's no timer, but
+// nothing is waiting on a stuck connection except the fetches queued
+// behind it, and those only show up when something else happens
+static void expire(Prefetcher *pf) {
+    time_t now = time(NULL);
+    for (int i = pf->numConns - 1; i >= 0; i--) {
+        PfConn *conn = pf->conns[i];
+        bool owing = !conn->connected || conn->depth > 0;
+        if (now - conn->lastProgress > (owing ? PF_TIMEOUT : PF_IDLE_TIMEOUT))
+            closeConn(pf, i, true);
+    }
+}
+
+// The host url is on, added if it's new. Returns NULL if there's no room
+// for another one
+static PfHost *findHost(Prefetcher *pf, const char *name, const char *port) {
+    for (PfHost *host = pf->hosts; host != NULL; host = host->next) {
+        if (strcasecmp(host->name, name) == 0 && strcmp(host->port, port) == 0)
+            return host;
+    }
+
+    if (pf->numHosts >= PF_MAX_HOSTS) {
+        // Make way by forgetting a host nothing is using
+        PfHost **link = &(pf->hosts);
+        while (*link != NULL && ((*link)->state == PF_RESOLVING || (*link)->numConns > 0 || (*link)->queued != NULL))
+            link = &((*link)->next);
+        if (*link == NULL)
+            return NULL;
+        PfHost *idle = *link;
+        *link = idle->next;
+        free(idle);
+        pf->numHosts--;
+    }
+
+    PfHost *host = calloc(1, sizeof(PfHost));
+    host->owner = pf;
+    strcpy(host->name, name);
+    strcpy(host->port, port);
+    host->state = PF_UNRESOLVED;
+    host->next = pf->hosts;
+    pf->hosts = host;
+    pf->numHosts++;
+    return host;
+}
+
+static bool alreadyFetching(Prefetcher *pf, PfHost *host, const char *url) {
+    for (int i = 0; i < pf->numConns; i++) {
+        for (PfFetch *fetch = pf->conns[i]->pipeline; fetch != NULL; fetch = fetch->next) {
+            if (strcmp(fetch->url, url) == 0)
+                return true;
+        }
+    }
+    for (PfFetch *fetch = host->queued; fetch != NULL; fetch = fetch->next) {
+        if (strcmp(fetch->url, url) == 0)
+            return true;
+    }
+    return false;
+}
+
+void pf_init(Prefetcher *pf, int epollfd, WorkerPool *workers) {
+    memset(pf, 0, sizeof(Prefetcher));
+    pf->epollfd = epollfd;
+    pf->workers = workers;
+}
+
+void pf_queue(Prefetcher *pf, const char *url, PrefetchStore *store) {
+    expire(pf);
+    if (pf->numQueued >= PF_MAX_QUEUED || strncasecmp(url, "http://", 7) != 0 || ps_find(store, url) != NULL)
+        return;
+
+    // The request line only wants the path, and the host goes in Host
+    char *authority = (char*)url + 7;
+    int authorityLength = strcspn(authority, "/?#");
+    char name[sizeof(((Header*)0)->domain)], port[sizeof(((Header*)0)->port)];
+    if (!splitAuthority(authority, 0, authorityLength, name, port, "80") || memchr(authority, '@', authorityLength))
+        return;
+    const char *path = authority + authorityLength;
+    if (strpbrk(path, " \r\n") != NULL)
+        return;
+
+    PfHost *host = findHost(pf, name, port);
+    if (host == NULL || alreadyFetching(pf, host, url))
+        return;
+
+    PfFetch *fetch = fetchCreate(url, host, path);
+    if (host->queued == NULL)
+        host->queued = fetch;
+    else
+        host->lastQueued->next = fetch;
+    host->lastQueued = fetch;
+    pf->numQueued++;
+    pumpHost(pf, host);
+}
+
+// Writes what it can of the requests waiting to go. Returns false if the
+// connection broke
+static bool writeConn(Prefetcher *pf, PfConn *conn) {
+    while (conn->out.size > 0) {
+        ssize_t written = write(conn->sock, conn->out.buff, conn->out.size);
+        if (written > 0) {
+            da_shift(&(conn->out), written);
+            conn->lastProgress = time(NULL);
+            continue;
+        }
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        return false;
+    }
+    return watch(pf, conn);
+}
+
+typedef struct {
+    BodyDecoder decoder;
+    FilterStream stream;
+} BodyCheck;
+
+static void scanDecoded(FilterStream *stream, const char *data, int len) {
+    cf_streamFeed(stream, data, len);
+}
+
+static void decodeBody(BodyCheck *check, const char *data, int len) {
+    bd_feed(&(check->decoder), data, len, (DecodeSink)scanDecoded, &(check->stream));
+}
+
+bool pf_bodyPasses(const Header *header, const char *message, int messageSize, ContentFilter *filter) {
+    const char *body = message + header->headerLength;
+    int bodySize = messageSize - header->headerLength;
+    BodyCheck *check = malloc(sizeof(BodyCheck)); // the decoder's windows are big
+    bd_init(&(check->decoder), header->encodings, header->numEncodings, PF_MAX_BYTES);
+    cf_streamInit(&(check->stream), filter);
+    if (header->framing == BODY_CHUNKED) {
+        ChunkDecoder chunks;
+        cd_init(&chunks);
+        cd_feed(&chunks, body, bodySize, (ChunkSink)decodeBody, check);
+    } else {
+        decodeBody(check, body, bodySize);
+    }
+
+    // An uncoded body is only done when it runs out
+    BdStatus status = check->decoder.status;
+    bool decoded = status == BD_DONE || (status == BD_MORE && check->decoder.numStages == 0);
+    bool passes = decoded && !cf_streamVerdict(&(check->stream));
+    bd_term(&(check->decoder));
+    cf_streamTerm(&(check->stream));
+    free(check);
+    return passes;
+}
+
+// Reads what's there, and takes every response that's all in off the
+// front of the buffer, adding the images among them that filter lets
+// through to store. Returns false if the connection should be closed, with
+// *dropFirst set if it's the oldest request's fault
+static bool readConn(PfConn *conn, PrefetchStore *store, ContentFilter *filter, bool *dropFirst) {
+    char chunk[16384];
+    bool closed = false;
+    for (;;) {
+        ssize_t got = read(conn->sock, chunk, sizeof(chunk));
+        if (got > 0) {
+            da_append(&(conn->buffer), chunk, got);
+            conn->lastProgress = time(NULL);
+            continue;
+        }
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        closed = got == 0;
+        break;
+    }
+
+    Header *header = &(conn->header);
+    while (conn->pipeline != NULL) {
+        if (!conn->haveHeader) {
+            HpStatus status = parseHeader(header, &(conn->parser), &(conn->buffer));
+            if (status == HP_ERROR) {
+                *dropFirst = true;
+                return false;
+            }
+            if (status == HP_NEED_MORE)
+                break;
+            if (header->status >= 100 && header->status < 200 && header->status != 101) {
+                // An interim response; the real one follows it
+                da_shift(&(conn->buffer), header->headerLength);
+                hp_init(&(conn->parser));
+                continue;
+            }
+            conn->haveHeader = true;
+            conn->framed = header->headerLength;
+            cd_init(&(conn->chunks));
+            if (header->keepAlive && header->framing != BODY_UNTIL_CLOSE)
+                conn->keepsAlive = true;
+            else
+                conn->closing = true;
+        }
+
+        int messageSize = -1;
+        switch (header->framing) {
+            case BODY_NONE:
+                messageSize = header->headerLength;
+                break;
+            case BODY_LENGTH:
+                if (conn->buffer.size >= header->headerLength + header->contentLength)
+                    messageSize = header->headerLength + header->contentLength;
+                break;
+            case BODY_CHUNKED: {
+                int used = cd_feed(&(conn->chunks), conn->buffer.buff + conn->framed,
+                                   conn->buffer.size - conn->framed, NULL, NULL);
+                if (used == -1) {
+                    *dropFirst = true;
+                    return false;
+                }
+                conn->framed += used;
+                if (cd_done(&(conn->chunks)))
+                    messageSize = conn->framed;
+                break;
+            }
+            case BODY_UNTIL_CLOSE:
+                if (closed)
+                    messageSize = conn->buffer.size;
+                break;
+        }
+        if (messageSize == -1)
+            break;
+
+        PfFetch *fetch = conn->pipeline;
+        conn->pipeline = fetch->next;
+        conn->depth--;
+        if (header->status == 200) { // only images are worth keeping
+            if (pf_bodyPasses(header, conn->buffer.buff, messageSize, filter)) {
+                printf("Prefetched %s\n", fetch->url);
+                ps_add(store, fetch->url, conn->buffer.buff, messageSize);
+            } else {
+                printf("Not keeping prefetched %s, it's blocked or couldn't be scanned\n", fetch->url);
+            }
+        }
+        fetchDelete(fetch);
+
+        da_shift(&(conn->buffer), messageSize);
+        hp_init(&(conn->parser));
+        conn->haveHeader = false;
+        if (conn->depth == 0)
+            conn->lastProgress = time(NULL);
+        if (conn->closing)
+            return false; // anything sent after this one has to go again
+    }
+
+    if (conn->buffer.size > PF_MAX_BYTES) {
+        *dropFirst = true; // bigger images aren't worth holding
+        return false;
+    }
+    // A server that hangs up, or sends something nobody asked for, is done
+    // with the connection
+    return !closed && (conn->pipeline != NULL || conn->buffer.size == 0);
+}
+
+bool pf_handle(Prefetcher *pf, int fd, PrefetchStore *store, ContentFilter *filter) {
+    int index = 0;
+    while (index < pf->numConns && pf->conns[index]->sock != fd)
+        index++;
+    if (index == pf->numConns)
+        return false;
+
+    PfConn *conn = pf->conns[index];
+    bool ok = true, dropFirst = false;
+    if (!conn->connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        ok = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+        conn->connected = ok;
+        conn->lastProgress = time(NULL);
+    }
+    if (ok)
+        ok = writeConn(pf, conn);
+    if (ok)
+        ok = readConn(conn, store, filter, &dropFirst);
+    if (!ok)
+        closeConn(pf, index, dropFirst);
+
+    expire(pf);
+    pump(pf);
+    return true;
+}
+
+void pf_term(Prefetcher *pf) {
+    while (pf->numConns > 0)
+        closeConn(pf, pf->numConns - 1, false);
+    while (pf->hosts != NULL) {
+        PfHost *host = pf->hosts;
+        pf->hosts = host->next;
+        while (host->queued != NULL) {
+            PfFetch *fetch = host->queued;
+            host->queued = fetch->next;
+            fetchDelete(fetch);
+        }
+        free(host);
+    }
+}
@@ -0,0 +1,31 @@
+#include "responseQueue.h"
+
+void rq_init(ResponseQueue *queue) {
+    queue->head = 0;
+    queue->count = 0;
+}
+
+bool rq_push(ResponseQueue *queue, PendingRequest request) {
+    if (rq_full(queue))
+        return false;
+    queue->slots[(queue->head + queue->count) % MAX_PIPELINE] = request;
+    queue->count++;
+    return true;
+}
+
+bool rq_pop(ResponseQueue *queue, PendingRequest *out) {
+    if (rq_empty(queue))
+        return false;
+    *out = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % MAX_PIPELINE;
+    queue->count--;
+    return true;
+}
+
+bool rq_empty(ResponseQueue *queue) {
+    return queue->count == 0;
+}
+
+bool rq_full(ResponseQueue *queue) {
+    return queue->count == MAX_PIPELINE;
+}
@@ -0,0 +1,388 @@
+#include "scan.h"
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <string.h>
+
+void scan_initSet(ByteSet *set, const char *bytes) {
+    memset(set, 0, sizeof(ByteSet));
+    for (const char *cur = bytes; *cur != '\0' && set->count < SCAN_MAX_SET; cur++) {
+        set->bytes[set->count++] = *cur;
+        set->member[(unsigned char)*cur] = true;
+    }
+}
+
+void scan_initPairs(PairSet *set) {
+    memset(set, 0, sizeof(PairSet));
+}
+
+// Setting the 0x20 bit lowercases a letter, and the text gets the same
+// treatment before its nibbles are looked up. That leaves 128 bytes, and
+// this numbers them
+static inline unsigned foldedIndex(unsigned char c) {
+    return ((c & 0xc0) >> 1) | (c & 0x1f);
+}
+
+void scan_addPair(PairSet *set, char first, char second) {
+    unsigned char a = first | 0x20, b = second | 0x20;
+    uint64_t *row = set->member[foldedIndex(a)];
+    uint64_t bit = 1ull << (foldedIndex(b) % 64);
+    if (row[foldedIndex(b) / 64] & bit)
+        return;
+    row[foldedIndex(b) / 64] |= bit;
+    set->count++;
+
+    uint8_t bucket = 1 << (a % 8);
+    set->firstLo[a & 0x0f] |= bucket;
+    set->firstHi[a >> 4] |= bucket;
+    set->secondLo[b & 0x0f] |= bucket;
+    set->secondHi[b >> 4] |= bucket;
+}
+
+static inline bool isPair(const PairSet *set, char first, char second) {
+    unsigned a = foldedIndex(first | 0x20), b = foldedIndex(second | 0x20);
+    return (set->member[a][b / 64] >> (b % 64)) & 1;
+}
+
+static const char *findPairScalar(const char *buf, int len, const PairSet *set) {
+    for (int i = 0; i + 1 < len; i++) {
+        if (isPair(set, buf[i], buf[i + 1]))
+            return buf + i;
+    }
+    return NULL;
+}
+
+// Bits of mask are bytes from buf + i whose buckets overlap the next
+// byte's. Most are real pairs; the rest are nibbles from different bytes
+// in the same bucket
+static inline const char *checkCandidates(const char *buf, int i, uint32_t mask, const PairSet *set) {
+    while (mask != 0) {
+        int at = i + __builtin_ctz(mask);
+        if (isPair(set, buf[at], buf[at + 1]))
+            return buf + at;
+        mask &= mask - 1;
+    }
+    return NULL;
+}
+
+static const char *findAnyScalar(const char *buf, int len, const ByteSet *set) {
+    for (int i = 0; i < len; i++) {
+        if (set->member[(unsigned char)buf[i]])
+            return buf + i;
+    }
+    return NULL;
+}
+
+static uint64_t blockMaskScalar(const char *block, int len, const ByteSet *set) {
+    uint64_t mask = 0;
+    for (int i = 0; i < len; i++) {
+        if (set->member[(unsigned char)block[i]])
+            mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+static uint64_t fullBlockMaskScalar(const char *block, const ByteSet *set) {
+    return blockMaskScalar(block, 64, set);
+}
+
+#define CMPESTRM_MODE (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK)
+#define CMPESTRI_MODE (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT)
+
+// pcmpestri compares 16 bytes of input against the whole set at once and
+// hands back the index of the first match
+__attribute__((target("sse4.2")))
+static const char *findAnySse42(const char *buf, int len, const ByteSet *set) {
+    __m128i needles = _mm_loadu_si128((const __m128i *)set->bytes);
+
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+        int idx = _mm_cmpestri(needles, set->count, block, 16, CMPESTRI_MODE);
+        if (idx < 16)
+            return buf + i + idx;
+    }
+
+    return findAnyScalar(buf + i, len - i, set);
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t blockMaskSse42(const char *block, const ByteSet *set) {
+    __m128i needles = _mm_loadu_si128((const __m128i *)set->bytes);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+        __m128i hits = _mm_cmpestrm(needles, set->count, chunk, 16, CMPESTRM_MODE);
+        mask |= (uint64_t)(_mm_cvtsi128_si32(hits) & 0xffff) << (16 * i);
+    }
+    return mask;
+}
+
+// Compares 32 bytes against each delimiter, ORs the results together and
+// uses the movemask to find the first hit. Sets are small (1-3 bytes for
+// every caller we have), so those get their own loop that keeps the
+// delimiters in registers; repeating a delimiter doesn't change the result
+__attribute__((target("avx2")))
+static const char *findAnyAvx2(const char *buf, int len, const ByteSet *set) {
+    int i = 0;
+
+    if (set->count <= 3) {
+        __m256i n0 = _mm256_set1_epi8(set->bytes[0]);
+        __m256i n1 = _mm256_set1_epi8(set->bytes[set->count > 1 ? 1 : 0]);
+        __m256i n2 = _mm256_set1_epi8(set->bytes[set->count > 2 ? 2 : 0]);
+        for (; i + 32 <= len; i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+            __m256i hits = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, n0), _mm256_cmpeq_epi8(block, n1)),
+                _mm256_cmpeq_epi8(block, n2));
+
+            unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+            if (mask != 0)
+                return buf + i + __builtin_ctz(mask);
+        }
+        return findAnyScalar(buf + i, len - i, set);
+    }
+
+    __m256i needles[SCAN_MAX_SET];
+    for (int n = 0; n < set->count; n++)
+        needles[n] = _mm256_set1_epi8(set->bytes[n]);
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i hits = _mm256_cmpeq_epi8(block, needles[0]);
+        for (int n = 1; n < set->count; n++)
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[n]));
+
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0)
+            return buf + i + __builtin_ctz(mask);
+    }
+
+    return findAnyScalar(buf + i, len - i, set);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hitsAvx2(__m256i block, const ByteSet *set) {
+    __m256i hits = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(set->bytes[0]));
+    for (int n = 1; n < set->count; n++)
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(set->bytes[n])));
+    return hits;
+}
+
+__attribute__((target("avx2")))
+static uint64_t blockMaskAvx2(const char *block, const ByteSet *set) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(block + 32));
+
+    if (set->count == 2) {
+        // Header fields and HTML attributes: the common case, unrolled
+        __m256i a = _mm256_set1_epi8(set->bytes[0]);
+        __m256i b = _mm256_set1_epi8(set->bytes[1]);
+        uint32_t loMask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(lo, a), _mm256_cmpeq_epi8(lo, b)));
+        uint32_t hiMask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(hi, a), _mm256_cmpeq_epi8(hi, b)));
+        return ((uint64_t)hiMask << 32) | loMask;
+    }
+
+    uint32_t loMask = (uint32_t)_mm256_movemask_epi8(hitsAvx2(lo, set));
+    uint32_t hiMask = (uint32_t)_mm256_movemask_epi8(hitsAvx2(hi, set));
+    return ((uint64_t)hiMask << 32) | loMask;
+}
+
+// Both loads are a vector wide, the second one byte on, so the loop stops
+// a byte short of a full vector and the scalar loop does the rest
+__attribute__((target("sse4.2")))
+static const char *findPairSse42(const char *buf, int len, const PairSet *set) {
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i firstLo = _mm_loadu_si128((const __m128i *)set->firstLo);
+    __m128i firstHi = _mm_loadu_si128((const __m128i *)set->firstHi);
+    __m128i secondLo = _mm_loadu_si128((const __m128i *)set->secondLo);
+    __m128i secondHi = _mm_loadu_si128((const __m128i *)set->secondHi);
+
+    int i = 0;
+    for (; i + 17 <= len; i += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)), fold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 1)), fold);
+        __m128i first = _mm_and_si128(
+            _mm_shuffle_epi8(firstLo, _mm_and_si128(a, nibble)),
+            _mm_shuffle_epi8(firstHi, _mm_and_si128(_mm_srli_epi16(a, 4), nibble)));
+        __m128i second = _mm_and_si128(
+            _mm_shuffle_epi8(secondLo, _mm_and_si128(b, nibble)),
+            _mm_shuffle_epi8(secondHi, _mm_and_si128(_mm_srli_epi16(b, 4), nibble)));
+
+        __m128i none = _mm_cmpeq_epi8(_mm_and_si128(first, second), zero);
+        uint32_t mask = ~(uint32_t)_mm_movemask_epi8(none) & 0xffff;
+        if (mask != 0) {
+            const char *pair = checkCandidates(buf, i, mask, set);
+            if (pair != NULL)
+                return pair;
+        }
+    }
+
+    return findPairScalar(buf + i, len - i, set);
+}
+
+// Same as above, 32 bytes at a time. vpshufb looks up within each 128-bit
+// lane, so the tables are repeated in both
+__attribute__((target("avx2")))
+static const char *findPairAvx2(const char *buf, int len, const PairSet *set) {
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i firstLo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->firstLo));
+    __m256i firstHi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->firstHi));
+    __m256i secondLo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->secondLo));
+    __m256i secondHi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->secondHi));
+
+    int i = 0;
+    for (; i + 33 <= len; i += 32) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)), fold);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 1)), fold);
+        __m256i first = _mm256_and_si256(
+            _mm256_shuffle_epi8(firstLo, _mm256_and_si256(a, nibble)),
+            _mm256_shuffle_epi8(firstHi, _mm256_and_si256(_mm256_srli_epi16(a, 4), nibble)));
+        __m256i second = _mm256_and_si256(
+            _mm256_shuffle_epi8(secondLo, _mm256_and_si256(b, nibble)),
+            _mm256_shuffle_epi8(secondHi, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble)));
+
+        __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(first, second), zero);
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(none);
+        if (mask != 0) {
+            const char *pair = checkCandidates(buf, i, mask, set);
+            if (pair != NULL)
+                return pair;
+        }
+    }
+
+    return findPairScalar(buf + i, len - i, set);
+}
+
+static ScanImpl best;
+
+static void pickBest() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        best = SCAN_AVX2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        best = SCAN_SSE42;
+    else
+        best = SCAN_SCALAR;
+}
+
+ScanImpl scan_bestImpl() {
+    // The loop, the workers and the blacklist builder all scan, so the
+    // first of them to get here picks for everyone
+    static pthread_once_t picked = PTHREAD_ONCE_INIT;
+    pthread_once(&picked, pickBest);
+    return best;
+}
+
+const char *scan_implName(ScanImpl impl) {
+    switch (impl) {
+        case SCAN_AVX2:
+            return "avx2";
+        case SCAN_SSE42:
+            return "sse4.2";
+        default:
+            return "scalar";
+    }
+}
+
+const char *scan_findAnyWith(ScanImpl impl, const char *buf, int len, const ByteSet *set) {
+    if (set->count == 0 || len <= 0)
+        return NULL;
+
+    switch (impl) {
+        case SCAN_AVX2:
+            return findAnyAvx2(buf, len, set);
+        case SCAN_SSE42:
+            return findAnySse42(buf, len, set);
+        default:
+            return findAnyScalar(buf, len, set);
+    }
+}
+
+const char *scan_findAny(const char *buf, int len, const ByteSet *set) {
+    if (set->count == 0 || len <= 0)
+        return NULL;
+
+    // libc's memchr is already vectorized and tuned for short inputs, so
+    // single delimiters go straight to it
+    if (set->count == 1)
+        return memchr(buf, set->bytes[0], len);
+
+    // Setting up the registers isn't worth it for less than a vector
+    if (len < 16)
+        return findAnyScalar(buf, len, set);
+
+    return scan_findAnyWith(scan_bestImpl(), buf, len, set);
+}
+
+const char *scan_findPairWith(ScanImpl impl, const char *buf, int len, const PairSet *set) {
+    if (set->count == 0 || len < 2)
+        return NULL;
+
+    switch (impl) {
+        case SCAN_AVX2:
+            return findPairAvx2(buf, len, set);
+        case SCAN_SSE42:
+            return findPairSse42(buf, len, set);
+        default:
+            return findPairScalar(buf, len, set);
+    }
+}
+
+const char *scan_findPair(const char *buf, int len, const PairSet *set) {
+    if (len < 17)
+        return set->count == 0 ? NULL : findPairScalar(buf, len, set);
+    return scan_findPairWith(scan_bestImpl(), buf, len, set);
+}
+
+void scan_cursorInitWith(ScanImpl impl, ScanCursor *cursor, const char *buf, int len, const ByteSet *set) {
+    cursor->buf = buf;
+    cursor->len = len;
+    cursor->blockStart = -64;
+    cursor->mask = 0;
+    cursor->set = set;
+
+    switch (impl) {
+        case SCAN_AVX2:
+            cursor->blockMask = blockMaskAvx2;
+            break;
+        case SCAN_SSE42:
+            cursor->blockMask = blockMaskSse42;
+            break;
+        default:
+            cursor->blockMask = fullBlockMaskScalar;
+            break;
+    }
+}
+
+void scan_cursorInit(ScanCursor *cursor, const char *buf, int len, const ByteSet *set) {
+    scan_cursorInitWith(scan_bestImpl(), cursor, buf, len, set);
+}
+
+uint64_t scan_nextBlock(ScanCursor *cursor) {
+    while (cursor->mask == 0) {
+        cursor->blockStart += 64;
+        int remaining = cursor->len - cursor->blockStart;
+        if (remaining <= 0)
+            return 0;
+
+        // The last partial block can't be loaded straight from the buffer
+        // without reading past its end, so it's copied out first
+        const char *block = cursor->buf + cursor->blockStart;
+        if (remaining >= 64) {
+            cursor->mask = cursor->blockMask(block, cursor->set);
+        } else {
+            char tail[64];
+            memcpy(tail, block, remaining);
+            uint64_t valid = ((uint64_t)1 << remaining) - 1;
+            cursor->mask = cursor->blockMask(tail, cursor->set) & valid;
+        }
+    }
+    return cursor->mask;
+}
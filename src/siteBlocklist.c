@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+
+#include "siteBlocklist.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static inline uint64_t hashStep(uint64_t hash, char c) {
+    return (hash ^ (unsigned char)tolower((unsigned char)c)) * FNV_PRIME;
+}
+
+// The hash of name[0, length), taken from its end the same way lookups do
+static uint64_t suffixHash(const char *name, int length) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = length - 1; i >= 0; i--)
+        hash = hashStep(hash, name[i]);
+    return hash;
+}
+
+// The slot name is in, or the empty one it would go in
+static SbSlot *findSlot(SiteBlocklist *list, uint64_t hash, const char *name, int length) {
+    int mask = list->numSlots - 1;
+    for (int i = hash & mask;; i = (i + 1) & mask) {
+        SbSlot *slot = list->slots + i;
+        if (slot->name == -1)
+            return slot;
+        if (slot->hash == hash && slot->nameLength == length &&
+            strncasecmp(list->names.buff + slot->name, name, length) == 0)
+            return slot;
+    }
+}
+
+static void grow(SiteBlocklist *list) {
+    SbSlot *old = list->slots;
+    int oldSize = list->numSlots;
+    list->numSlots *= 2;
+    list->slots = malloc(sizeof(SbSlot) * list->numSlots);
+    for (int i = 0; i < list->numSlots; i++)
+        list->slots[i].name = -1;
+
+    // Nothing needs comparing, every domain is already unique
+    int mask = list->numSlots - 1;
+    for (int i = 0; i < oldSize; i++) {
+        if (old[i].name == -1)
+            continue;
+        int j = old[i].hash & mask;
+        while (list->slots[j].name != -1)
+            j = (j + 1) & mask;
+        list->slots[j] = old[i];
+    }
+    free(old);
+}
+
+static int addName(SiteBlocklist *list, const char *name, int length) {
+    int offset = list->names.size;
+    da_append(&(list->names), name, length);
+    da_append(&(list->names), "", 1);
+    return offset;
+}
+
+SiteBlocklist *sb_create(const char *fileName) {
+    SiteBlocklist *list = malloc(sizeof(SiteBlocklist));
+    list->numSlots = 64;
+    list->numDomains = 0;
+    list->slots = malloc(sizeof(SbSlot) * list->numSlots);
+    for (int i = 0; i < list->numSlots; i++)
+        list->slots[i].name = -1;
+    list->numPaths = 0;
+    list->maxPaths = 16;
+    list->paths = malloc(sizeof(SbPath) * list->maxPaths);
+    da_init(&(list->names), 1024);
+
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Couldn't open site blocklist %s\n", fileName);
+        return list;
+    }
+    char line[2048];
+    while (fgets(line, sizeof(line), file))
+        sb_add(list, line);
+    fclose(file);
+    return list;
+}
+
+void sb_add(SiteBlocklist *list, const char *rule) {
+    // Surrounding space, comments and blank lines are skipped, and so are
+    // the scheme and wildcard some lists write domains with
+    while (isspace((unsigned char)*rule))
+        rule++;
+    int length = strcspn(rule, "#");
+    while (length > 0 && isspace((unsigned char)rule[length - 1]))
+        length--;
+    if (length <= 0)
+        return; // blank, or only a comment
+    if (length > 7 && strncasecmp(rule, "http://", 7) == 0) {
+        rule += 7;
+        length -= 7;
+    }
+    if (length > 2 && strncmp(rule, "*.", 2) == 0) {
+        rule += 2;
+        length -= 2;
+    }
+
+    const char *slash = memchr(rule, '/', length);
+    int domainLength = slash != NULL ? slash - rule : length;
+    // "example.com." is the same host as "example.com"
+    while (domainLength > 0 && rule[domainLength - 1] == '.')
+        domainLength--;
+    if (domainLength == 0)
+        return;
+
+    uint64_t hash = suffixHash(rule, domainLength);
+    SbSlot *slot = findSlot(list, hash, rule, domainLength);
+    if (slot->name == -1) {
+        slot->hash = hash;
+        slot->name = addName(list, rule, domainLength);
+        for (char *cur = list->names.buff + slot->name; *cur != '\0'; cur++)
+            *cur = tolower((unsigned char)*cur);
+        slot->nameLength = domainLength;
+        slot->everything = false;
+        slot->firstPath = -1;
+        list->numDomains++;
+    }
+
+    // A bare domain, or one with just "/", blocks all of it
+    int pathLength = slash != NULL ? rule + length - slash : 0;
+    if (pathLength <= 1) {
+        slot->everything = true;
+    }
+    else {
+        if (list->numPaths == list->maxPaths) {
+            list->maxPaths *= 2;
+            list->paths = realloc(list->paths, sizeof(SbPath) * list->maxPaths);
+        }
+        SbPath *path = list->paths + list->numPaths;
+        path->prefix = addName(list, slash, pathLength);
+        path->length = pathLength;
+        path->next = slot->firstPath;
+        slot->firstPath = list->numPaths++;
+    }
+
+    if (list->numDomains * 2 > list->numSlots)
+        grow(list);
+}
+
+bool sb_blocks(SiteBlocklist *list, const char *host, const char *path) {
+    if (list->numDomains == 0)
+        return false;
+
+    int length = strlen(host);
+    while (length > 0 && host[length - 1] == '.')
+        length--;
+
+    // Each suffix that starts a label is looked up as the hash reaches it
+    uint64_t hash = FNV_OFFSET;
+    for (int i = length - 1; i >= 0; i--) {
+        hash = hashStep(hash, host[i]);
+        if (i > 0 && host[i - 1] != '.')
+            continue;
+
+        SbSlot *slot = findSlot(list, hash, host + i, length - i);
+        if (slot->name == -1)
+            continue;
+        if (slot->everything)
+            return true;
+        for (int p = slot->firstPath; p != -1 && path != NULL; p = list->paths[p].next) {
+            SbPath *prefix = list->paths + p;
+            if (strncmp(path, list->names.buff + prefix->prefix, prefix->length) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+bool sb_blocksUrl(SiteBlocklist *list, const char *url) {
+    if (strncasecmp(url, "http://", 7) != 0)
+        return false;
+
+    // The host runs up to the path, leaving out any user info and port
+    const char *authority = url + 7;
+    int authorityLength = strcspn(authority, "/?#");
+    const char *at = memrchr(authority, '@', authorityLength);
+    if (at != NULL) {
+        authorityLength -= at + 1 - authority;
+        authority = at + 1;
+    }
+    int hostLength = authorityLength;
+    if (authority[0] == '[') {
+        const char *close = memchr(authority, ']', authorityLength);
+        hostLength = close != NULL ? close + 1 - authority : authorityLength;
+    }
+    else {
+        const char *colon = memchr(authority, ':', authorityLength);
+        if (colon != NULL)
+            hostLength = colon - authority;
+    }
+
+    char host[256];
+    if (hostLength >= (int)sizeof(host))
+        return false;
+    memcpy(host, authority, hostLength);
+    host[hostLength] = '\0';
+
+    const char *path = authority + authorityLength;
+    return sb_blocks(list, host, *path == '/' ? path : "/");
+}
+
+void sb_delete(SiteBlocklist *list) {
+    if (list == NULL)
+        return;
+    free(list->slots);
+    free(list->paths);
+    da_term(&(list->names));
+    free(list);
+}
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+
+#include "workerPool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static void *workLoop(void *arg) {
+    WorkerPool *pool = arg;
+
+    pthread_mutex_lock(&(pool->lock));
+    for (;;) {
+        while (pool->numQueued == 0 && !pool->stopping)
+            pthread_cond_wait(&(pool->wake), &(pool->lock));
+        if (pool->stopping)
+            break;
+
+        WpJob job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % WP_MAX_JOBS;
+        pool->numQueued--;
+        pthread_mutex_unlock(&(pool->lock));
+
+        bool tell = job.work(job.ctx);
+
+        pthread_mutex_lock(&(pool->lock));
+        if (!tell) {
+            pool->outstanding--;
+            continue;
+        }
+        // Outstanding keeps counting it until the loop has it, which is
+        // what keeps finished from filling up
+        pool->finished[pool->numFinished++] = job;
+        if (pool->numFinished == 1) {
+            uint64_t one = 1;
+            if (write(pool->doneFd, &one, sizeof(one)) != sizeof(one))
+                fprintf(stderr, "Error on write() to the worker eventfd\n");
+        }
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return NULL;
+}
+
+bool wp_init(WorkerPool *pool, int threads, int epollfd) {
+    pool->numThreads = 0;
+    pool->head = 0;
+    pool->numQueued = 0;
+    pool->numFinished = 0;
+    pool->outstanding = 0;
+    pool->stopping = false;
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->wake), NULL);
+
+    pool->doneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = pool->doneFd;
+    if (pool->doneFd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, pool->doneFd, &ev) == -1) {
+        fprintf(stderr, "Couldn't set up the worker pool, decoding on the loop instead\n");
+        return false;
+    }
+
+    if (threads > WP_MAX_THREADS)
+        threads = WP_MAX_THREADS;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&(pool->threads[i]), NULL, workLoop, pool) != 0)
+            break;
+        pool->numThreads++;
+    }
+    return pool->numThreads > 0;
+}
+
+bool wp_submit(WorkerPool *pool, WorkFunc work, DoneFunc done, void *ctx) {
+    if (pool->numThreads == 0)
+        return false;
+
+    pthread_mutex_lock(&(pool->lock));
+    bool room = pool->outstanding < WP_MAX_JOBS;
+    if (room) {
+        int tail = (pool->head + pool->numQueued) % WP_MAX_JOBS;
+        pool->queue[tail] = (WpJob){ work, done, ctx };
+        pool->numQueued++;
+        pool->outstanding++;
+        pthread_cond_signal(&(pool->wake));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return room;
+}
+
+bool wp_handle(WorkerPool *pool, int fd) {
+    if (fd != pool->doneFd)
+        return false;
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return true;
+
+    // Taken out first, since a done function may well submit more
+    WpJob finished[WP_MAX_JOBS];
+    pthread_mutex_lock(&(pool->lock));
+    int numFinished = pool->numFinished;
+    memcpy(finished, pool->finished, numFinished * sizeof(WpJob));
+    pool->numFinished = 0;
+    pool->outstanding -= numFinished;
+    pthread_mutex_unlock(&(pool->lock));
+
+    for (int i = 0; i < numFinished; i++)
+        finished[i].done(finished[i].ctx);
+    return true;
+}
+
+void wp_term(WorkerPool *pool) {
+    pthread_mutex_lock(&(pool->lock));
+    pool->stopping = true;
+    pthread_cond_broadcast(&(pool->wake));
+    pthread_mutex_unlock(&(pool->lock));
+    for (int i = 0; i < pool->numThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    if (pool->doneFd != -1)
+        close(pool->doneFd);
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->wake));
+}
@@ -0,0 +1,1283 @@
+// Microbenchmarks for the proxy's hot paths.
+// Run with no arguments to run all of them, or name the ones you want:
+//   ./bench headers
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <brotli/encode.h>
+
+#include "bodyDecoder.h"
+#include "caseFold.h"
+#include "chunkDecoder.h"
+#include "contentFilter.h"
+#include "htmlScanner.h"
+#include "httpParser.h"
+#include "scan.h"
+#include "siteBlocklist.h"
+
+// Keeps the compiler from optimizing away work whose result we ignore
+static volatile long sink;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double bytes, double seconds) {
+    printf("  %-32s %8.3f GB/s  (%.0f MB in %.3fs)\n",
+           name, bytes / seconds / 1e9, bytes / 1e6, seconds);
+}
+
+/************ Header parsing ************/
+static const char requestHeader[] =
+    "GET http://www.example.com/articles/2018/12/some-long-article-name.html?ref=front HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:63.0) Gecko/20100101 Firefox/63.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.2.1234567890.1543000000\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char responseHeader[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Tue, 04 Dec 2018 02:12:00 GMT\r\n"
+    "Server: Apache/2.4.29 (Ubuntu)\r\n"
+    "Last-Modified: Mon, 03 Dec 2018 19:44:00 GMT\r\n"
+    "ETag: \"2d8b-57c2f0c1b8a40-gzip\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Encoding: gzip\r\n"
+    "Cache-Control: max-age=3600, public\r\n"
+    "Expires: Tue, 04 Dec 2018 03:12:00 GMT\r\n"
+    "Age: 120\r\n"
+    "Content-Length: 11659\r\n"
+    "Keep-Alive: timeout=5, max=100\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "\r\n";
+
+static void benchParse(const char *name, const char *header) {
+    int size = strlen(header);
+    int iterations = 2000000;
+    HttpMessage msg;
+
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        sink += hp_parse(&msg, header, size);
+        sink += hp_findField(&msg, header, "Content-Length");
+    }
+    report(name, (double)size * iterations, now() - start);
+}
+
+// A slow client's header shows up a few bytes per read. The parser keeps
+// its place, so this should cost about the same as parsing it in one go
+static void benchTrickle(const char *name, const char *header, int step) {
+    int size = strlen(header);
+    int iterations = 500000;
+    HttpParser parser;
+
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        hp_init(&parser);
+        for (int avail = step; hp_feed(&parser, header, avail < size ? avail : size) == HP_NEED_MORE; avail += step)
+            ;
+        sink += parser.msg.headerLength;
+    }
+    report(name, (double)size * iterations, now() - start);
+}
+
+// Every known name has to map back to itself in any case, and nothing else
+// may map to a known name. Catches two names landing in the same slot
+static void crossCheckNames() {
+    const char *others[] = { "X-Forwarded-For", "Hosts", "Ag", "Content-Lengths", "Set-Cookie2", "Accept", "" };
+    char name[32];
+
+    for (HeaderName id = HDR_OTHER + 1; id < HDR_COUNT; id++) {
+        const char *canonical = hp_headerName(id);
+        int length = strlen(canonical);
+        for (int i = 0; i <= length; i++)
+            name[i] = i % 2 ? tolower(canonical[i]) : toupper(canonical[i]);
+        if (hp_lookupName(canonical, length) != id || hp_lookupName(name, length) != id) {
+            fprintf(stderr, "header name %s doesn't map back to itself\n", canonical);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 7; i++) {
+        if (hp_lookupName(others[i], strlen(others[i])) != HDR_OTHER) {
+            fprintf(stderr, "%s mapped to a known header\n", others[i]);
+            exit(1);
+        }
+    }
+}
+
+// The names from a typical response, looked up the way parseHeader used to
+// (compare against each name it handles in turn) and with the slot table
+static void benchNames() {
+    const char *names[] = { "Date", "Server", "Last-Modified", "ETag", "Accept-Ranges", "Vary",
+                            "Content-Encoding", "Cache-Control", "Expires", "Age", "Content-Length",
+                            "Keep-Alive", "Connection", "Content-Type" };
+    const char *handled[] = { "Host", "Transfer-Encoding", "Content-Length", "Age", "Content-Encoding",
+                              "Cache-Control", "Connection", "ETag" };
+    int numNames = sizeof(names) / sizeof(names[0]);
+    int lengths[sizeof(names) / sizeof(names[0])];
+    for (int i = 0; i < numNames; i++)
+        lengths[i] = strlen(names[i]);
+    int iterations = 2000000;
+
+    double start = now();
+    for (int iter = 0; iter < iterations; iter++) {
+        for (int i = 0; i < numNames; i++) {
+            HttpSlice slice = { 0, lengths[i] };
+            for (int h = 0; h < 8; h++) {
+                if (hp_sliceEqualsNoCase(names[i], slice, handled[h])) {
+                    sink += h;
+                    break;
+                }
+            }
+        }
+    }
+    double chain = now() - start;
+
+    start = now();
+    for (int iter = 0; iter < iterations; iter++) {
+        for (int i = 0; i < numNames; i++)
+            sink += hp_lookupName(names[i], lengths[i]);
+    }
+    double table = now() - start;
+
+    double lookups = (double)iterations * numNames;
+    printf("  %-32s %8.1f ns/name\n", "name lookup, compare chain", chain / lookups * 1e9);
+    printf("  %-32s %8.1f ns/name\n", "name lookup, slot table", table / lookups * 1e9);
+}
+
+static void benchHeaders() {
+    printf("headers: hp_parse + one field lookup\n");
+    crossCheckNames();
+    benchParse("request header", requestHeader);
+    benchParse("response header", responseHeader);
+    benchTrickle("response header, 64B per read", responseHeader, 64);
+    benchTrickle("response header, 16B per read", responseHeader, 16);
+    benchNames();
+}
+
+/************ Delimiter scanning ************/
+// Every implementation has to agree with the scalar one. Random buffers
+// are built from a small alphabet so delimiters show up often, and start
+// at random offsets so unaligned loads and short tails get exercised
+static void crossCheckScan() {
+    const char alphabet[] = "abABi<>\"=:\r\n \x80\xff";
+    const char *sets[] = { "\n", "\r\n:", "<\"", ":\n", "\x80\xff<" };
+    char buf[512];
+    int cases = 0;
+
+    srand(112);
+    for (int round = 0; round < 200000; round++) {
+        int offset = rand() % 32;
+        int len = rand() % (sizeof(buf) - 32);
+        for (int i = 0; i < offset + len; i++)
+            buf[i] = rand() % 8 == 0 ? alphabet[rand() % (sizeof(alphabet) - 1)] : 'x';
+
+        ByteSet set;
+        scan_initSet(&set, sets[round % 5]);
+        const char *expected = scan_findAnyWith(SCAN_SCALAR, buf + offset, len, &set);
+
+        // Pairs from the same letters, in either case, sharing buckets
+        PairSet pairs;
+        scan_initPairs(&pairs);
+        scan_addPair(&pairs, 'a', 'B');
+        scan_addPair(&pairs, round % 2 ? 'x' : 'i', 'a'); // 'i' shares a's bucket
+        scan_addPair(&pairs, '<', '\x80');
+        const char *expectedPair = scan_findPairWith(SCAN_SCALAR, buf + offset, len, &pairs);
+
+        for (ScanImpl impl = SCAN_SSE42; impl <= scan_bestImpl(); impl++) {
+            const char *pair = scan_findPairWith(impl, buf + offset, len, &pairs);
+            if (pair != expectedPair) {
+                fprintf(stderr, "pair scan mismatch: %s found %ld, scalar found %ld (len %d)\n",
+                        scan_implName(impl), pair ? pair - buf - offset : -1L,
+                        expectedPair ? expectedPair - buf - offset : -1L, len);
+                exit(1);
+            }
+            const char *got = scan_findAnyWith(impl, buf + offset, len, &set);
+            if (got != expected) {
+                fprintf(stderr, "scan mismatch: %s found %ld, scalar found %ld (len %d, set %d)\n",
+                        scan_implName(impl), got ? got - buf - offset : -1L,
+                        expected ? expected - buf - offset : -1L, len, round % 5);
+                exit(1);
+            }
+
+            // A cursor has to hand out every hit, in order, with nothing
+            // from past the end of the buffer
+            ScanCursor scalarCursor, cursor;
+            scan_cursorInitWith(SCAN_SCALAR, &scalarCursor, buf + offset, len, &set);
+            scan_cursorInitWith(impl, &cursor, buf + offset, len, &set);
+            const char *want, *hit;
+            do {
+                want = scan_next(&scalarCursor);
+                hit = scan_next(&cursor);
+                if (hit != want || (want != NULL && !set.member[(unsigned char)*want])) {
+                    fprintf(stderr, "scan cursor mismatch: %s (len %d, set %d)\n",
+                            scan_implName(impl), len, round % 5);
+                    exit(1);
+                }
+            } while (want != NULL);
+            cases++;
+        }
+    }
+    printf("  cross-checked %d random cases against scalar\n", cases);
+}
+
+// Finds every delimiter in a page of HTML-ish text, one call per hit
+static void benchScanSet(ScanImpl impl, const char *page, int size, const char *delims, const char *label) {
+    ByteSet set;
+    scan_initSet(&set, delims);
+    int iterations = 50;
+    char name[64];
+    snprintf(name, sizeof(name), "%-7s %s", scan_implName(impl), label);
+
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        const char *cur = page;
+        const char *end = page + size;
+        const char *hit;
+        while ((hit = scan_findAnyWith(impl, cur, end - cur, &set)) != NULL) {
+            sink++;
+            cur = hit + 1;
+        }
+    }
+    report(name, (double)size * iterations, now() - start);
+}
+
+// Same, but walking the hits with a cursor instead of a call per hit
+static void benchScanCursor(ScanImpl impl, const char *page, int size, const char *delims, const char *label) {
+    ByteSet set;
+    scan_initSet(&set, delims);
+    int iterations = 50;
+    char name[64];
+    snprintf(name, sizeof(name), "%-7s cursor %s", scan_implName(impl), label);
+
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        ScanCursor cursor;
+        scan_cursorInitWith(impl, &cursor, page, size, &set);
+        while (scan_next(&cursor) != NULL)
+            sink++;
+    }
+    report(name, (double)size * iterations, now() - start);
+}
+
+static void benchScan() {
+    printf("scan: find-any-of over 4MB of text (best here: %s)\n", scan_implName(scan_bestImpl()));
+    crossCheckScan();
+
+    // Mostly prose with a tag every few hundred bytes, like a real page
+    int size = 4 * 1024 * 1024;
+    char *page = malloc(size);
+    const char paragraph[] =
+        "Biodiversity informatics brings together species observations, "
+        "taxonomic names and specimen records from collections all over the "
+        "world so that researchers can ask questions at a much larger scale "
+        "than any single museum could support on its own. <a href=\"/x\">";
+    for (int i = 0; i < size; i++)
+        page[i] = paragraph[i % (sizeof(paragraph) - 1)];
+
+    for (ScanImpl impl = SCAN_SCALAR; impl <= scan_bestImpl(); impl++) {
+        benchScanSet(impl, page, size, "\n", "newline");
+        benchScanSet(impl, page, size, "\r\n:", "header delimiters");
+        benchScanSet(impl, page, size, "<\"", "html delimiters");
+        benchScanCursor(impl, page, size, "<\"", "html delimiters");
+    }
+    free(page);
+}
+
+/************ Chunked decoding ************/
+typedef struct {
+    char *out;
+    int size;
+} Collected;
+
+static void collect(Collected *collected, const char *data, int len) {
+    memcpy(collected->out + collected->size, data, len);
+    collected->size += len;
+}
+
+// Frames body in chunks of up to maxChunk bytes, with the odd extension
+// and a trailer at the end, like the servers we've seen in the wild
+static int encodeChunked(char *out, const char *body, int size, int maxChunk) {
+    int pos = 0;
+    for (int start = 0; start < size;) {
+        int len = 1 + rand() % maxChunk;
+        if (len > size - start)
+            len = size - start;
+        pos += sprintf(out + pos, rand() % 4 == 0 ? "%x;name=\"v\"\r\n" : "%X\r\n", len);
+        memcpy(out + pos, body + start, len);
+        pos += len;
+        out[pos++] = '\r';
+        out[pos++] = '\n';
+        start += len;
+    }
+    pos += sprintf(out + pos, "0\r\nExpires: never\r\n\r\n");
+    return pos;
+}
+
+// Feeds encoded in pieces of step bytes (random sizes if step is 0) and
+// checks the whole body comes out and nothing past the end is consumed
+static bool decodeInPieces(const char *encoded, int encodedSize, const char *body, int size, int step, Collected *collected) {
+    ChunkDecoder decoder;
+    cd_init(&decoder);
+    collected->size = 0;
+
+    int fed = 0, end = 0;
+    while (end < encodedSize + 8 && !cd_done(&decoder)) {
+        end += step != 0 ? step : 1 + rand() % 700;
+        if (end > encodedSize + 8)
+            end = encodedSize + 8; // the 8 bytes after are the next message
+        int used = cd_feed(&decoder, encoded + fed, end - fed, (ChunkSink)collect, collected);
+        if (used == -1)
+            return false;
+        fed += used;
+    }
+    return cd_done(&decoder) && fed == encodedSize &&
+           collected->size == size && memcmp(collected->out, body, size) == 0;
+}
+
+static void crossCheckChunked() {
+    // One byte chunks with extensions take up to 15 bytes each
+    static char body[4096], encoded[4096 * 16];
+    Collected collected = { malloc(sizeof(body)), 0 };
+
+    srand(112);
+    for (int round = 0; round < 2000; round++) {
+        int size = rand() % sizeof(body);
+        for (int i = 0; i < size; i++)
+            body[i] = rand();
+        int encodedSize = encodeChunked(encoded, body, size, 1 + rand() % 300);
+        memcpy(encoded + encodedSize, "HTTP/1.1", 8);
+
+        int steps[] = { 0, 1, 7, encodedSize + 8 };
+        for (int i = 0; i < 4; i++) {
+            if (!decodeInPieces(encoded, encodedSize, body, size, steps[i], &collected)) {
+                fprintf(stderr, "chunked decode mismatch (size %d, step %d)\n", size, steps[i]);
+                exit(1);
+            }
+        }
+    }
+
+    // Things that have to be rejected rather than misread
+    const char *bad[] = { "\r\n", "g\r\n", "5\r\nhelloX\r\n", "1234567890abcdef0\r\n", ";ext\r\n" };
+    for (int i = 0; i < 5; i++) {
+        ChunkDecoder decoder;
+        cd_init(&decoder);
+        if (cd_feed(&decoder, bad[i], strlen(bad[i]), NULL, NULL) != -1) {
+            fprintf(stderr, "chunked decoder accepted bad framing %d\n", i);
+            exit(1);
+        }
+    }
+    free(collected.out);
+    printf("  cross-checked 2000 random bodies split 4 ways\n");
+}
+
+static void benchChunkedWith(const char *name, const char *encoded, int encodedSize, int segment, int size, Collected *collected) {
+    int rounds = 20;
+    double start = now();
+    for (int round = 0; round < rounds; round++) {
+        ChunkDecoder decoder;
+        cd_init(&decoder);
+        collected->size = 0;
+        for (int fed = 0; fed < encodedSize && !cd_done(&decoder);) {
+            int len = encodedSize - fed < segment ? encodedSize - fed : segment;
+            fed += cd_feed(&decoder, encoded + fed, len, (ChunkSink)collect, collected);
+        }
+        sink += collected->size;
+    }
+    if (collected->size != size) {
+        fprintf(stderr, "%s: decoded %d of %d bytes\n", name, collected->size, size);
+        exit(1);
+    }
+    report(name, (double)encodedSize * rounds, now() - start);
+}
+
+static void benchChunked() {
+    printf("chunked decoding:\n");
+    crossCheckChunked();
+
+    int size = 4 << 20;
+    char *body = malloc(size);
+    char *encoded = malloc(size * 2);
+    Collected collected = { malloc(size), 0 };
+    for (int i = 0; i < size; i++)
+        body[i] = 'a' + i % 26;
+
+    // Typical server chunks are a few KB; tiny ones are all framing
+    int encodedSize = encodeChunked(encoded, body, size, 8192);
+    benchChunkedWith("8KB chunks, one buffer", encoded, encodedSize, encodedSize, size, &collected);
+    benchChunkedWith("8KB chunks, 1460B segments", encoded, encodedSize, 1460, size, &collected);
+    encodedSize = encodeChunked(encoded, body, size, 64);
+    benchChunkedWith("64B chunks, 1460B segments", encoded, encodedSize, 1460, size, &collected);
+
+    free(body);
+    free(encoded);
+    free(collected.out);
+}
+
+/************ Content filter ************/
+#define MAX_TERM 16
+
+// The automaton as it was before it was laid out in one table: a malloc
+// per node, each with a pointer for every letter. Kept to measure the
+// table against
+typedef struct TrieNode {
+    struct TrieNode *trie[26];
+    struct TrieNode *fail;
+    int depth; // only trie[] entries one deeper are children
+    bool isComplete;
+} TrieNode;
+
+static TrieNode *newNode(int depth) {
+    TrieNode *node = calloc(1, sizeof(TrieNode));
+    node->depth = depth;
+    return node;
+}
+
+static TrieNode *pointerTrie(const char *terms, int count, int *numNodes) {
+    TrieNode *root = newNode(0);
+    *numNodes = 1;
+    for (int i = 0; i < count; i++) {
+        TrieNode *node = root;
+        for (const char *cur = terms + i * MAX_TERM; *cur != '\0'; cur++) {
+            int idx = tolower(*cur) - 'a';
+            if (node->trie[idx] == NULL) {
+                node->trie[idx] = newNode(node->depth + 1);
+                (*numNodes)++;
+            }
+            node = node->trie[idx];
+        }
+        node->isComplete = true;
+    }
+
+    TrieNode **queue = malloc(sizeof(TrieNode*) * *numNodes);
+    int head = 0, tail = 0;
+    root->fail = root;
+    for (int i = 0; i < 26; i++) {
+        if (root->trie[i] != NULL) {
+            root->trie[i]->fail = root;
+            queue[tail++] = root->trie[i];
+        } else {
+            root->trie[i] = root;
+        }
+    }
+    while (head < tail) {
+        TrieNode *node = queue[head++];
+        for (int i = 0; i < 26; i++) {
+            TrieNode *child = node->trie[i];
+            if (child == NULL) {
+                node->trie[i] = node->fail->trie[i];
+                continue;
+            }
+            child->fail = node->fail->trie[i];
+            child->isComplete = child->isComplete || child->fail->isComplete;
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    return root;
+}
+
+static bool pointerSearch(TrieNode *root, const char *text, int size) {
+    TrieNode *state = root;
+    for (int i = 0; i < size; i++) {
+        unsigned idx = (text[i] | 0x20) - 'a';
+        if (idx >= 26) {
+            state = root;
+            continue;
+        }
+        state = state->trie[idx];
+        if (state->isComplete)
+            return true;
+    }
+    return false;
+}
+
+static void deleteTrie(TrieNode *root, int numNodes) {
+    // Every node is found through its children first, since shortcuts can
+    // point into parts of the trie that would already be freed
+    TrieNode **nodes = malloc(sizeof(TrieNode*) * numNodes);
+    int count = 0;
+    nodes[count++] = root;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 26; j++) {
+            if (nodes[i]->trie[j]->depth == nodes[i]->depth + 1)
+                nodes[count++] = nodes[i]->trie[j];
+        }
+    }
+    for (int i = 0; i < count; i++)
+        free(nodes[i]);
+    free(nodes);
+}
+
+// The blacklist scan as it was before the automaton: split the body into
+// words on a copy, then walk the trie again from every offset of every word.
+// Only the trie's own edges are followed, not the automaton's shortcuts
+static bool restartSearch(TrieNode *root, const char *text, int size) {
+    char *copy = malloc(size + 1);
+    memcpy(copy, text, size);
+    copy[size] = '\0';
+
+    bool found = false;
+    for (char *token = strtok(copy, " <>"); token != NULL && !found; token = strtok(NULL, " <>")) {
+        for (char *cur = token; *cur != '\0' && !found; cur++) {
+            TrieNode *trie = root;
+            for (char *matched = cur; *matched != '\0'; matched++) {
+                int idx = tolower(*matched) - 'a';
+                if (idx < 0 || idx > 25 || trie->trie[idx]->depth != trie->depth + 1)
+                    break;
+                trie = trie->trie[idx];
+                if (trie->isComplete) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+    free(copy);
+    return found;
+}
+
+// Random terms between minLen and maxLen letters, one per line, in a temp
+// file for cf_create. Each one is also kept in terms, NUL terminated,
+// MAX_TERM bytes apart
+static ContentFilter *randomBlacklist(int count, int minLen, int maxLen, int alphabet, char *terms) {
+    char path[] = "/tmp/blacklistXXXXXX";
+    FILE *file = fdopen(mkstemp(path), "w");
+    for (int i = 0; i < count; i++) {
+        char *term = terms + i * MAX_TERM;
+        int len = minLen + rand() % (maxLen - minLen + 1);
+        for (int j = 0; j < len; j++)
+            term[j] = (rand() % 4 == 0 ? 'A' : 'a') + rand() % alphabet;
+        term[len] = '\0';
+        fprintf(file, "%s\r\n", term);
+    }
+    fclose(file);
+
+    ContentFilter *filter = cf_create(path);
+    remove(path);
+    return filter;
+}
+
+// Text made of words and tags over the first alphabet letters
+static void randomText(char *text, int size, int alphabet) {
+    static const char separators[] = " <>\n.,\"=/1";
+    for (int i = 0; i < size; i++) {
+        if (rand() % 6 == 0)
+            text[i] = separators[rand() % (sizeof(separators) - 1)];
+        else
+            text[i] = (rand() % 8 == 0 ? 'A' : 'a') + rand() % alphabet;
+    }
+}
+
+// Feeds text in random pieces, so pairs and terms get split between them
+static bool searchInPieces(ContentFilter *filter, const char *text, int size) {
+    FilterStream stream;
+    cf_streamInit(&stream, filter);
+    for (int pos = 0; pos < size;) {
+        int len = 1 + rand() % 40;
+        if (len > size - pos)
+            len = size - pos;
+        cf_streamFeed(&stream, text + pos, len);
+        pos += len;
+    }
+    bool matched = cf_streamVerdict(&stream);
+    cf_streamTerm(&stream);
+    return matched;
+}
+
+// Saves filter compiled and loads it back, the way the proxy would
+static ContentFilter *compiledCopy(ContentFilter *filter, double *loadTime) {
+    char path[] = "/tmp/compiledXXXXXX";
+    close(mkstemp(path));
+    if (!cf_save(filter, path)) {
+        fprintf(stderr, "couldn't save a compiled filter\n");
+        exit(1);
+    }
+    double start = now();
+    ContentFilter *loaded = cf_create(path);
+    if (loadTime != NULL)
+        *loadTime = now() - start;
+    remove(path);
+    if (loaded->mapped == NULL || loaded->numStates != filter->numStates) {
+        fprintf(stderr, "compiled filter didn't load\n");
+        exit(1);
+    }
+    return loaded;
+}
+
+// A compiled file that's cut short, or has an entry or a class past the
+// end of the table, has to be turned away rather than mapped
+static void checkDamagedFilter(ContentFilter *filter) {
+    char path[] = "/tmp/compiledXXXXXX";
+    close(mkstemp(path));
+    long tableStart = -1;
+    for (int damage = 0; damage < 3; damage++) {
+        cf_save(filter, path);
+        FILE *file = fopen(path, "r+b");
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        if (tableStart == -1)
+            tableStart = size - 4L * filter->numEntries;
+        uint32_t bad = UINT32_MAX - 3;
+        if (damage == 0) {
+            ftruncate(fileno(file), size - 4);
+        }
+        else if (damage == 1) {
+            fseek(file, tableStart + 4 * (rand() % filter->numEntries), SEEK_SET);
+            fwrite(&bad, sizeof(bad), 1, file);
+        }
+        else {
+            // classOf sits just after the header's seven words
+            fseek(file, 32 + 'a', SEEK_SET);
+            fputc(filter->numClasses, file);
+        }
+        fclose(file);
+
+        ContentFilter *loaded = cf_create(path);
+        if (loaded->mapped != NULL || loaded->numStates != 1) {
+            fprintf(stderr, "damaged compiled filter was loaded (damage %d)\n", damage);
+            exit(1);
+        }
+        cf_delete(loaded);
+    }
+    remove(path);
+}
+
+// Small alphabets and short terms, so matches (and failure link chains)
+// are common, checked against the pointer automaton and the restart walk.
+// Lists without one letter terms get the pair prefilter, and are checked
+// both with and without it, and every list is checked compiled too
+static void crossCheckFilter() {
+    static char text[2048];
+    char terms[20 * MAX_TERM];
+    int prefiltered = 0;
+    srand(112);
+    for (int round = 0; round < 300; round++) {
+        int alphabet = 2 + rand() % 4;
+        int count = 1 + rand() % 20;
+        ContentFilter *filter = randomBlacklist(count, 1 + round % 2, 6, alphabet, terms);
+        bool prefilter = filter->prefilter;
+        prefiltered += prefilter;
+        int numNodes;
+        TrieNode *root = pointerTrie(terms, count, &numNodes);
+        if (filter->numStates != numNodes) {
+            fprintf(stderr, "filter has %d states, the trie %d nodes (round %d)\n", filter->numStates, numNodes, round);
+            exit(1);
+        }
+        ContentFilter *loaded = compiledCopy(filter, NULL);
+        for (int i = 0; i < 20; i++) {
+            int size = rand() % sizeof(text);
+            randomText(text, size, alphabet + 1);
+            bool expected = restartSearch(root, text, size);
+            if (cf_searchText(filter, text, size) != expected || pointerSearch(root, text, size) != expected ||
+                searchInPieces(filter, text, size) != expected || cf_searchText(loaded, text, size) != expected) {
+                fprintf(stderr, "filter mismatch (round %d, text %d, prefilter %d)\n", round, i, prefilter);
+                exit(1);
+            }
+            filter->prefilter = false;
+            if (cf_searchText(filter, text, size) != expected || searchInPieces(filter, text, size) != expected) {
+                fprintf(stderr, "filter mismatch without the prefilter (round %d, text %d)\n", round, i);
+                exit(1);
+            }
+            filter->prefilter = prefilter;
+        }
+        if (round % 100 == 0)
+            checkDamagedFilter(filter);
+        deleteTrie(root, numNodes);
+        cf_delete(loaded);
+        cf_delete(filter);
+    }
+    printf("  cross-checked 6000 random texts against the pointer trie and the restart walk"
+           " (%d of 300 lists prefiltered), compiled and not\n", prefiltered);
+}
+
+// Lists too big for every state to get a row, so walks go through sparse
+// states and their failure links, checked the same way. Random words
+// would hardly ever get that deep, so the texts are strewn with terms cut
+// a letter short
+static void crossCheckSparseFilter() {
+    static char text[2048];
+    int count = 30000;
+    char *terms = malloc(count * MAX_TERM);
+    int matched = 0;
+    srand(41);
+    for (int round = 0; round < 3; round++) {
+        int alphabet = 18 + 4 * round;
+        ContentFilter *filter = randomBlacklist(count, 5, 9, alphabet, terms);
+        if (filter->sparseFrom == filter->acceptFrom) {
+            fprintf(stderr, "big list has no sparse states (round %d)\n", round);
+            exit(1);
+        }
+        int numNodes;
+        TrieNode *root = pointerTrie(terms, count, &numNodes);
+        ContentFilter *loaded = compiledCopy(filter, NULL);
+        for (int i = 0; i < 200; i++) {
+            int size = rand() % sizeof(text);
+            randomText(text, size, alphabet + 1);
+            for (int planted = 0; planted < size / 64 + 1; planted++) {
+                const char *term = terms + (rand() % count) * MAX_TERM;
+                // Half the texts get one whole term
+                int len = strlen(term) - (planted > 0 || rand() % 2 == 0);
+                if (len < size)
+                    memcpy(text + rand() % (size - len), term, len);
+            }
+            bool expected = restartSearch(root, text, size);
+            matched += expected;
+            if (cf_searchText(filter, text, size) != expected || pointerSearch(root, text, size) != expected ||
+                searchInPieces(filter, text, size) != expected || cf_searchText(loaded, text, size) != expected) {
+                fprintf(stderr, "sparse filter mismatch (round %d, text %d)\n", round, i);
+                exit(1);
+            }
+        }
+        checkDamagedFilter(filter);
+        deleteTrie(root, numNodes);
+        cf_delete(loaded);
+        cf_delete(filter);
+    }
+    free(terms);
+    printf("  cross-checked 600 random texts (%d matching) against lists of %d terms with sparse states,"
+           " compiled and not\n", matched, count);
+}
+
+// Whether text starts with term, folding every character as it's compared
+static bool foldedMatchAt(const char *text, int size, const char *term) {
+    while (*term != '\0') {
+        uint32_t want, got;
+        int termLen = fold_decode(term, strlen(term), &want);
+        int textLen = fold_decode(text, size, &got);
+        if (textLen == 0 || fold_codePoint(got) != fold_codePoint(want))
+            return false;
+        term += termLen;
+        text += textLen;
+        size -= textLen;
+    }
+    return true;
+}
+
+// Terms with digits, spaces and UTF-8, in all the cases the fold table has
+// for them, checked against trying every term at every offset. Stray bytes
+// in the text, and characters cut in half, mustn't match anything
+static void crossCheckFoldedFilter() {
+    // Spellings of the same character sit next to each other, so a window
+    // of a few of them makes for plenty of matches
+    static const char *chars[] = { "a", "B", "b", "1", " ", "\xc3\xa9", "\xc3\x89", "\xc3\x9f",
+                                   "\xe1\xba\x9e", "\xcf\x83", "\xcf\x82", "\xce\xa3", "\xd0\xb6",
+                                   "\xd0\x96", "\xe2\x82\xac", "\xe2\x84\xa6", "\xcf\x89", "\xce\xa9",
+                                   "\xc2\xb5", "\xce\xbc", "\xf0\x9f\x98\x80", "-" };
+    static const char *stray[] = { "\xff", "\xc3", "\x83", "\xe2\x82", "<", "\n" };
+    int numChars = sizeof(chars) / sizeof(chars[0]);
+    static char text[1024];
+    char terms[12][MAX_TERM * 4];
+    int prefiltered = 0;
+    srand(47);
+    for (int round = 0; round < 300; round++) {
+        int window = 3 + rand() % 4;
+        int from = rand() % (numChars - window);
+        int count = 1 + rand() % 12;
+        char path[] = "/tmp/blacklistXXXXXX";
+        FILE *file = fdopen(mkstemp(path), "w");
+        for (int i = 0; i < count; i++) {
+            terms[i][0] = '\0';
+            int len = 1 + round % 2 + rand() % 4;
+            for (int j = 0; j < len; j++)
+                strcat(terms[i], chars[from + rand() % window]);
+            fprintf(file, "%s\n", terms[i]);
+        }
+        fclose(file);
+        ContentFilter *filter = cf_create(path);
+        remove(path);
+        bool prefilter = filter->prefilter;
+        prefiltered += prefilter;
+        ContentFilter *loaded = compiledCopy(filter, NULL);
+
+        for (int i = 0; i < 20; i++) {
+            int size = 0;
+            int want = rand() % (sizeof(text) - 8);
+            while (size < want) {
+                const char *piece = rand() % 10 == 0 ? stray[rand() % 6] : chars[from + rand() % window];
+                memcpy(text + size, piece, strlen(piece));
+                size += strlen(piece);
+            }
+            bool expected = false;
+            for (int at = 0; at < size && !expected; at++) {
+                for (int t = 0; t < count && !expected; t++)
+                    expected = foldedMatchAt(text + at, size - at, terms[t]);
+            }
+            if (cf_searchText(filter, text, size) != expected || searchInPieces(filter, text, size) != expected ||
+                cf_searchText(loaded, text, size) != expected) {
+                fprintf(stderr, "folded filter mismatch (round %d, text %d, prefilter %d)\n", round, i, prefilter);
+                exit(1);
+            }
+            filter->prefilter = false;
+            if (cf_searchText(filter, text, size) != expected) {
+                fprintf(stderr, "folded filter mismatch without the prefilter (round %d, text %d)\n", round, i);
+                exit(1);
+            }
+            filter->prefilter = prefilter;
+        }
+        cf_delete(loaded);
+        cf_delete(filter);
+    }
+    printf("  cross-checked 6000 random texts against folding every comparison, with UTF-8 terms"
+           " (%d of 300 lists prefiltered)\n", prefiltered);
+}
+
+static void benchFilterWith(const char *name, bool (*search)(void*, const char*, int),
+                            void *filter, const char *page, int size, bool expected) {
+    int rounds = 5;
+    double start = now();
+    for (int round = 0; round < rounds; round++) {
+        if (search(filter, page, size) != expected) {
+            fprintf(stderr, "%s: wrong verdict\n", name);
+            exit(1);
+        }
+    }
+    report(name, (double)size * rounds, now() - start);
+}
+
+static bool tableSearch(void *filter, const char *text, int size) {
+    return cf_searchText(filter, (char*)text, size);
+}
+
+// Fed the way a relay feeds it, a decoded window at a time
+static double streamSeconds(ContentFilter *filter, const char *text, int size, bool expected) {
+    double start = now();
+    FilterStream stream;
+    cf_streamInit(&stream, filter);
+    for (int fed = 0; fed < size && !stream.matched; fed += BD_WINDOW)
+        cf_streamFeed(&stream, text + fed, size - fed < BD_WINDOW ? size - fed : BD_WINDOW);
+    cf_streamTerm(&stream);
+    if (stream.matched != expected) {
+        fprintf(stderr, "streamed table: wrong verdict\n");
+        exit(1);
+    }
+    return now() - start;
+}
+
+// The table walking every byte, then skipping to pairs if the list allows
+static void benchTable(const char *page, ContentFilter *filter, const char *text, int size, bool expected) {
+    char name[64];
+    bool prefilter = filter->prefilter;
+    filter->prefilter = false;
+    snprintf(name, sizeof(name), "table, %s", page);
+    benchFilterWith(name, tableSearch, filter, text, size, expected);
+    filter->prefilter = prefilter;
+    if (!prefilter)
+        return;
+    snprintf(name, sizeof(name), "table + pairs, %s", page);
+    benchFilterWith(name, tableSearch, filter, text, size, expected);
+
+    // The pairs have to pay for themselves on every kind of page, so the
+    // two take turns, and the best of each is compared
+    double walk = 1e9, pairs = 1e9;
+    for (int round = 0; round < 9; round++) {
+        filter->prefilter = false;
+        double seconds = streamSeconds(filter, text, size, expected);
+        walk = seconds < walk ? seconds : walk;
+        filter->prefilter = true;
+        seconds = streamSeconds(filter, text, size, expected);
+        pairs = seconds < pairs ? seconds : pairs;
+    }
+    printf("  %-32s %8.2fx the walk, streamed in windows, best of 9\n", "  pairs", walk / pairs);
+}
+
+static void benchFilterList(int numTerms, char *page, int size) {
+    // Long enough terms that random words almost never hit one, so the
+    // clean pages really are scanned to the end
+    char *terms = malloc(numTerms * MAX_TERM);
+    double start = now();
+    ContentFilter *filter = randomBlacklist(numTerms, 8, 14, 26, terms);
+    double built = now() - start;
+    int numNodes;
+    TrieNode *root = pointerTrie(terms, numTerms, &numNodes);
+    printf("  %d terms: table %.1f MB (%d states x %d classes, built in %.3fs), pointer trie %.1f MB (%d nodes),"
+           " %d first pairs%s\n",
+           numTerms, cf_tableBytes(filter) / 1e6, filter->numStates, filter->numClasses, built,
+           (double)numNodes * sizeof(TrieNode) / 1e6, numNodes, filter->pairs.count,
+           filter->prefilter ? "" : " (too many to prefilter)");
+    double loadTime;
+    ContentFilter *loaded = compiledCopy(filter, &loadTime);
+    printf("  compiled, it maps in %.4fs\n", loadTime);
+
+    randomText(page, size, 26);
+    benchTable("clean page", filter, page, size, false);
+    benchFilterWith("mapped table, clean page", tableSearch, loaded, page, size, false);
+    benchFilterWith("pointer trie, clean page", (bool (*)(void*, const char*, int))pointerSearch, root, page, size, false);
+    benchFilterWith("restart walk, clean page", (bool (*)(void*, const char*, int))restartSearch, root, page, size, false);
+
+    // Real pages share a vocabulary with the list, so words often start
+    // like a term and only differ near the end. Those are the walks the
+    // restart search has to repeat
+    for (int pos = 0; pos < size - 2 * MAX_TERM;) {
+        const char *term = terms + (rand() % numTerms) * MAX_TERM;
+        int len = strlen(term) - 1;
+        memcpy(page + pos, term, len);
+        pos += len;
+        page[pos++] = rand() % 2 ? ' ' : '>';
+    }
+    benchTable("near misses", filter, page, size, false);
+    benchFilterWith("pointer trie, near misses", (bool (*)(void*, const char*, int))pointerSearch, root, page, size, false);
+    benchFilterWith("restart walk, near misses", (bool (*)(void*, const char*, int))restartSearch, root, page, size, false);
+
+    // A page that only has a term right at the end still gets read to
+    // the end, and then has to be caught
+    int termLen = strlen(terms);
+    page[size - termLen - 2] = ' ';
+    memcpy(page + size - termLen - 1, terms, termLen);
+    page[size - 1] = ' ';
+    benchTable("match at the end", filter, page, size, true);
+    benchFilterWith("pointer trie, match at the end", (bool (*)(void*, const char*, int))pointerSearch, root, page, size, true);
+
+    free(terms);
+    deleteTrie(root, numNodes);
+    cf_delete(loaded);
+    cf_delete(filter);
+}
+
+static void benchFilter() {
+    printf("content filter:\n");
+    crossCheckFilter();
+    crossCheckSparseFilter();
+    crossCheckFoldedFilter();
+
+    // Short lists like the one we ship, which the pair prefilter can skip
+    // through, a list the size we actually run with, and a big one that
+    // can't stay in cache whatever the layout
+    int size = 4 << 20;
+    char *page = malloc(size);
+    srand(37);
+    benchFilterList(2, page, size);
+    benchFilterList(20, page, size);
+    benchFilterList(1000, page, size);
+    benchFilterList(100000, page, size);
+    free(page);
+}
+
+/************ Body decoding ************/
+static void countDecoded(long *decoded, const char *data, int len) {
+    *decoded += len;
+    sink += data[len - 1];
+}
+
+// A page of paragraphs drawn from a few thousand words, which compresses
+// about as well as real HTML does
+static void htmlPage(char *page, int size) {
+    int numWords = 3000;
+    char (*words)[12] = malloc(numWords * sizeof(*words));
+    for (int i = 0; i < numWords; i++) {
+        int len = 2 + rand() % 9;
+        for (int j = 0; j < len; j++)
+            words[i][j] = 'a' + rand() % 26;
+        words[i][len] = '\0';
+    }
+
+    int pos = 0;
+    while (pos < size) {
+        char para[1024];
+        int len = sprintf(para, "<p class=\"text\">");
+        for (int i = 0; i < 40; i++)
+            len += sprintf(para + len, "%s ", words[rand() % numWords]);
+        len += sprintf(para + len, "</p>\n");
+        if (len > size - pos)
+            len = size - pos;
+        memcpy(page + pos, para, len);
+        pos += len;
+    }
+    free(words);
+}
+
+static int zlibCompress(char *out, int outSize, const char *page, int size, int windowBits) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef*)page;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = outSize;
+    deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    return outSize - zs.avail_out;
+}
+
+static void benchDecodeWith(const char *name, Encoding encoding, const char *coded, int codedSize, int size) {
+    // Fed the way it comes off the socket, a segment at a time
+    int rounds = 10;
+    int segment = 16384;
+    double start = now();
+    for (int round = 0; round < rounds; round++) {
+        long decoded = 0;
+        BodyDecoder decoder;
+        bd_init(&decoder, &encoding, 1, size + 1);
+        for (int fed = 0; fed < codedSize; fed += segment) {
+            int len = codedSize - fed < segment ? codedSize - fed : segment;
+            bd_feed(&decoder, coded + fed, len, (DecodeSink)countDecoded, &decoded);
+        }
+        bd_term(&decoder);
+        if (decoded != size || decoder.status == BD_ERROR) {
+            fprintf(stderr, "%s: decoded %ld of %d bytes\n", name, decoded, size);
+            exit(1);
+        }
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "%s (%.1fx)", name, (double)size / codedSize);
+    report(label, (double)size * rounds, now() - start);
+}
+
+static void benchDecode() {
+    printf("body decoding: 8MB of HTML, decoded bytes per second\n");
+    int size = 8 << 20;
+    char *page = malloc(size);
+    srand(40);
+    htmlPage(page, size);
+
+    int codedMax = size + size / 8 + 1024;
+    char *coded = malloc(codedMax);
+    int codedSize = zlibCompress(coded, codedMax, page, size, 16 + MAX_WBITS);
+    benchDecodeWith("gzip", GZIP, coded, codedSize, size);
+    codedSize = zlibCompress(coded, codedMax, page, size, MAX_WBITS);
+    benchDecodeWith("deflate, zlib wrapped", DEFLATE, coded, codedSize, size);
+    codedSize = zlibCompress(coded, codedMax, page, size, -MAX_WBITS);
+    benchDecodeWith("deflate, raw", DEFLATE, coded, codedSize, size);
+
+    // What servers use on the fly, and for files compressed ahead of time
+    int qualities[] = { 5, 11 };
+    for (int i = 0; i < 2; i++) {
+        size_t brSize = codedMax;
+        BrotliEncoderCompress(qualities[i], BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                              size, (const uint8_t*)page, &brSize, (uint8_t*)coded);
+        char name[32];
+        snprintf(name, sizeof(name), "brotli, quality %d", qualities[i]);
+        benchDecodeWith(name, BROTLI, coded, brSize, size);
+    }
+
+    free(coded);
+    free(page);
+}
+
+/************ Page scanning ************/
+// Feeds the page in pieces the size of a read, the way relays do
+static void benchPageWith(const char *name, const char *page, int size, HsKind kind) {
+    int rounds = 10;
+    int found = 0;
+    double start = now();
+    for (int round = 0; round < rounds; round++) {
+        HtmlScanner *scanner = malloc(sizeof(HtmlScanner));
+        hs_init(scanner, kind, "http://example.com/articles/page.html");
+        for (int fed = 0; fed < size; fed += 16384)
+            hs_feed(scanner, page + fed, size - fed < 16384 ? size - fed : 16384);
+        found = scanner->numUrls;
+        hs_term(scanner);
+        free(scanner);
+    }
+    sink += found;
+    char label[64];
+    snprintf(label, sizeof(label), "%s (%d urls)", name, found);
+    report(label, (double)size * rounds, now() - start);
+}
+
+static void benchPages() {
+    printf("page scanning: 8MB pages, fed 16KB at a time\n");
+    int size = 8 << 20;
+    char *page = malloc(size);
+    srand(50);
+    htmlPage(page, size);
+    benchPageWith("prose", page, size, HS_HTML);
+
+    // Markup heavy, with a link, image or script every few hundred bytes.
+    // The scanner stops once it has all the URLs it keeps, so these are a
+    // few used over and over, like icons, to keep it going to the end
+    const char *tags[] = {
+        "<li class=\"nav-item\"><a href=\"/section/news\" data-id=\"%d\">News</a></li>\n",
+        "<div class=\"card\" style=\"background-image: url('/img/card%d.png')\"></div>\n",
+        "<img src=\"../img/photo%d.jpg?w=640&amp;h=480\" alt=\"A photo\" loading=\"lazy\">\n",
+        "<link rel=\"stylesheet\" href=\"/css/site%d.css\"><script src=\"/js/app.js\"></script>\n",
+        "<!-- a comment, with <tags> in it --><span>text %d</span>\n",
+    };
+    for (int pos = 0, i = 0; pos < size; i++) {
+        char tag[256];
+        int len = snprintf(tag, sizeof(tag), tags[i % 5], i % 8);
+        if (len > size - pos)
+            len = size - pos;
+        memcpy(page + pos, tag, len);
+        pos += len;
+    }
+    benchPageWith("markup", page, size, HS_HTML);
+    benchPageWith("markup as css", page, size, HS_CSS);
+    free(page);
+}
+
+/************ Site blocklist ************/
+typedef struct {
+    char domain[64];
+    char path[16]; // empty for the whole domain
+} SiteRule;
+
+// Checks every rule in turn, the obvious way
+static bool linearBlocks(const SiteRule *rules, int count, const char *host, const char *path) {
+    int hostLength = strlen(host);
+    while (hostLength > 0 && host[hostLength - 1] == '.')
+        hostLength--;
+    for (int i = 0; i < count; i++) {
+        int len = strlen(rules[i].domain);
+        bool under = hostLength >= len && strncasecmp(host + hostLength - len, rules[i].domain, len) == 0 &&
+                     (hostLength == len || host[hostLength - len - 1] == '.');
+        if (!under)
+            continue;
+        if (rules[i].path[0] == '\0' || (path != NULL && strncmp(path, rules[i].path, strlen(rules[i].path)) == 0))
+            return true;
+    }
+    return false;
+}
+
+// 1 to maxLabels labels, either from a handful of short ones, so hosts
+// and rules share suffixes all the time, or random letters
+static void randomHost(char *out, int maxLabels, bool fromPool) {
+    static const char *pool[] = { "a", "b", "ads", "cdn", "example", "com", "net", "x" };
+    int labels = 1 + rand() % maxLabels;
+    int len = 0;
+    for (int i = 0; i < labels; i++) {
+        if (i > 0)
+            out[len++] = '.';
+        if (fromPool) {
+            len += sprintf(out + len, "%s", pool[rand() % 8]);
+        } else {
+            int labelLength = 3 + rand() % 8;
+            for (int j = 0; j < labelLength; j++)
+                out[len++] = 'a' + rand() % 26;
+        }
+    }
+    out[len] = '\0';
+}
+
+static SiteBlocklist *randomSites(SiteRule *rules, int count, bool fromPool) {
+    SiteBlocklist *list = sb_create("/dev/null");
+    for (int i = 0; i < count; i++) {
+        randomHost(rules[i].domain, 3, fromPool);
+        rules[i].path[0] = '\0';
+        if (rand() % 3 == 0)
+            sprintf(rules[i].path, "/p%d", rand() % 4);
+        char rule[128];
+        snprintf(rule, sizeof(rule), "%s%s%s\n", rand() % 4 == 0 ? "*." : "", rules[i].domain, rules[i].path);
+        sb_add(list, rule);
+    }
+    return list;
+}
+
+static void crossCheckSites() {
+    SiteRule rules[30];
+    int cases = 0;
+    srand(112);
+    for (int round = 0; round < 500; round++) {
+        int count = 1 + rand() % 30;
+        SiteBlocklist *list = randomSites(rules, count, true);
+        for (int i = 0; i < 200; i++) {
+            char host[128], path[16], url[256];
+            randomHost(host, 5, true);
+            if (rand() % 4 == 0)
+                host[0] = toupper(host[0]);
+            sprintf(path, "/%c%d/x", rand() % 2 ? 'p' : 'q', rand() % 4);
+            snprintf(url, sizeof(url), "http://%s%s%s", host, rand() % 2 ? ":8080" : "", path);
+
+            bool expected = linearBlocks(rules, count, host, path);
+            if (sb_blocks(list, host, path) != expected || sb_blocksUrl(list, url) != expected ||
+                sb_blocks(list, host, NULL) != linearBlocks(rules, count, host, NULL)) {
+                fprintf(stderr, "site blocklist mismatch for %s (round %d)\n", url, round);
+                exit(1);
+            }
+            cases++;
+        }
+        sb_delete(list);
+    }
+    printf("  cross-checked %d random hosts against checking every rule\n", cases);
+}
+
+static void benchSitesWith(const char *name, SiteBlocklist *list, SiteRule *rules, int count,
+                           char (*hosts)[128], int numHosts, int lookups) {
+    double start = now();
+    for (int i = 0; i < lookups; i++) {
+        const char *host = hosts[i % numHosts];
+        sink += list != NULL ? sb_blocks(list, host, "/") : linearBlocks(rules, count, host, "/");
+    }
+    double seconds = now() - start;
+    printf("  %-32s %8.1f ns/lookup\n", name, seconds / lookups * 1e9);
+}
+
+static void benchSites() {
+    printf("site blocklist:\n");
+    crossCheckSites();
+
+    // Hosts with a few labels, half of them under a listed domain
+    int numHosts = 4096;
+    char (*hosts)[128] = malloc(numHosts * sizeof(*hosts));
+    int sizes[] = { 1000, 100000 };
+    for (int s = 0; s < 2; s++) {
+        int count = sizes[s];
+        SiteRule *rules = malloc(count * sizeof(SiteRule));
+        SiteBlocklist *list = randomSites(rules, count, false);
+        for (int i = 0; i < numHosts; i++) {
+            char label[16];
+            randomHost(label, 1, false);
+            if (i % 2 == 0)
+                snprintf(hosts[i], sizeof(hosts[i]), "%s.%s", label, rules[rand() % count].domain);
+            else
+                randomHost(hosts[i], 4, false);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "%d domains, suffix index", count);
+        benchSitesWith(name, list, rules, count, hosts, numHosts, 2000000);
+        snprintf(name, sizeof(name), "%d domains, every rule", count);
+        benchSitesWith(name, NULL, rules, count, hosts, numHosts, 20000000 / count);
+        sb_delete(list);
+        free(rules);
+    }
+    free(hosts);
+}
+
+/******************************************/
+
+typedef struct {
+    const char *name;
+    void (*run)();
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+    { "headers", benchHeaders },
+    { "scan", benchScan },
+    { "chunked", benchChunked },
+    { "filter", benchFilter },
+    { "decode", benchDecode },
+    { "pages", benchPages },
+    { "sites", benchSites },
+};
+
+int main(int argc, char **argv) {
+    int numBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+    for (int i = 0; i < numBenchmarks; i++) {
+        bool selected = argc == 1;
+        for (int arg = 1; arg < argc; arg++) {
+            if (strcmp(argv[arg], benchmarks[i].name) == 0)
+                selected = true;
+        }
+        if (selected)
+            benchmarks[i].run();
+    }
+    return 0;
+}
@@ -0,0 +1,941 @@
+// Fuzz target for the code that parses what clients and servers send us.
+// Every input is checked against the sanitizers and against other ways of
+// getting the same answer:
+//   - hp_parse against a plain line-at-a-time reference parser
+//   - hp_parse in one go against hp_feed over many reads
+//   - hp_lookupName against comparing with every known name
+//   - every scanner implementation against the scalar one
+//   - the chunk decoder in one go against the same bytes in pieces
+//   - the body decoder against the input, compressed with every coding
+//     we can undo, then decoded in pieces and capped
+//   - the page scanner in one go against the same bytes in pieces, and
+//     the URLs it resolves against resolving them again
+//   - the site blocklist against checking every rule, with the input as
+//     the host and as a URL
+//   - the prefetch store against a plain array of what it should hold,
+//     with the input as a run of adds, lookups and removals
+//   - the check prefetched responses go through against the filter on
+//     the input, sent as a body that's compressed, chunked or cut short
+//   - parseHeader and the header rewrite for their own invariants
+//
+// make fuzz builds a standalone driver with ASan and UBSan. It runs every
+// file it's given (or every file in a directory given), and with -runs=N
+// it then mutates those for N more inputs:
+//   ./fuzz test/corpus -runs=200000
+// Anything that fails is written to fuzz-crash so it can be run again on
+// its own. AFL can drive the same binary with a file argument, and
+// make fuzz-libfuzzer builds it for libFuzzer with clang instead.
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <brotli/encode.h>
+
+#include "bodyDecoder.h"
+#include "chunkDecoder.h"
+#include "contentFilter.h"
+#include "dynamicArray.h"
+#include "headerRewrite.h"
+#include "httpData.h"
+#include "httpParser.h"
+#include "htmlScanner.h"
+#include "prefetcher.h"
+#include "prefetchStore.h"
+#include "scan.h"
+#include "siteBlocklist.h"
+
+static const uint8_t *currentInput;
+static size_t currentSize;
+
+static void saveInput() {
+    FILE *file = fopen("fuzz-crash", "wb");
+    if (file == NULL)
+        return;
+    fwrite(currentInput, 1, currentSize, file);
+    fclose(file);
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "fuzz: %s (input saved to fuzz-crash)\n", what);
+    saveInput();
+    abort();
+}
+
+#define CHECK(cond) do { if (!(cond)) fail(#cond); } while (0)
+
+// Cheap deterministic randomness from the input, so a saved crash does the
+// same splits when it's run again
+static uint32_t seedFrom(const uint8_t *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size && i < 64; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+static uint32_t nextRand(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/************ Reference header parser ************/
+// The obvious way to do what hp_parse does: find each line with memchr and
+// split it with more memchrs. Slow, but easy to check by eye against the
+// rules in httpParser.c
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static bool sliceSame(HttpSlice a, HttpSlice b) {
+    return a.offset == b.offset && a.length == b.length;
+}
+
+static HttpSlice trimmed(const char *buf, int start, int end) {
+    while (start < end && isBlank(buf[start]))
+        start++;
+    while (end > start && isBlank(buf[end - 1]))
+        end--;
+    return (HttpSlice){ start, end - start };
+}
+
+static bool referenceStartLine(HttpMessage *msg, const char *buf, int start, int end) {
+    const char *line = buf + start;
+    int length = end - start;
+    const char *firstSp = memchr(line, ' ', length);
+    if (firstSp == NULL)
+        return false;
+    int first = firstSp - line;
+    const char *secondSp = memchr(firstSp + 1, ' ', length - first - 1);
+    int second = secondSp == NULL ? length : secondSp - line;
+
+    msg->startLine = (HttpSlice){ start, length };
+    msg->isResponse = length >= 5 && strncmp(line, "HTTP/", 5) == 0;
+    if (msg->isResponse) {
+        msg->version = (HttpSlice){ start, first };
+        msg->status = (HttpSlice){ start + first + 1, second - first - 1 };
+        return msg->status.length == 3;
+    }
+    if (secondSp == NULL)
+        return false;
+    msg->method = (HttpSlice){ start, first };
+    msg->target = (HttpSlice){ start + first + 1, second - first - 1 };
+    msg->version = (HttpSlice){ start + second + 1, length - second - 1 };
+    return first > 0 && msg->target.length > 0 && msg->version.length >= 5 &&
+           strncmp(line + second + 1, "HTTP/", 5) == 0;
+}
+
+// Same return values as hp_parse
+static int referenceParse(HttpMessage *msg, const char *buf, int size) {
+    int limit = size < HP_MAX_HEADER ? size : HP_MAX_HEADER;
+    bool sawStartLine = false;
+    int pos = 0;
+    msg->numFields = 0;
+
+    for (;;) {
+        const char *newline = memchr(buf + pos, '\n', limit - pos);
+        if (newline == NULL)
+            return size >= HP_MAX_HEADER || limit - pos > HP_MAX_LINE ? -1 : 0;
+        int lineEnd = newline - buf;
+        if (lineEnd - pos > HP_MAX_LINE)
+            return -1;
+        int contentEnd = lineEnd > pos && buf[lineEnd - 1] == '\r' ? lineEnd - 1 : lineEnd;
+
+        if (!sawStartLine) {
+            if (contentEnd != pos) {
+                if (!referenceStartLine(msg, buf, pos, contentEnd))
+                    return -1;
+                sawStartLine = true;
+            }
+        } else if (contentEnd == pos) {
+            msg->headerLength = lineEnd + 1;
+            return msg->headerLength;
+        } else {
+            const char *colon = memchr(buf + pos, ':', lineEnd - pos);
+            if (isBlank(buf[pos]) || colon == NULL || colon == buf + pos || isBlank(colon[-1]))
+                return -1;
+            if (msg->numFields == HP_MAX_FIELDS)
+                return -1;
+
+            HttpField *field = &msg->fields[msg->numFields++];
+            field->name = (HttpSlice){ pos, colon - buf - pos };
+            field->value = trimmed(buf, colon - buf + 1, contentEnd);
+            field->line = (HttpSlice){ pos, lineEnd + 1 - pos };
+        }
+        pos = lineEnd + 1;
+    }
+}
+
+// The slow way to name a header: compare against every one we know
+static HeaderName referenceLookup(const char *name, int length) {
+    for (HeaderName id = HDR_OTHER + 1; id < HDR_COUNT; id++) {
+        const char *known = hp_headerName(id);
+        if ((int)strlen(known) == length && strncasecmp(known, name, length) == 0)
+            return id;
+    }
+    return HDR_OTHER;
+}
+
+static void checkSameMessage(const HttpMessage *a, const HttpMessage *b) {
+    CHECK(a->isResponse == b->isResponse);
+    CHECK(sliceSame(a->startLine, b->startLine));
+    CHECK(sliceSame(a->version, b->version));
+    if (a->isResponse) {
+        CHECK(sliceSame(a->status, b->status));
+    } else {
+        CHECK(sliceSame(a->method, b->method));
+        CHECK(sliceSame(a->target, b->target));
+    }
+    CHECK(a->numFields == b->numFields);
+    for (int i = 0; i < a->numFields; i++) {
+        CHECK(sliceSame(a->fields[i].name, b->fields[i].name));
+        CHECK(sliceSame(a->fields[i].value, b->fields[i].value));
+        CHECK(sliceSame(a->fields[i].line, b->fields[i].line));
+    }
+}
+
+/************ Checks ************/
+
+static int checkParser(const char *buf, int size, uint32_t *rng) {
+    HttpMessage msg, expected;
+    int result = hp_parse(&msg, buf, size);
+    int expectedResult = referenceParse(&expected, buf, size);
+    CHECK(result == expectedResult);
+    if (result > 0) {
+        checkSameMessage(&msg, &expected);
+        for (int i = 0; i < msg.numFields; i++) {
+            HttpSlice name = msg.fields[i].name;
+            CHECK(msg.fields[i].id == referenceLookup(buf + name.offset, name.length));
+        }
+    }
+
+    // The same bytes showing up a few at a time, and one at a time. The
+    // parser can only be told the buffer grew, so that's how they're fed
+    for (int pass = 0; pass < 2; pass++) {
+        HttpParser parser;
+        hp_init(&parser);
+        HpStatus status = HP_NEED_MORE;
+        int fed = 0;
+        while (fed < size && status == HP_NEED_MORE) {
+            fed += pass == 0 ? 1 : 1 + nextRand(rng) % 64;
+            if (fed > size)
+                fed = size;
+            status = hp_feed(&parser, buf, fed);
+        }
+        if (size == 0)
+            status = hp_feed(&parser, buf, 0);
+
+        // It can finish early if the header ends before the input does,
+        // but it has to finish in the same place
+        CHECK(status == (result > 0 ? HP_COMPLETE : result == 0 ? HP_NEED_MORE : HP_ERROR));
+        if (status == HP_COMPLETE) {
+            CHECK(parser.msg.headerLength == result);
+            checkSameMessage(&parser.msg, &msg);
+        }
+    }
+    return result;
+}
+
+static void checkParseHeader(const char *buf, int size, int headerLength) {
+    // parseHeader gets its own exact size copy, so reading past the end of
+    // what it was given shows up under ASan
+    DynamicArray copy;
+    copy.buff = malloc(size > 0 ? size : 1);
+    memcpy(copy.buff, buf, size);
+    copy.size = copy.maxSize = size;
+
+    Header header;
+    HttpParser parser;
+    hp_init(&parser);
+    HpStatus status = parseHeader(&header, &parser, &copy);
+    if (headerLength <= 0)
+        CHECK(status == (headerLength == 0 ? HP_NEED_MORE : HP_ERROR));
+
+    if (status == HP_COMPLETE) {
+        CHECK(header.headerLength == headerLength);
+        CHECK(memchr(header.url, '\0', sizeof(header.url)) != NULL);
+        CHECK(memchr(header.domain, '\0', sizeof(header.domain)) != NULL);
+        CHECK(memchr(header.port, '\0', sizeof(header.port)) != NULL);
+        if (header.domain[0] != '\0')
+            CHECK(header.port[0] != '\0');
+        CHECK(header.framing != BODY_CHUNKED || header.chunkedEncoding);
+        CHECK(header.framing != BODY_LENGTH || header.contentLength >= 0);
+        if (!parser.msg.isResponse) {
+            CHECK(header.framing != BODY_UNTIL_CLOSE);
+            CHECK(header.domain[0] != '\0');
+        }
+        for (HeaderName id = HDR_OTHER + 1; id < HDR_COUNT; id++) {
+            HttpField *field = getField(&header, id);
+            CHECK(field == NULL || field->id == id);
+        }
+    }
+    free(copy.buff);
+}
+
+static void checkRewrite(const char *buf, int headerLength) {
+    HttpMessage msg;
+    CHECK(hp_parse(&msg, buf, headerLength) == headerLength);
+
+    HeaderRewrite rw;
+    hr_init(&rw, buf, headerLength);
+    hr_stripHopByHop(&rw, &msg);
+    CHECK(hr_addField(&rw, "Via", "1.1 fuzz")); // however much was stripped
+
+    int length = hr_length(&rw);
+    char *out = malloc(length);
+    hr_copy(&rw, out);
+
+    // What comes out is still a header, with everything hop-by-hop gone
+    // and what was added at the end
+    HttpMessage edited;
+    CHECK(hp_parse(&edited, out, length) == length);
+    CHECK(edited.numFields >= 1);
+    HttpField *last = &edited.fields[edited.numFields - 1];
+    CHECK(last->id == HDR_VIA && last->value.length == 8 && memcmp(out + last->value.offset, "1.1 fuzz", 8) == 0);
+    for (int i = 0; i < edited.numFields; i++) {
+        HeaderName id = edited.fields[i].id;
+        CHECK(id != HDR_CONNECTION && id != HDR_KEEP_ALIVE && id != HDR_PROXY_CONNECTION &&
+              id != HDR_TE && id != HDR_UPGRADE);
+    }
+
+    // Framing and Host stay, whatever Connection names
+    HeaderName essential[] = { HDR_CONTENT_LENGTH, HDR_TRANSFER_ENCODING, HDR_HOST };
+    for (int e = 0; e < 3; e++) {
+        int before = 0, after = 0;
+        for (int i = 0; i < msg.numFields; i++)
+            before += msg.fields[i].id == essential[e];
+        for (int i = 0; i < edited.numFields; i++)
+            after += edited.fields[i].id == essential[e];
+        CHECK(before == after);
+    }
+    free(out);
+}
+
+static void checkScan(const char *buf, int size) {
+    if (size < 2)
+        return;
+
+    // The first few bytes pick the delimiters
+    char bytes[SCAN_MAX_SET + 1];
+    int count = 1 + (unsigned char)buf[0] % 8;
+    if (count > size - 1)
+        count = size - 1;
+    for (int i = 0; i < count; i++)
+        bytes[i] = buf[1 + i] != '\0' ? buf[1 + i] : '\n';
+    bytes[count] = '\0';
+    ByteSet set;
+    scan_initSet(&set, bytes);
+
+    // And the same bytes pick a few pairs
+    PairSet pairs;
+    scan_initPairs(&pairs);
+    for (int i = 1; i + 1 <= count; i += 2)
+        scan_addPair(&pairs, buf[i], buf[i + 1]);
+
+    for (ScanImpl impl = SCAN_SCALAR + 1; impl <= scan_bestImpl(); impl++) {
+        for (int offset = 0; offset < 3 && offset < size; offset++) {
+            CHECK(scan_findAnyWith(impl, buf + offset, size - offset, &set) ==
+                  scan_findAnyWith(SCAN_SCALAR, buf + offset, size - offset, &set));
+            CHECK(scan_findPairWith(impl, buf + offset, size - offset, &pairs) ==
+                  scan_findPairWith(SCAN_SCALAR, buf + offset, size - offset, &pairs));
+
+            ScanCursor cursor, scalar;
+            scan_cursorInitWith(impl, &cursor, buf + offset, size - offset, &set);
+            scan_cursorInitWith(SCAN_SCALAR, &scalar, buf + offset, size - offset, &set);
+            const char *hit;
+            do {
+                hit = scan_next(&scalar);
+                CHECK(scan_next(&cursor) == hit);
+            } while (hit != NULL);
+        }
+    }
+}
+
+typedef struct {
+    char *out;
+    int size;
+} Decoded;
+
+static void collect(void *ctx, const char *data, int len) {
+    Decoded *decoded = ctx;
+    CHECK(len > 0);
+    memcpy(decoded->out + decoded->size, data, len);
+    decoded->size += len;
+}
+
+static void checkChunked(const char *buf, int size, uint32_t *rng) {
+    // Decoded data is never bigger than what it was decoded from
+    Decoded whole = { malloc(size + 1), 0 };
+    ChunkDecoder decoder;
+    cd_init(&decoder);
+    int consumed = cd_feed(&decoder, buf, size, collect, &whole);
+    bool done = cd_done(&decoder);
+    CHECK(consumed == -1 || consumed == size || done);
+
+    Decoded pieces = { malloc(size + 1), 0 };
+    cd_init(&decoder);
+    int total = 0, result = 0;
+    while (total < size && !cd_done(&decoder)) {
+        int step = 1 + nextRand(rng) % 16;
+        if (step > size - total)
+            step = size - total;
+        result = cd_feed(&decoder, buf + total, step, collect, &pieces);
+        if (result == -1)
+            break;
+        CHECK(result == step || cd_done(&decoder));
+        total += result;
+    }
+
+    CHECK((result == -1) == (consumed == -1));
+    if (consumed != -1) {
+        CHECK(total == consumed);
+        CHECK(cd_done(&decoder) == done);
+        CHECK(pieces.size == whole.size && memcmp(pieces.out, whole.out, whole.size) == 0);
+        CHECK(decoder.bodySize == whole.size);
+    }
+    free(whole.out);
+    free(pieces.out);
+}
+
+// windowBits picks the wrapper: 16 more for gzip, negative for none
+static int zlibCompress(char **out, const char *buf, int size, int windowBits) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    CHECK(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    int bound = deflateBound(&zs, size);
+    *out = malloc(bound);
+    zs.next_in = (Bytef*)buf;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)*out;
+    zs.avail_out = bound;
+    CHECK(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+    deflateEnd(&zs);
+    return bound - zs.avail_out;
+}
+
+static void checkDecoder(const char *buf, int size, uint32_t *rng) {
+    // Compress the input, then decode it a few bytes at a time with a
+    // random cap. What comes out has to be the input, cut off at the cap
+    Encoding encoding;
+    char *coded;
+    int codedSize;
+    switch (nextRand(rng) % 4) {
+        case 0:
+            encoding = GZIP;
+            codedSize = zlibCompress(&coded, buf, size, 16 + MAX_WBITS);
+            break;
+        case 1:
+            encoding = DEFLATE;
+            codedSize = zlibCompress(&coded, buf, size, MAX_WBITS);
+            break;
+        case 2:
+            encoding = DEFLATE;
+            codedSize = zlibCompress(&coded, buf, size, -MAX_WBITS);
+            break;
+        default: {
+            encoding = BROTLI;
+            size_t brSize = BrotliEncoderMaxCompressedSize(size);
+            coded = malloc(brSize);
+            CHECK(BrotliEncoderCompress(1 + nextRand(rng) % 9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                        size, (const uint8_t*)buf, &brSize, (uint8_t*)coded));
+            codedSize = brSize;
+            break;
+        }
+    }
+
+    // Sometimes gzipped again on top, as "Content-Encoding: br, gzip" says
+    Encoding encodings[2] = { encoding, GZIP };
+    int numEncodings = 1;
+    if (nextRand(rng) % 2 == 0) {
+        char *twice;
+        int twiceSize = zlibCompress(&twice, coded, codedSize, 16 + MAX_WBITS);
+        free(coded);
+        coded = twice;
+        codedSize = twiceSize;
+        numEncodings = 2;
+    }
+
+    long limit = 1 + nextRand(rng) % (size + 2);
+    Decoded out = { malloc(size + 1), 0 };
+    BodyDecoder decoder;
+    bd_init(&decoder, encodings, numEncodings, limit);
+    BdStatus status = BD_MORE;
+    for (int fed = 0; fed < codedSize && status == BD_MORE; ) {
+        int step = 1 + nextRand(rng) % 512;
+        if (step > codedSize - fed)
+            step = codedSize - fed;
+        status = bd_feed(&decoder, coded + fed, step, collect, &out);
+        fed += step;
+    }
+    bd_term(&decoder);
+
+    long expected = limit < size ? limit : size;
+    CHECK(status == (limit <= size ? BD_LIMIT : BD_DONE));
+    CHECK(out.size == expected && decoder.produced == expected);
+    CHECK(memcmp(out.out, buf, expected) == 0);
+
+    // The raw input as if it were coded, for the error paths
+    bd_init(&decoder, encodings, numEncodings, size + 1);
+    out.size = 0;
+    bd_feed(&decoder, buf, size, collect, &out);
+    bd_term(&decoder);
+
+    free(coded);
+    free(out.out);
+}
+
+static void checkHtmlScanner(const char *buf, int size, uint32_t *rng, HsKind kind) {
+    const char *page = "http://example.com/dir/page.html?q";
+    HtmlScanner *whole = malloc(sizeof(HtmlScanner));
+    HtmlScanner *pieces = malloc(sizeof(HtmlScanner));
+    hs_init(whole, kind, page);
+    hs_feed(whole, buf, size);
+    hs_init(pieces, kind, page);
+    for (int fed = 0; fed < size; ) {
+        int step = 1 + nextRand(rng) % 32;
+        if (step > size - fed)
+            step = size - fed;
+        hs_feed(pieces, buf + fed, step);
+        fed += step;
+    }
+
+    // The tokenizer keeps its place anywhere, so the same URLs either way.
+    // Each is one a browser would send, so resolving it again, against
+    // anything, leaves it as it is
+    const char *a = NULL, *b = NULL;
+    int found = 0;
+    char again[HS_MAX_URL];
+    while ((a = hs_nextUrl(whole, a)) != NULL) {
+        b = hs_nextUrl(pieces, b);
+        CHECK(b != NULL && strcmp(a, b) == 0);
+        CHECK(strncmp(a, "http://", 7) == 0 && strpbrk(a, " \t\r\n#") == NULL);
+        int length = strlen(a);
+        CHECK(hs_resolve(page, a, length, again, sizeof(again)) == length && strcmp(again, a) == 0);
+        found++;
+    }
+    CHECK(hs_nextUrl(pieces, b) == NULL);
+    CHECK(found == whole->numUrls && found <= HS_MAX_URLS);
+    hs_term(whole);
+    hs_term(pieces);
+    free(whole);
+    free(pieces);
+
+    // The input as a link on its own
+    char url[HS_MAX_URL];
+    int length = hs_resolve(page, buf, size, url, sizeof(url));
+    if (length != -1) {
+        CHECK(length == (int)strlen(url) && strncmp(url, "http://", 7) == 0);
+        CHECK(hs_resolve(url, url, length, again, sizeof(again)) == length && strcmp(again, url) == 0);
+    }
+}
+
+static const char *siteRules[][2] = {
+    { "example.com", "" }, { "ads.example.net", "/banners/" }, { "cdn.x", "" },
+    { "a", "/p" }, { "b.a", "" },
+};
+
+static bool referenceBlocks(const char *host, const char *path) {
+    int hostLength = strlen(host);
+    while (hostLength > 0 && host[hostLength - 1] == '.')
+        hostLength--;
+    for (int i = 0; i < 5; i++) {
+        const char *domain = siteRules[i][0], *prefix = siteRules[i][1];
+        int len = strlen(domain);
+        if (hostLength < len || strncasecmp(host + hostLength - len, domain, len) != 0)
+            continue;
+        if (hostLength > len && host[hostLength - len - 1] != '.')
+            continue;
+        if (prefix[0] == '\0' || (path != NULL && strncmp(path, prefix, strlen(prefix)) == 0))
+            return true;
+    }
+    return false;
+}
+
+static void checkSites(const char *buf, int size) {
+    static SiteBlocklist *list = NULL;
+    if (list == NULL) {
+        list = sb_create("/dev/null");
+        for (int i = 0; i < 5; i++) {
+            char rule[64];
+            snprintf(rule, sizeof(rule), "%s%s%s  # rule %d\n", i % 2 ? "*." : "", siteRules[i][0], siteRules[i][1], i);
+            sb_add(list, rule);
+        }
+    }
+
+    // Up to the first NUL, as the proxy would see it
+    char *host = malloc(size + 1);
+    memcpy(host, buf, size);
+    host[size] = '\0';
+    CHECK(sb_blocks(list, host, NULL) == referenceBlocks(host, NULL));
+    CHECK(sb_blocks(list, host, "/banners/1") == referenceBlocks(host, "/banners/1"));
+    CHECK(sb_blocks(list, host, "/p") == referenceBlocks(host, "/p"));
+    sb_blocksUrl(list, host);
+    free(host);
+
+    // And as a URL, with only the characters a host can't have ending it
+    char *url = malloc(size + 8);
+    memcpy(url, "http://", 7);
+    memcpy(url + 7, buf, size);
+    url[size + 7] = '\0';
+    int hostLength = strcspn(url + 7, "/?#@:[");
+    if (url[7 + hostLength] == '\0' || url[7 + hostLength] == '/') {
+        char *path = url[7 + hostLength] == '/' ? url + 7 + hostLength : "/";
+        char *justHost = strndup(url + 7, hostLength);
+        CHECK(sb_blocksUrl(list, url) == (hostLength < 256 && referenceBlocks(justHost, path)));
+        free(justHost);
+    } else {
+        sb_blocksUrl(list, url);
+    }
+    free(url);
+}
+
+// The input as a prefetched stylesheet, with a blacklisted term dropped
+// in half the time. Coded, it's only let through if it decodes to the end
+static void checkPrefetchFilter(const char *buf, int size, uint32_t *rng) {
+    static ContentFilter *filter = NULL;
+    if (filter == NULL) {
+        char path[] = "/tmp/fuzzBlacklistXXXXXX";
+        int fd = mkstemp(path);
+        CHECK(fd != -1 && write(fd, "fuzzblock\n", 10) == 10);
+        close(fd);
+        filter = cf_create(path);
+        remove(path);
+    }
+
+    char *plain = malloc(size + 9);
+    int plainSize = size;
+    memcpy(plain, buf, size);
+    if (nextRand(rng) % 2 == 0) {
+        int at = nextRand(rng) % (size + 1);
+        memmove(plain + at + 9, plain + at, size - at);
+        memcpy(plain + at, "FuzzBlock", 9);
+        plainSize += 9;
+    }
+    bool expected = !cf_searchText(filter, plain, plainSize);
+
+    char *body = plain;
+    int bodySize = plainSize;
+    const char *coding = NULL;
+    int choice = nextRand(rng) % 3;
+    if (choice > 0) {
+        coding = choice == 1 ? "gzip" : "deflate";
+        bodySize = zlibCompress(&body, plain, plainSize, choice == 1 ? 16 + MAX_WBITS : MAX_WBITS);
+        if (nextRand(rng) % 4 == 0) {
+            bodySize -= 1 + nextRand(rng) % bodySize; // the stream never ends
+            expected = false;
+        }
+    }
+
+    bool chunked = nextRand(rng) % 2 == 0;
+    char line[128];
+    DynamicArray message;
+    da_init(&message, 256 + 2 * bodySize);
+    da_append(&message, line, sprintf(line, "HTTP/1.1 200 OK\r\nContent-Type: text/css\r\n%s%s%s",
+                                      coding != NULL ? "Content-Encoding: " : "",
+                                      coding != NULL ? coding : "", coding != NULL ? "\r\n" : ""));
+    if (chunked) {
+        da_append(&message, line, sprintf(line, "Transfer-Encoding: chunked\r\n\r\n"));
+        for (int sent = 0; sent < bodySize; ) {
+            int step = 1 + nextRand(rng) % 300;
+            if (step > bodySize - sent)
+                step = bodySize - sent;
+            da_append(&message, line, sprintf(line, "%x\r\n", step));
+            da_append(&message, body + sent, step);
+            da_append(&message, line, sprintf(line, "\r\n"));
+            sent += step;
+        }
+        da_append(&message, line, sprintf(line, "0\r\n\r\n"));
+    } else {
+        da_append(&message, line, sprintf(line, "Content-Length: %d\r\n\r\n", bodySize));
+        da_append(&message, body, bodySize);
+    }
+
+    Header header;
+    HttpParser parser;
+    hp_init(&parser);
+    DynamicArray copy = message;
+    CHECK(parseHeader(&header, &parser, &copy) == HP_COMPLETE);
+    CHECK(pf_bodyPasses(&header, message.buff, message.size, filter) == expected);
+
+    da_term(&message);
+    if (body != plain)
+        free(body);
+    free(plain);
+}
+
+// Every three bytes are an operation, a URL out of STORE_URLS, and a
+// length. The model evicts the least recently used by looking at all of
+// them, and nothing is around long enough to expire
+#define STORE_URLS 128
+static void storeUrl(char *url, int which) {
+    sprintf(url, "http://host/%d", which);
+}
+
+// What the store counts an entry as
+static long storeBytes(int which, int length) {
+    char url[32];
+    storeUrl(url, which);
+    return sizeof(PsEntry) + strlen(url) + 1 + length;
+}
+
+static void checkPrefetchStore(const char *buf, int size) {
+    PrefetchStore store;
+    ps_init(&store, 48 * 1024);
+    bool present[STORE_URLS] = { false };
+    int lengths[STORE_URLS];
+    long lastUse[STORE_URLS];
+    long tick = 0, bytes = 0;
+    int count = 0;
+    char content[255 * 16];
+
+    for (int at = 0; at + 3 <= size; at += 3) {
+        int op = (unsigned char)buf[at] % 4, which = (unsigned char)buf[at + 1] % STORE_URLS;
+        int arg = (unsigned char)buf[at + 2];
+        int length = arg < 128 ? arg : arg * 16;
+        char url[32];
+        storeUrl(url, which);
+
+        if (op <= 1) {
+            for (int i = 0; i < length; i++)
+                content[i] = which + i;
+            ps_add(&store, url, content, length);
+            if (present[which]) {
+                present[which] = false;
+                bytes -= storeBytes(which, lengths[which]);
+                count--;
+            }
+            if (storeBytes(which, length) > store.maxBytes)
+                continue;
+            while (bytes + storeBytes(which, length) > store.maxBytes) {
+                int oldest = -1;
+                for (int i = 0; i < STORE_URLS; i++) {
+                    if (present[i] && (oldest == -1 || lastUse[i] < lastUse[oldest]))
+                        oldest = i;
+                }
+                present[oldest] = false;
+                bytes -= storeBytes(oldest, lengths[oldest]);
+                count--;
+            }
+            present[which] = true;
+            lengths[which] = length;
+            lastUse[which] = tick++;
+            bytes += storeBytes(which, length);
+            count++;
+        } else if (op == 2) {
+            PsEntry *entry = ps_find(&store, url);
+            CHECK((entry != NULL) == present[which]);
+            if (entry != NULL) {
+                CHECK(entry->contentLen == lengths[which]);
+                for (int i = 0; i < entry->contentLen; i++)
+                    CHECK(entry->content[i] == (char)(which + i));
+                lastUse[which] = tick++;
+            }
+        } else {
+            ps_remove(&store, url);
+            if (present[which]) {
+                present[which] = false;
+                bytes -= storeBytes(which, lengths[which]);
+                count--;
+            }
+        }
+        CHECK(store.bytes == bytes && store.count == count && store.bytes <= store.maxBytes);
+    }
+    ps_term(&store);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size > 2 * HP_MAX_HEADER)
+        return 0;
+    currentInput = data;
+    currentSize = size;
+
+    // An exact size copy, so reads past the end are caught
+    char *buf = malloc(size > 0 ? size : 1);
+    memcpy(buf, data, size);
+    uint32_t rng = seedFrom(data, size) | 1;
+
+    int headerLength = checkParser(buf, size, &rng);
+    checkParseHeader(buf, size, headerLength);
+    if (headerLength > 0) {
+        checkRewrite(buf, headerLength);
+        checkChunked(buf + headerLength, size - headerLength, &rng);
+    } else {
+        checkChunked(buf, size, &rng);
+    }
+    checkScan(buf, size);
+    checkDecoder(buf, size, &rng);
+    checkHtmlScanner(buf, size, &rng, HS_HTML);
+    checkHtmlScanner(buf, size, &rng, HS_CSS);
+    checkSites(buf, size);
+    checkPrefetchStore(buf, size);
+    checkPrefetchFilter(buf, size, &rng);
+
+    free(buf);
+    return 0;
+}
+
+/************ Standalone driver ************/
+#ifndef FUZZ_LIBFUZZER
+
+#include <sanitizer/common_interface_defs.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} Input;
+
+static Input *corpus;
+static int corpusSize, corpusCap;
+
+static void addInput(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "fuzz: can't open %s\n", path);
+        return;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    size = fread(data, 1, size, file);
+    fclose(file);
+
+    if (corpusSize == corpusCap) {
+        corpusCap = corpusCap == 0 ? 64 : corpusCap * 2;
+        corpus = realloc(corpus, corpusCap * sizeof(Input));
+    }
+    corpus[corpusSize++] = (Input){ data, size };
+}
+
+static void addPath(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            addPath(child);
+        }
+        closedir(dir);
+    } else {
+        addInput(path);
+    }
+}
+
+// Pieces of HTTP that random byte flips would take forever to come up with
+static const char *dictionary[] = {
+    "\r\n", "\n", "\r\n\r\n", ": ", ":", " ", "\t", ",", ";", "0\r\n\r\n",
+    "HTTP/1.1", "HTTP/1.0", "GET ", "CONNECT ", "http://", "[::1]", ":8080",
+    "Host", "Content-Length", "Transfer-Encoding", "chunked", "gzip", "close",
+    "keep-alive", "Connection", "Keep-Alive", "Age", "TE", "Upgrade",
+    "ffffffffffffffff", "7fffffff", "-1", "00000000000000001",
+    "<!DOCTYPE html>", "<img src=\"http://a/b.png\">", "<IMG ", "src=\"", "\"", ">",
+    "<img srcset=", "<link rel=stylesheet href=", "<script src=", "</script>", "<style>",
+    "</style>", "<base href=", "url(", "@import '", "<!--", "-->", "../", "./", "//", "&amp;",
+};
+
+static size_t mutate(uint8_t *out, size_t cap, uint32_t *rng) {
+    Input *base = &corpus[nextRand(rng) % corpusSize];
+    size_t size = base->size < cap ? base->size : cap;
+    memcpy(out, base->data, size);
+
+    int edits = 1 + nextRand(rng) % 4;
+    for (int i = 0; i < edits; i++) {
+        size_t pos = size == 0 ? 0 : nextRand(rng) % (size + 1);
+        switch (nextRand(rng) % 5) {
+            case 0: // flip a byte
+                if (pos < size)
+                    out[pos] = nextRand(rng);
+                break;
+            case 1: { // drop a run
+                size_t len = 1 + nextRand(rng) % 16;
+                if (pos + len > size)
+                    len = size - pos;
+                memmove(out + pos, out + pos + len, size - pos - len);
+                size -= len;
+                break;
+            }
+            case 2: { // insert a dictionary word
+                const char *word = dictionary[nextRand(rng) % (sizeof(dictionary) / sizeof(dictionary[0]))];
+                size_t len = strlen(word);
+                if (size + len > cap)
+                    break;
+                memmove(out + pos + len, out + pos, size - pos);
+                memcpy(out + pos, word, len);
+                size += len;
+                break;
+            }
+            case 3: { // repeat a run
+                size_t len = 1 + nextRand(rng) % 64;
+                if (pos + len > size || size + len > cap)
+                    break;
+                memmove(out + pos + len, out + pos, size - pos);
+                size += len;
+                break;
+            }
+            case 4: { // splice in part of another input
+                Input *other = &corpus[nextRand(rng) % corpusSize];
+                if (other->size == 0)
+                    break;
+                size_t from = nextRand(rng) % other->size;
+                size_t len = other->size - from;
+                if (pos + len > cap)
+                    len = cap - pos;
+                memcpy(out + pos, other->data + from, len);
+                if (pos + len > size)
+                    size = pos + len;
+                break;
+            }
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    long runs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-runs=", 6) == 0)
+            runs = atol(argv[i] + 6);
+        else
+            addPath(argv[i]);
+    }
+    if (corpusSize == 0) {
+        fprintf(stderr, "Usage: %s <file or dir>... [-runs=N]\n", argv[0]);
+        return 1;
+    }
+
+    // Sanitizer reports end the process, so leave the input behind first
+    __sanitizer_set_death_callback(saveInput);
+
+    for (int i = 0; i < corpusSize; i++)
+        LLVMFuzzerTestOneInput(corpus[i].data, corpus[i].size);
+    printf("%d corpus inputs ok\n", corpusSize);
+
+    size_t cap = 4 * HP_MAX_LINE;
+    uint8_t *input = malloc(cap);
+    uint32_t rng = 0x9e3779b9;
+    for (long run = 0; run < runs; run++) {
+        size_t size = mutate(input, cap, &rng);
+        LLVMFuzzerTestOneInput(input, size);
+        if ((run + 1) % 100000 == 0)
+            printf("%ld runs\n", run + 1);
+    }
+    if (runs > 0)
+        printf("%ld mutated inputs ok\n", runs);
+    free(input);
+    return 0;
+}
+
+#endif
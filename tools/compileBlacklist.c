@@ -0,0 +1,52 @@
+// Builds the blacklist's automaton ahead of time, so the proxy can map the
+// result instead of building it when it starts:
+//
+//   ./compileBlacklist res/contentBlacklist.txt res/contentBlacklist.bin
+//
+// The output is written next to where it's going and renamed into place,
+// so a running proxy sees one complete change, and anything that already
+// has the old one mapped keeps it until it lets go.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "contentFilter.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Invalid arguments!\n");
+        fprintf(stderr, "Try: %s <Blacklist> <Output>\n", argv[0]);
+        return 1;
+    }
+
+    // cf_create falls back to an empty filter, which isn't worth writing
+    if (access(argv[1], R_OK) != 0) {
+        fprintf(stderr, "Couldn't open blacklist %s\n", argv[1]);
+        return 1;
+    }
+    double start = now();
+    ContentFilter *filter = cf_create(argv[1]);
+    double built = now() - start;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+    if (!cf_save(filter, tmp) || rename(tmp, argv[2]) != 0) {
+        fprintf(stderr, "Couldn't write %s\n", argv[2]);
+        remove(tmp);
+        cf_delete(filter);
+        return 1;
+    }
+
+    printf("%s: %d states x %d classes, %.1f MB, built in %.3fs\n", argv[2], filter->numStates,
+           filter->numClasses, cf_tableBytes(filter) / 1e6, built);
+    cf_delete(filter);
+    return 0;
+}